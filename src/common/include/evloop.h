@@ -0,0 +1,109 @@
+#ifndef _EVLOOP_H_
+# define _EVLOOP_H_
+
+# include <stdint.h>
+# include <signal.h>
+# include <sys/time.h>
+
+# include "list.h"
+
+/*
+ * Minimal select() based event loop.
+ * XXX: So why no libevent? Because I don't want to add dependencies and only a
+ *      small subset of libevent would be used here.
+ *
+ * Callbacks are free to add, pause or mark any object for release (including
+ * the one being run), released objects are freed once dispatching is over.
+ */
+struct evloop {
+    struct list_head events;    /* fd readiness events. */
+    struct list_head timers;    /* Timers, sorted by expiry. */
+    struct list_head signals;   /* Signal events. */
+    struct list_head deferred;  /* Callbacks to run on the next iteration. */
+    int sigpipe[2];             /* Self-pipe signal handlers write to. */
+};
+
+/*
+ * fd readiness.
+ */
+struct event {
+    struct list_head l;
+    struct evloop *loop;
+    int fd;
+    void *arg;
+    int (*ops)(struct event *ev);
+    unsigned int want;  /* Readiness the event waits for, 0 for a dormant event. */
+# define EV_READ     (1U << 0)
+# define EV_WRITE    (1U << 1)
+    unsigned int paused;    /* Readiness put aside by event_pause_fd(). */
+    int release;    /* Used to release events after the main event loop. */
+};
+
+struct event *event_init(struct event *ev, int fd, void *arg,
+                         int (*ev_ops)(struct event *));
+struct event *event_alloc(int fd, void *arg, int (*ev_ops)(struct event *));
+void event_add(struct evloop *loop, struct event *ev);
+void event_del(struct event *ev);
+void event_release(struct event *ev);
+void event_mark_release(struct event *ev);
+/* Stop waiting for input on @fd, without releasing the events. */
+void event_pause_fd(struct evloop *loop, int fd);
+/* Wait for input on @fd again, for the events event_pause_fd() paused. */
+void event_resume_fd(struct evloop *loop, int fd);
+
+/*
+ * Timers, on CLOCK_MONOTONIC. A timer with a period is re-armed after it ran.
+ * A one-shot timer is freed once it ran: timer_cancel() on it afterwards is a
+ * use after free, only cancel one-shot timers known not to have fired yet.
+ */
+struct timer {
+    struct list_head l;
+    uint64_t expires;   /* ns. */
+    uint64_t period;    /* ns, 0 for one-shot timers. */
+    void *arg;
+    int (*ops)(struct timer *t);
+    int release;
+};
+
+struct timer *timer_alloc(uint64_t delay, uint64_t period, void *arg,
+                          int (*t_ops)(struct timer *));
+void timer_add(struct evloop *loop, struct timer *t);
+void timer_cancel(struct timer *t);
+
+/*
+ * Signals, delivered from the loop rather than from the handler.
+ */
+struct evsignal {
+    struct list_head l;
+    int signo;
+    void *arg;
+    int (*ops)(struct evsignal *s);
+    int release;
+    struct sigaction old;
+};
+
+struct evsignal *evsignal_alloc(int signo, void *arg,
+                                int (*s_ops)(struct evsignal *));
+int evsignal_add(struct evloop *loop, struct evsignal *s);
+void evsignal_cancel(struct evsignal *s);
+
+/*
+ * Deferred callbacks, run once at the start of the next evloop_wait().
+ */
+int evloop_defer(struct evloop *loop, void (*fn)(void *), void *arg);
+
+/*
+ * Loop.
+ */
+int evloop_init(struct evloop *loop);
+void evloop_fini(struct evloop *loop);
+/* Dispatch ready events, waiting at most @to. Returns 0 or -errno. */
+int evloop_wait(struct evloop *loop, struct timeval *to);
+uint64_t evloop_now(void);
+
+static inline int evloop_has_events(const struct evloop *loop)
+{
+    return !list_empty(&loop->events);
+}
+
+#endif /* !_EVLOOP_H_ */
@@ -16,6 +16,9 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#ifndef _LIST_H_
+# define _LIST_H_
+
 /*
  * Simple doubly linked list implementation.
  *
@@ -286,3 +289,4 @@ static inline void list_splice_tail(struct list_head *list,
 	     &pos->member != (head); 					\
 	     pos = n, n = list_entry(n->member.next, typeof(*n), member))
 
+#endif /* !_LIST_H_ */
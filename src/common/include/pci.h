@@ -1,7 +1,12 @@
 #ifndef _PCI_H_
 # define _PCI_H_
 
+# include <stddef.h>
+
+# include "list.h"
+
 struct pci_bdf {
+    unsigned int domain;
     unsigned int bus;
     unsigned int slot;
     unsigned int func;
@@ -11,12 +16,25 @@ struct pci_handle {
     int fd;
     void *p;
     size_t len;
+    size_t off;         /* Offset of the mapping in the BAR. */
+    size_t size;        /* Size of the whole BAR. */
+    struct pci_bdf bdf;
+    unsigned int bar;
+    unsigned int flags; /* PCI_BAR_* asked for. */
+    int wc;             /* Mapped write-combined. */
+
+    /* Mapping cache bookkeeping, see pci_get_bar(). */
+    struct list_head l;
+    unsigned int refs;
 };
 
 /*
  * Input parsing helpers.
  */
-/* bdfptr expected to have an /lspci/ like format (%02u:%02x.%1x). */
+/*
+ * bdfptr expected to have an /lspci/ like format (%02x:%02x.%1x), optionally
+ * preceded by the PCI domain (%04x:).
+ */
 int parse_bdf(const char *bdfptr, struct pci_bdf *bdf);
 
 /*
@@ -24,8 +42,53 @@ int parse_bdf(const char *bdfptr, struct pci_bdf *bdf);
  */
 size_t pci_bar_size(const struct pci_bdf *bdf, int bar);
 
-struct pci_handle *pci_open_bar(const struct pci_bdf *bdf, unsigned int bar, size_t len);
+/*
+ * Map the part of BAR @bar holding [@off, @off + @len), returns NULL with errno
+ * set to ERANGE if it goes past the end of the BAR. The window is extended to
+ * page boundaries, or to PCI_WINDOW_HUGE ones (and mapped at an address
+ * aligned the same) when at least that large, so the kernel can use huge
+ * pages. Use pci_bar_ptr() to access it.
+ * With PCI_BAR_WC, the BAR is mapped write-combined through resourceN_wc if
+ * it has one (prefetchable BARs), uncached otherwise; h->wc tells which.
+ */
+# define PCI_WINDOW_HUGE    (2UL << 20)
+
+# define PCI_BAR_WC         0x1
+
+struct pci_handle *pci_open_bar(const struct pci_bdf *bdf, unsigned int bar,
+                                size_t off, size_t len, unsigned int flags);
+/*
+ * Same as pci_open_bar() for any file, e.g a regular file standing in for a
+ * BAR when there is no hardware.
+ */
+struct pci_handle *pci_open_file(const char *path, size_t off, size_t len);
 void pci_close_handle(struct pci_handle *h);
 
+/* Address of offset @off of the BAR, which must be within the mapping. */
+static inline void *pci_bar_ptr(const struct pci_handle *h, size_t off)
+{
+    return (char *)h->p + (off - h->off);
+}
+
+/*
+ * BAR mapping cache.
+ * pci_get_bar() returns a reference on a mapping covering [@off, @off + @len)
+ * of the BAR, created on first use and kept once released with pci_put_bar(),
+ * so accessing the same BAR again costs a lookup. BARs up to
+ * PCI_WINDOW_WHOLE are mapped whole, larger ones in PCI_WINDOW_HUGE windows.
+ * BAR sizes are read from sysfs once. Mappings no longer referenced are
+ * unmapped, least recently used first, when the bytes mapped go over the
+ * limit (PCI_CACHE_LIMIT by default).
+ */
+# define PCI_CACHE_LIMIT    (256UL << 20)
+# define PCI_WINDOW_WHOLE   (16UL << 20)
+
+struct pci_handle *pci_get_bar(const struct pci_bdf *bdf, unsigned int bar,
+                               size_t off, size_t len, unsigned int flags);
+void pci_put_bar(struct pci_handle *h);
+void pci_cache_set_limit(size_t bytes);
+/* Unmap everything not referenced and forget the BAR sizes read. */
+void pci_cache_flush(void);
+
 #endif /* !_PCI_H_ */
 
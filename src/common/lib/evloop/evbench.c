@@ -0,0 +1,192 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+#define M_TAG "evbench: "
+#include <utils.h>
+#include <evloop.h>
+
+/*
+ * Dispatch cost of the event loop, per kind of work:
+ * - events: a byte bounced between two pipes, each hop is one select() and
+ *   one callback,
+ * - timers: one-shot timers due right away, each one arming the next,
+ * - deferred: a callback deferring itself again,
+ * - signals: a handler raising its signal again, each round trip is one
+ *   write to the self-pipe, one select() and one callback.
+ */
+#define EVBENCH_COUNT_DEFAULT   100000UL
+
+static unsigned long left;
+
+/* Forward the byte read to the other pipe. */
+static int evbench_hop(struct event *ev)
+{
+    int *wr = ev->arg;
+    char c;
+
+    if (read(ev->fd, &c, 1) != 1) {
+        return -errno;
+    }
+    if (left) {
+        --left;
+        if (write(*wr, &c, 1) != 1) {
+            return -errno;
+        }
+    }
+    return 1;
+}
+
+static int evbench_timer(struct timer *t)
+{
+    struct evloop *loop = t->arg;
+    struct timer *next;
+
+    if (left) {
+        --left;
+        next = timer_alloc(0, 0, loop, evbench_timer);
+        if (!next) {
+            return -ENOMEM;
+        }
+        timer_add(loop, next);
+    }
+    return 0;
+}
+
+static void evbench_deferred(void *arg)
+{
+    struct evloop *loop = arg;
+
+    if (left) {
+        --left;
+        evloop_defer(loop, evbench_deferred, loop);
+    }
+}
+
+static int evbench_signal(struct evsignal *s)
+{
+    if (left) {
+        --left;
+        raise(s->signo);
+    }
+    return 0;
+}
+
+static int evbench_run(struct evloop *loop, const char *what, unsigned long n)
+{
+    struct timeval to = { .tv_sec = 1, .tv_usec = 0 };
+    uint64_t start;
+    int rc = 0;
+
+    start = evloop_now();
+    while (left && !rc) {
+        rc = evloop_wait(loop, &to);
+    }
+    if (rc) {
+        ERR("%s: evloop_wait() failed (%s).", what, strerror(-rc));
+        return rc;
+    }
+    INF("%s: %lu dispatches, %.0fns each.", what, n,
+        (double)(evloop_now() - start) / n);
+    return 0;
+}
+
+static int evbench_events(struct evloop *loop, unsigned long n)
+{
+    struct event *ev[2];
+    int a[2], b[2], i, rc;
+    char c = 0;
+
+    if (pipe(a)) {
+        return -errno;
+    }
+    if (pipe(b)) {
+        close(a[0]);
+        close(a[1]);
+        return -errno;
+    }
+    ev[0] = event_alloc(a[0], &b[1], evbench_hop);
+    ev[1] = event_alloc(b[0], &a[1], evbench_hop);
+    if (!ev[0] || !ev[1]) {
+        free(ev[0]);
+        free(ev[1]);
+        close(a[0]);
+        close(a[1]);
+        close(b[0]);
+        close(b[1]);
+        return -ENOMEM;
+    }
+    event_add(loop, ev[0]);
+    event_add(loop, ev[1]);
+
+    left = n;
+    rc = (write(a[1], &c, 1) == 1) ? evbench_run(loop, "events", n) : -errno;
+
+    for (i = 0; i < 2; ++i) {
+        event_del(ev[i]);
+        event_release(ev[i]);
+    }
+    close(a[0]);
+    close(a[1]);
+    close(b[0]);
+    close(b[1]);
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    struct evloop loop;
+    struct timer *t;
+    unsigned long n = EVBENCH_COUNT_DEFAULT;
+    int rc;
+
+    if (argc > 1 && (parse_ul(argv[1], &n) || !n)) {
+        ERR("usage: %s [count]", argv[0]);
+        return EINVAL;
+    }
+
+    rc = evloop_init(&loop);
+    if (rc) {
+        ERR("evloop_init() failed (%s).", strerror(-rc));
+        return -rc;
+    }
+
+    rc = evbench_events(&loop, n);
+
+    if (!rc) {
+        t = timer_alloc(0, 0, &loop, evbench_timer);
+        if (!t) {
+            rc = -ENOMEM;
+        } else {
+            left = n;
+            timer_add(&loop, t);
+            rc = evbench_run(&loop, "timers", n);
+        }
+    }
+
+    if (!rc) {
+        left = n;
+        rc = evloop_defer(&loop, evbench_deferred, &loop);
+        if (!rc) {
+            rc = evbench_run(&loop, "deferred", n);
+        }
+    }
+
+    if (!rc) {
+        struct evsignal *s = evsignal_alloc(SIGUSR1, NULL, evbench_signal);
+
+        rc = s ? evsignal_add(&loop, s) : -ENOMEM;
+        if (!rc) {
+            left = n;
+            raise(SIGUSR1);
+            rc = evbench_run(&loop, "signals", n);
+            evsignal_cancel(s);
+        } else {
+            free(s);
+        }
+    }
+
+    evloop_fini(&loop);
+    return -rc;
+}
@@ -0,0 +1,425 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/select.h>
+
+#include <evloop.h>
+
+uint64_t evloop_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * fd readiness.
+ */
+struct event *event_init(struct event *ev, int fd, void *arg,
+                         int (*ev_ops)(struct event *))
+{
+    ev->loop = NULL;
+    ev->fd = fd;
+    ev->arg = arg;
+    ev->ops = ev_ops;
+    ev->want = EV_READ;
+    ev->paused = 0;
+    ev->release = 0;
+    INIT_LIST_HEAD(&ev->l);
+    return ev;
+}
+
+struct event *event_alloc(int fd, void *arg, int (*ev_ops)(struct event *))
+{
+    struct event *ev;
+
+    ev = malloc(sizeof (*ev));
+    if (!ev) {
+        return NULL;
+    }
+    return event_init(ev, fd, arg, ev_ops);
+}
+
+void event_add(struct evloop *loop, struct event *ev)
+{
+    ev->loop = loop;
+    list_add_tail(&ev->l, &loop->events);
+}
+
+void event_del(struct event *ev)
+{
+    list_del(&ev->l);
+}
+
+void event_release(struct event *ev)
+{
+    free(ev);
+}
+
+void event_mark_release(struct event *ev)
+{
+    ev->release = 1;
+}
+
+void event_pause_fd(struct evloop *loop, int fd)
+{
+    struct event *ev;
+
+    list_for_each_entry(ev, &loop->events, l) {
+        if (ev->fd == fd) {
+            ev->paused |= ev->want & EV_READ;
+            ev->want &= ~EV_READ;
+        }
+    }
+}
+
+void event_resume_fd(struct evloop *loop, int fd)
+{
+    struct event *ev;
+
+    list_for_each_entry(ev, &loop->events, l) {
+        if (ev->fd == fd) {
+            ev->want |= ev->paused;
+            ev->paused = 0;
+        }
+    }
+}
+
+/*
+ * Timers.
+ */
+struct timer *timer_alloc(uint64_t delay, uint64_t period, void *arg,
+                          int (*t_ops)(struct timer *))
+{
+    struct timer *t;
+
+    t = malloc(sizeof (*t));
+    if (!t) {
+        return NULL;
+    }
+    INIT_LIST_HEAD(&t->l);
+    t->expires = delay;     /* Relative until timer_add(). */
+    t->period = period;
+    t->arg = arg;
+    t->ops = t_ops;
+    t->release = 0;
+    return t;
+}
+
+static void __timer_insert(struct evloop *loop, struct timer *t)
+{
+    struct timer *pos;
+
+    list_for_each_entry(pos, &loop->timers, l) {
+        if (pos->expires > t->expires) {
+            break;
+        }
+    }
+    list_add_tail(&t->l, &pos->l);
+}
+
+void timer_add(struct evloop *loop, struct timer *t)
+{
+    t->expires += evloop_now();
+    __timer_insert(loop, t);
+}
+
+void timer_cancel(struct timer *t)
+{
+    t->release = 1;
+}
+
+static void timers_run(struct evloop *loop)
+{
+    struct timer *t, *tt;
+    struct list_head rearm;
+    uint64_t now = evloop_now();
+
+    INIT_LIST_HEAD(&rearm);
+    list_for_each_entry_safe(t, tt, &loop->timers, l) {
+        if (t->expires > now) {
+            break;
+        }
+        list_del(&t->l);
+        if (!t->release) {
+            t->ops(t);
+        }
+        if (t->period && !t->release) {
+            /* Skip missed periods rather than running them in a burst. */
+            do {
+                t->expires += t->period;
+            } while (t->expires <= now);
+            list_add_tail(&t->l, &rearm);
+        } else {
+            free(t);
+        }
+    }
+    while (!list_empty(&rearm)) {
+        t = list_entry(rearm.next, struct timer, l);
+        list_del(&t->l);
+        __timer_insert(loop, t);
+    }
+    /* Cancelled timers not due yet. */
+    list_for_each_entry_safe(t, tt, &loop->timers, l) {
+        if (t->release) {
+            list_del(&t->l);
+            free(t);
+        }
+    }
+}
+
+/*
+ * Signals.
+ * Handlers only write the signal number in the self-pipe of the loop that
+ * registered them, so only one loop per process can handle signals.
+ */
+static int sigpipe_wr = -1;
+
+static void evsignal_handler(int signo)
+{
+    unsigned char c = signo;
+    int e = errno;
+
+    if (write(sigpipe_wr, &c, 1) < 0) {
+        /* Pipe full, the loop has enough to do already. */
+    }
+    errno = e;
+}
+
+struct evsignal *evsignal_alloc(int signo, void *arg,
+                                int (*s_ops)(struct evsignal *))
+{
+    struct evsignal *s;
+
+    s = malloc(sizeof (*s));
+    if (!s) {
+        return NULL;
+    }
+    INIT_LIST_HEAD(&s->l);
+    s->signo = signo;
+    s->arg = arg;
+    s->ops = s_ops;
+    s->release = 0;
+    return s;
+}
+
+int evsignal_add(struct evloop *loop, struct evsignal *s)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof (sa));
+    sa.sa_handler = evsignal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigpipe_wr = loop->sigpipe[1];
+    if (sigaction(s->signo, &sa, &s->old)) {
+        return -errno;
+    }
+    list_add_tail(&s->l, &loop->signals);
+    return 0;
+}
+
+void evsignal_cancel(struct evsignal *s)
+{
+    s->release = 1;
+}
+
+static void __evsignal_release(struct evsignal *s)
+{
+    sigaction(s->signo, &s->old, NULL);
+    list_del(&s->l);
+    free(s);
+}
+
+static void signals_run(struct evloop *loop)
+{
+    unsigned char sigs[64];
+    struct evsignal *s, *ts;
+    ssize_t i, n;
+
+    n = read(loop->sigpipe[0], sigs, sizeof (sigs));
+    for (i = 0; i < n; ++i) {
+        list_for_each_entry(s, &loop->signals, l) {
+            if (s->signo == sigs[i] && !s->release) {
+                s->ops(s);
+            }
+        }
+    }
+    list_for_each_entry_safe(s, ts, &loop->signals, l) {
+        if (s->release) {
+            __evsignal_release(s);
+        }
+    }
+}
+
+/*
+ * Deferred callbacks.
+ */
+struct deferred {
+    struct list_head l;
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+int evloop_defer(struct evloop *loop, void (*fn)(void *), void *arg)
+{
+    struct deferred *d;
+
+    d = malloc(sizeof (*d));
+    if (!d) {
+        return -ENOMEM;
+    }
+    d->fn = fn;
+    d->arg = arg;
+    list_add_tail(&d->l, &loop->deferred);
+    return 0;
+}
+
+static void deferred_run(struct evloop *loop)
+{
+    struct list_head run;
+    struct deferred *d;
+
+    if (list_empty(&loop->deferred)) {
+        return;
+    }
+    /* Callbacks deferred from here run on the next iteration. */
+    INIT_LIST_HEAD(&run);
+    list_splice_tail(&loop->deferred, &run);
+    INIT_LIST_HEAD(&loop->deferred);
+    while (!list_empty(&run)) {
+        d = list_entry(run.next, struct deferred, l);
+        list_del(&d->l);
+        d->fn(d->arg);
+        free(d);
+    }
+}
+
+/*
+ * Loop.
+ */
+int evloop_init(struct evloop *loop)
+{
+    int i;
+
+    INIT_LIST_HEAD(&loop->events);
+    INIT_LIST_HEAD(&loop->timers);
+    INIT_LIST_HEAD(&loop->signals);
+    INIT_LIST_HEAD(&loop->deferred);
+    if (pipe(loop->sigpipe)) {
+        return -errno;
+    }
+    for (i = 0; i < 2; ++i) {
+        fcntl(loop->sigpipe[i], F_SETFL, fcntl(loop->sigpipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(loop->sigpipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    return 0;
+}
+
+void evloop_fini(struct evloop *loop)
+{
+    struct event *ev;
+    struct timer *t;
+    struct deferred *d;
+
+    while (!list_empty(&loop->events)) {
+        ev = list_entry(loop->events.next, struct event, l);
+        event_del(ev);
+        event_release(ev);
+    }
+    while (!list_empty(&loop->timers)) {
+        t = list_entry(loop->timers.next, struct timer, l);
+        list_del(&t->l);
+        free(t);
+    }
+    while (!list_empty(&loop->signals)) {
+        __evsignal_release(list_entry(loop->signals.next, struct evsignal, l));
+    }
+    while (!list_empty(&loop->deferred)) {
+        d = list_entry(loop->deferred.next, struct deferred, l);
+        list_del(&d->l);
+        free(d);
+    }
+    if (sigpipe_wr == loop->sigpipe[1]) {
+        sigpipe_wr = -1;
+    }
+    close(loop->sigpipe[0]);
+    close(loop->sigpipe[1]);
+}
+
+int evloop_wait(struct evloop *loop, struct timeval *to)
+{
+    fd_set rfds, wfds;
+    int n, nfds;
+    struct event *ev = NULL, *tev = NULL;
+    struct timeval __to = { .tv_sec = to->tv_sec, .tv_usec = to->tv_usec };
+
+    deferred_run(loop);
+    if (!list_empty(&loop->deferred)) {
+        __to.tv_sec = __to.tv_usec = 0;
+    }
+    if (!list_empty(&loop->timers)) {
+        struct timer *t = list_entry(loop->timers.next, struct timer, l);
+        uint64_t now = evloop_now(), wait;
+
+        wait = (t->expires > now) ? t->expires - now : 0;
+        if (wait < __to.tv_sec * 1000000000ULL + __to.tv_usec * 1000ULL) {
+            __to.tv_sec = wait / 1000000000ULL;
+            __to.tv_usec = (wait % 1000000000ULL + 999) / 1000;
+        }
+    }
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_SET(loop->sigpipe[0], &rfds);
+    nfds = loop->sigpipe[0];
+    list_for_each_entry_safe(ev, tev, &loop->events, l) {
+        if (ev->release || !ev->want) {
+            continue;
+        }
+        if (ev->want & EV_READ) {
+            FD_SET(ev->fd, &rfds);
+        }
+        if (ev->want & EV_WRITE) {
+            FD_SET(ev->fd, &wfds);
+        }
+        nfds = (nfds < ev->fd) ? ev->fd : nfds;
+    }
+    n = select(nfds + 1, &rfds, &wfds, NULL, &__to);
+    if (n < 0) {
+        return -errno;
+    }
+
+    if (FD_ISSET(loop->sigpipe[0], &rfds)) {
+        signals_run(loop);
+    }
+    /*
+     * Several events can share an fd (reader and flusher of a socket), so
+     * every event is checked rather than stopping after n of them.
+     */
+    list_for_each_entry_safe(ev, tev, &loop->events, l) {
+        /* Events can be released or paused by the ones that ran before. */
+        if (ev->release || !ev->want) {
+            continue;
+        }
+        if (((ev->want & EV_READ) && FD_ISSET(ev->fd, &rfds)) ||
+            ((ev->want & EV_WRITE) && FD_ISSET(ev->fd, &wfds))) {
+            ev->ops(ev);
+        }
+    }
+    timers_run(loop);
+
+    /* Release marked events. */
+    list_for_each_entry_safe(ev, tev, &loop->events, l) {
+        if (ev->release) {
+            event_del(ev);
+            event_release(ev);
+        }
+    }
+
+    return 0;
+}
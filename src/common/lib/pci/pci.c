@@ -4,21 +4,35 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <stdint.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <pci.h>
 
-/* bdfptr expected to have an /lspci/ like format (%02u:%02x.%1x). */
+/*
+ * bdfptr expected to have an /lspci/ like format (%02x:%02x.%1x), optionally
+ * preceded by the PCI domain (%04x:).
+ */
 int parse_bdf(const char *bdfptr, struct pci_bdf *bdf)
 {
     unsigned long values[3];
-    unsigned int bases[3] = { 10, 16, 16 };
+    unsigned long domain = 0;
+    unsigned int bases[3] = { 16, 16, 16 };
     unsigned int offsets[3] = { 0, 3, 6 };
     unsigned int i;
+    char *end;
 
-    for (i = 0; i < 3; ++i) {
-        char *end;
+    if (strlen(bdfptr) > 4 && bdfptr[4] == ':') {
+        domain = strtoul(bdfptr, &end, 16);
+        if (end != bdfptr + 4 || domain > 0xffff) {
+            return -EINVAL;
+        }
+        bdfptr += 5;
+    }
 
+    for (i = 0; i < 3; ++i) {
         values[i] = strtoul(bdfptr + offsets[i], &end, bases[i]);
         if (values[i] == ULONG_MAX) {
             return -ERANGE;
@@ -30,6 +44,7 @@ int parse_bdf(const char *bdfptr, struct pci_bdf *bdf)
     if (values[0] & ~0xff || values[1] & ~0x1f || values[2] & ~0x7) {
         return -EINVAL;
     }
+    bdf->domain = domain;
     bdf->bus = values[0];
     bdf->slot = values[1];
     bdf->func = values[2];
@@ -39,6 +54,16 @@ int parse_bdf(const char *bdfptr, struct pci_bdf *bdf)
 /*
  * PCI resources helpers.
  */
+static size_t pci_page_size(void)
+{
+    static size_t page = 0;
+
+    if (!page) {
+        page = sysconf(_SC_PAGESIZE);
+    }
+    return page;
+}
+
 #define RES_LINE_LEN    57
 size_t pci_bar_size(const struct pci_bdf *bdf, int bar)
 {
@@ -48,8 +73,8 @@ size_t pci_bar_size(const struct pci_bdf *bdf, int bar)
     size_t size = 0;
     unsigned long addr, mask, flags;
 
-    sprintf(syspath, "/sys/class/pci_bus/%04u:%02u/device/%04u:%02u:%02x.%1x/resource",
-            0 /* domain */, bdf->bus, 0 /* domain */, bdf->bus, bdf->slot, bdf->func);
+    sprintf(syspath, "/sys/class/pci_bus/%04x:%02x/device/%04x:%02x:%02x.%1x/resource",
+            bdf->domain, bdf->bus, bdf->domain, bdf->bus, bdf->slot, bdf->func);
     fd = open(syspath, O_RDONLY);
     if (fd < 0) {
         perror("open");
@@ -77,38 +102,130 @@ out:
     return size;
 }
 
-struct pci_handle *pci_open_bar(const struct pci_bdf *bdf, unsigned int bar, size_t len)
+/* Map @len bytes of @fd at @off, at a virtual address aligned on @align. */
+static void *pci_map_aligned(int fd, off_t off, size_t len, size_t align)
+{
+    uint8_t *area, *p;
+
+    if (align <= pci_page_size()) {
+        return mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, off);
+    }
+    /* Reserve enough to find an aligned spot, map there, trim the rest. */
+    area = mmap(NULL, len + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    p = (uint8_t *)(((uintptr_t)area + align - 1) & ~(uintptr_t)(align - 1));
+    if (mmap(p, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, off) == MAP_FAILED) {
+        munmap(area, len + align);
+        return MAP_FAILED;
+    }
+    if (p > area) {
+        munmap(area, p - area);
+    }
+    munmap(p + len, area + len + align - (p + len));
+    return p;
+}
+
+/* Map the window around [off, off + len) of the @size bytes resource @path. */
+static struct pci_handle *pci_map_resource(const char *path, size_t size,
+                                           size_t off, size_t len)
 {
     struct pci_handle *h;
-    char syspath[256];
+    size_t page = pci_page_size(), align, start, end;
     int fd;
     void *p;
 
-    sprintf(syspath, "/sys/class/pci_bus/%04u:%02u/device/%04u:%02u:%02x.%1x/resource%u",
-            0 /* domain */, bdf->bus, 0 /* domain */, bdf->bus, bdf->slot, bdf->func, bar);
-    fd = open(syspath, O_RDWR | O_SYNC);
+    if (!len || off >= size || len > size - off) {
+        errno = ERANGE;
+        return NULL;
+    }
+    align = (len >= PCI_WINDOW_HUGE) ? PCI_WINDOW_HUGE : page;
+    start = off & ~(align - 1);
+    end = (off + len + align - 1) & ~(align - 1);
+    /* sysfs allows mapping up to the BAR size rounded to a page. */
+    if (end > ((size + page - 1) & ~(page - 1))) {
+        end = (size + page - 1) & ~(page - 1);
+    }
+
+    fd = open(path, O_RDWR | O_SYNC);
     if (fd < 0) {
         perror("open");
         return NULL;
     }
-    p = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    p = pci_map_aligned(fd, start, end - start, align);
     if (p == MAP_FAILED || !p) {
         perror("mmap");
         close(fd);
         return NULL;
     }
 
-    h = malloc(sizeof (*h));
+    h = calloc(1, sizeof (*h));
     if (!h) {
+        munmap(p, end - start);
         close(fd);
         return NULL;
     }
     h->fd = fd;
-    h->len = len;
+    h->len = end - start;
+    h->off = start;
     h->p = p;
+    h->size = size;
+    return h;
+}
+
+static struct pci_handle *__pci_open_bar(const struct pci_bdf *bdf, unsigned int bar,
+                                         size_t size, size_t off, size_t len,
+                                         unsigned int flags)
+{
+    struct pci_handle *h;
+    char syspath[256];
+    int wc = 0;
+
+    sprintf(syspath, "/sys/class/pci_bus/%04x:%02x/device/%04x:%02x:%02x.%1x/resource%u",
+            bdf->domain, bdf->bus, bdf->domain, bdf->bus, bdf->slot, bdf->func, bar);
+    /* Only prefetchable BARs have a write-combined resource. */
+    if (flags & PCI_BAR_WC) {
+        strcat(syspath, "_wc");
+        wc = !access(syspath, F_OK);
+        if (!wc) {
+            syspath[strlen(syspath) - 3] = '\0';
+        }
+    }
+    h = pci_map_resource(syspath, size, off, len);
+    if (h) {
+        h->bdf = *bdf;
+        h->bar = bar;
+        h->flags = flags;
+        h->wc = wc;
+    }
     return h;
 }
 
+struct pci_handle *pci_open_bar(const struct pci_bdf *bdf, unsigned int bar,
+                                size_t off, size_t len, unsigned int flags)
+{
+    size_t size;
+
+    size = pci_bar_size(bdf, bar);
+    if (!size) {
+        errno = EIO;
+        return NULL;
+    }
+    return __pci_open_bar(bdf, bar, size, off, len, flags);
+}
+
+struct pci_handle *pci_open_file(const char *path, size_t off, size_t len)
+{
+    struct stat st;
+
+    if (stat(path, &st)) {
+        perror("stat");
+        return NULL;
+    }
+    return pci_map_resource(path, st.st_size, off, len);
+}
+
 void pci_close_handle(struct pci_handle *h)
 {
     if (munmap(h->p, h->len)) {
@@ -120,3 +237,150 @@ void pci_close_handle(struct pci_handle *h)
     free(h);
 }
 
+/*
+ * BAR mapping cache.
+ *
+ * BARs up to PCI_WINDOW_WHOLE are mapped whole, larger ones in windows of
+ * PCI_WINDOW_HUGE around what is accessed. Entries are kept in most recently
+ * used order.
+ */
+static LIST_HEAD(pci_cache);
+static size_t pci_cache_mapped = 0;
+static size_t pci_cache_limit = PCI_CACHE_LIMIT;
+
+/* Sizes of the BARs seen so far, sysfs is only read once for each. */
+struct pci_bar_info {
+    struct list_head l;
+    struct pci_bdf bdf;
+    unsigned int bar;
+    size_t size;
+};
+static LIST_HEAD(pci_bar_infos);
+
+static int pci_bdf_equal(const struct pci_bdf *a, const struct pci_bdf *b)
+{
+    return a->domain == b->domain && a->bus == b->bus &&
+           a->slot == b->slot && a->func == b->func;
+}
+
+static size_t pci_cached_bar_size(const struct pci_bdf *bdf, unsigned int bar)
+{
+    struct pci_bar_info *bi;
+
+    list_for_each_entry(bi, &pci_bar_infos, l) {
+        if (bi->bar == bar && pci_bdf_equal(&bi->bdf, bdf)) {
+            return bi->size;
+        }
+    }
+    bi = calloc(1, sizeof (*bi));
+    if (!bi) {
+        return 0;
+    }
+    bi->bdf = *bdf;
+    bi->bar = bar;
+    bi->size = pci_bar_size(bdf, bar);
+    if (!bi->size) {
+        free(bi);
+        return 0;
+    }
+    list_add(&bi->l, &pci_bar_infos);
+    return bi->size;
+}
+
+static void pci_cache_drop(struct pci_handle *h)
+{
+    pci_cache_mapped -= h->len;
+    list_del(&h->l);
+    pci_close_handle(h);
+}
+
+/* Unmap idle entries, least recently used first, until under the limit. */
+static void pci_cache_shrink(size_t limit)
+{
+    struct pci_handle *h, *prev;
+
+    for (h = list_entry(pci_cache.prev, struct pci_handle, l);
+         &h->l != &pci_cache && pci_cache_mapped > limit; h = prev) {
+        prev = list_entry(h->l.prev, struct pci_handle, l);
+        if (!h->refs) {
+            pci_cache_drop(h);
+        }
+    }
+}
+
+struct pci_handle *pci_get_bar(const struct pci_bdf *bdf, unsigned int bar,
+                               size_t off, size_t len, unsigned int flags)
+{
+    struct pci_handle *h;
+    size_t size, woff, wlen;
+
+    list_for_each_entry(h, &pci_cache, l) {
+        /* Windows are rounded up, so check the BAR itself as well. */
+        if (h->bar == bar && h->flags == flags && pci_bdf_equal(&h->bdf, bdf) &&
+            len && off < h->size && len <= h->size - off &&
+            off >= h->off && len <= h->len && off - h->off <= h->len - len) {
+            ++h->refs;
+            /* Most recently used first. */
+            list_del(&h->l);
+            list_add(&h->l, &pci_cache);
+            return h;
+        }
+    }
+
+    size = pci_cached_bar_size(bdf, bar);
+    if (!size) {
+        errno = EIO;
+        return NULL;
+    }
+    if (!len || off >= size || len > size - off) {
+        errno = ERANGE;
+        return NULL;
+    }
+    if (size <= PCI_WINDOW_WHOLE) {
+        woff = 0;
+        wlen = size;
+    } else {
+        woff = off & ~(PCI_WINDOW_HUGE - 1);
+        wlen = ((off + len + PCI_WINDOW_HUGE - 1) & ~(PCI_WINDOW_HUGE - 1)) - woff;
+        if (wlen > size - woff) {
+            wlen = size - woff;
+        }
+    }
+
+    pci_cache_shrink(pci_cache_limit > wlen ? pci_cache_limit - wlen : 0);
+    h = __pci_open_bar(bdf, bar, size, woff, wlen, flags);
+    if (!h) {
+        return NULL;
+    }
+    h->refs = 1;
+    pci_cache_mapped += h->len;
+    list_add(&h->l, &pci_cache);
+    return h;
+}
+
+void pci_put_bar(struct pci_handle *h)
+{
+    if (!h || !h->refs) {
+        return;
+    }
+    if (!--h->refs && pci_cache_mapped > pci_cache_limit) {
+        pci_cache_shrink(pci_cache_limit);
+    }
+}
+
+void pci_cache_set_limit(size_t bytes)
+{
+    pci_cache_limit = bytes;
+    pci_cache_shrink(pci_cache_limit);
+}
+
+void pci_cache_flush(void)
+{
+    struct pci_bar_info *bi, *tbi;
+
+    pci_cache_shrink(0);
+    list_for_each_entry_safe(bi, tbi, &pci_bar_infos, l) {
+        list_del(&bi->l);
+        free(bi);
+    }
+}
@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define M_TAG "xcbench: "
+#include <utils.h>
+#include "xenctrl.h"
+
+/*
+ * Benchmark driver for the simulated libxc.
+ *
+ * Times the paths of the tools that talk to the hypervisor against the mock:
+ * - the console ring read path, straight from the mock first as a baseline,
+ *   then through a one-shot condump (read_console()) and a condump -f
+ *   following a busy console for a while (follow_poll()),
+ * - MSI injection, straight from the mock first, then through a poke batch
+ *   of msi commands (poke -f).
+ * The tools are run as children, the mock is set up through its environment.
+ */
+#define XCBENCH_RING_SIZE   MB(16UL)
+#define XCBENCH_LINE_MIN    48          /* Shortest mock console line. */
+#define XCBENCH_READ_SIZE   KB(64)
+#define XCBENCH_FOLLOW_RATE 200000      /* Lines per second. */
+#define XCBENCH_FOLLOW_TIME 2           /* s */
+#define XCBENCH_MSI_COUNT   100000UL
+#define XCBENCH_MSI_LINE    "msi 1 0xfee00000 0x4041\n"
+
+static uint64_t xcbench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Mock console ring, full when @prefill is set, producing @rate lines/s. */
+static void xcbench_env(int prefill, unsigned long rate)
+{
+    char v[32];
+
+    snprintf(v, sizeof (v), "%lu", XCBENCH_RING_SIZE);
+    setenv("XCMOCK_RING_SIZE", v, 1);
+    /* Enough lines to wrap the ring. */
+    snprintf(v, sizeof (v), "%lu", prefill ? XCBENCH_RING_SIZE / XCBENCH_LINE_MIN : 0);
+    setenv("XCMOCK_PREFILL", v, 1);
+    snprintf(v, sizeof (v), "%lu", rate);
+    setenv("XCMOCK_RATE", v, 1);
+    unsetenv("XCMOCK_MSI_LOG");
+}
+
+/*
+ * Run @argv with stdin from @in (NULL for /dev/null), stdout to /dev/null or
+ * to a pipe *@out is set to the read end of.
+ */
+static pid_t xcbench_spawn(char *const argv[], const char *in, int *out)
+{
+    int p[2] = { -1, -1 };
+    pid_t pid;
+
+    if (out && pipe(p)) {
+        return -errno;
+    }
+    pid = fork();
+    if (pid < 0) {
+        pid = -errno;
+        if (out) {
+            close(p[0]);
+            close(p[1]);
+        }
+        return pid;
+    }
+    if (!pid) {
+        int fd;
+
+        fd = open(in ? in : "/dev/null", O_RDONLY);
+        if (fd < 0 || dup2(fd, STDIN_FILENO) < 0) {
+            _exit(127);
+        }
+        fd = out ? p[1] : open("/dev/null", O_WRONLY);
+        if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+            _exit(127);
+        }
+        if (out) {
+            close(p[0]);
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    if (out) {
+        close(p[1]);
+        *out = p[0];
+    }
+    return pid;
+}
+
+static int xcbench_wait(pid_t pid, const char *what)
+{
+    int status;
+
+    if (waitpid(pid, &status, 0) < 0) {
+        return -errno;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        ERR("%s failed (status %#x).", what, status);
+        return -ECHILD;
+    }
+    return 0;
+}
+
+static void xcbench_report(const char *what, uint64_t ns, double n, const char *unit)
+{
+    INF("%-24s %10.1fms %12.0f %s/s", what, ns / 1e6, n * 1e9 / ns, unit);
+}
+
+/*
+ * Baseline: drain the prefilled mock ring in-process. Prefilling is timed
+ * apart, the tools pay for it when they open the interface.
+ */
+static int xcbench_ring(void)
+{
+    xc_interface *xch;
+    char *buf;
+    unsigned int n, index = 0;
+    uint64_t t, total = 0;
+
+    xcbench_env(1, 0);
+    t = xcbench_now();
+    xch = xc_interface_open(NULL, NULL, 0);
+    if (!xch) {
+        return -errno;
+    }
+    t = xcbench_now() - t;
+    xcbench_report("mock ring prefill", t, XCBENCH_RING_SIZE / (double)MB(1), "MB");
+    buf = m_malloc(XCBENCH_READ_SIZE);
+    t = xcbench_now();
+    do {
+        n = XCBENCH_READ_SIZE;
+        if (xc_readconsolering(xch, buf, &n, 0, 1, &index) < 0) {
+            free(buf);
+            xc_interface_close(xch);
+            return -errno;
+        }
+        total += n;
+    } while (n == XCBENCH_READ_SIZE);
+    t = xcbench_now() - t;
+    free(buf);
+    xc_interface_close(xch);
+    xcbench_report("mock ring read", t, total / (double)MB(1), "MB");
+    return 0;
+}
+
+/* One-shot condump of the same ring. */
+static int xcbench_condump(const char *condump)
+{
+    char *argv[] = { (char *)condump, NULL };
+    uint64_t t;
+    pid_t pid;
+    int rc;
+
+    xcbench_env(1, 0);
+    t = xcbench_now();
+    pid = xcbench_spawn(argv, NULL, NULL);
+    if (pid < 0) {
+        return pid;
+    }
+    rc = xcbench_wait(pid, condump);
+    t = xcbench_now() - t;
+    if (!rc) {
+        xcbench_report("condump", t, XCBENCH_RING_SIZE / (double)MB(1), "MB");
+    }
+    return rc;
+}
+
+/* condump -f following a busy console, counting what it outputs. */
+static int xcbench_follow(const char *condump)
+{
+    char *argv[] = { (char *)condump, "-f", NULL };
+    char buf[XCBENCH_READ_SIZE];
+    uint64_t t, end, total = 0;
+    ssize_t n;
+    pid_t pid;
+    int fd, rc, stopped = 0;
+
+    xcbench_env(0, XCBENCH_FOLLOW_RATE);
+    t = xcbench_now();
+    end = t + XCBENCH_FOLLOW_TIME * 1000000000ULL;
+    pid = xcbench_spawn(argv, NULL, &fd);
+    if (pid < 0) {
+        return pid;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    for (;;) {
+        n = read(fd, buf, sizeof (buf));
+        if (n > 0) {
+            total += n;
+        } else if (!n) {
+            break;
+        } else if (errno != EAGAIN && errno != EINTR) {
+            break;
+        } else {
+            usleep(1000);
+        }
+        if (!stopped && xcbench_now() >= end) {
+            kill(pid, SIGINT);
+            stopped = 1;
+        }
+    }
+    close(fd);
+    rc = xcbench_wait(pid, condump);
+    t = xcbench_now() - t;
+    if (!rc) {
+        xcbench_report("condump -f", t, total / (double)MB(1), "MB");
+    }
+    return rc;
+}
+
+/* Baseline: MSI injection in-process. */
+static int xcbench_msi(unsigned long count)
+{
+    xc_interface *xch;
+    unsigned long i;
+    uint64_t t;
+
+    xcbench_env(0, 0);
+    xch = xc_interface_open(NULL, NULL, 0);
+    if (!xch) {
+        return -errno;
+    }
+    t = xcbench_now();
+    for (i = 0; i < count; ++i) {
+        if (xc_hvm_inject_msi(xch, 1, 0xfee00000, 0x4041)) {
+            xc_interface_close(xch);
+            return -errno;
+        }
+    }
+    t = xcbench_now() - t;
+    xc_interface_close(xch);
+    xcbench_report("mock msi", t, count, "msi");
+    return 0;
+}
+
+/* poke batch of @count msi commands. */
+static int xcbench_poke(const char *poke, unsigned long count)
+{
+    char path[] = "/tmp/xcbench.XXXXXX";
+    char *argv[] = { (char *)poke, "-f", "-", NULL };
+    unsigned long i;
+    uint64_t t;
+    FILE *f;
+    pid_t pid;
+    int fd, rc;
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        return -errno;
+    }
+    f = fdopen(fd, "w");
+    if (!f) {
+        rc = -errno;
+        close(fd);
+        unlink(path);
+        return rc;
+    }
+    for (i = 0; i < count; ++i) {
+        fputs(XCBENCH_MSI_LINE, f);
+    }
+    if (fclose(f)) {
+        rc = -errno;
+        unlink(path);
+        return rc;
+    }
+
+    xcbench_env(0, 0);
+    t = xcbench_now();
+    pid = xcbench_spawn(argv, path, NULL);
+    rc = (pid < 0) ? pid : xcbench_wait(pid, poke);
+    t = xcbench_now() - t;
+    unlink(path);
+    if (!rc) {
+        xcbench_report("poke -f msi", t, count, "msi");
+    }
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *condump = (argc > 1) ? argv[1] : "src/condump/condump";
+    const char *poke = (argc > 2) ? argv[2] : "src/poke/poke";
+    unsigned long count = XCBENCH_MSI_COUNT;
+    int rc;
+
+    if (argc > 4 || (argc > 3 && (parse_ul(argv[3], &count) || !count))) {
+        ERR("usage: %s [condump [poke [msi-count]]]", argv[0]);
+        return EINVAL;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    rc = xcbench_ring();
+    if (!rc) {
+        rc = xcbench_condump(condump);
+    }
+    if (!rc) {
+        rc = xcbench_follow(condump);
+    }
+    if (!rc) {
+        rc = xcbench_msi(count);
+    }
+    if (!rc) {
+        rc = xcbench_poke(poke, count);
+    }
+    if (rc) {
+        ERR("Benchmark failed (%s).", strerror(-rc));
+    }
+    return -rc;
+}
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <utils.h>
+#include "xenctrl.h"
+
+/*
+ * Simulated hypervisor console ring.
+ *
+ * Like Xen's conring, the producer and consumer positions are free running
+ * and the ring offset is taken modulo its size, so incremental reads see the
+ * same index arithmetic (and the same losses on wraparound) as on a host.
+ * Lines are generated lazily on each read, as many as the rate says should
+ * have been logged since the first open.
+ */
+#define XCMOCK_RING_DEFAULT KB(16)
+#define XCMOCK_LINE_MAX     128
+
+struct xc_interface_core {
+    unsigned int refs;
+};
+
+static struct xc_interface_core xcmock = { 0 };
+
+static struct {
+    char *buf;
+    uint32_t size;
+    uint32_t prod;
+    uint32_t cons;
+    double rate;            /* Lines per second. */
+    uint64_t start;         /* ns, first open. */
+    unsigned long long lines;
+} conring;
+
+static struct xcmock_msi *msis = NULL;
+static unsigned int msis_len = 0, msis_size = 0;
+static FILE *msi_log = NULL;
+
+static uint64_t xcmock_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long env_ul(const char *name, unsigned long def)
+{
+    const char *v = getenv(name);
+
+    return v ? strtoul(v, NULL, 0) : def;
+}
+
+static void conring_put_line(uint64_t now)
+{
+    char line[XCMOCK_LINE_MAX];
+    uint64_t t = now - conring.start;
+    int i, n;
+
+    n = snprintf(line, sizeof (line), "(XEN) [%6llu.%06llu] mock console line %llu\n",
+                 (unsigned long long)(t / 1000000000ULL),
+                 (unsigned long long)(t % 1000000000ULL) / 1000ULL,
+                 conring.lines++);
+    for (i = 0; i < n; ++i) {
+        conring.buf[conring.prod++ % conring.size] = line[i];
+    }
+    if (conring.prod - conring.cons > conring.size) {
+        conring.cons = conring.prod - conring.size;
+    }
+}
+
+static void conring_produce(void)
+{
+    uint64_t now = xcmock_now();
+    unsigned long long due;
+
+    if (conring.rate <= 0) {
+        return;
+    }
+    due = (now - conring.start) / 1e9 * conring.rate;
+    while (conring.lines < due) {
+        conring_put_line(now);
+    }
+}
+
+static int conring_init(void)
+{
+    unsigned long prefill, i;
+    const char *path;
+
+    conring.size = env_ul("XCMOCK_RING_SIZE", XCMOCK_RING_DEFAULT);
+    /* Free running positions only wrap cleanly modulo a power of 2. */
+    if (conring.size < XCMOCK_LINE_MAX || (conring.size & (conring.size - 1))) {
+        return -EINVAL;
+    }
+    conring.buf = m_malloc(conring.size);
+    conring.rate = getenv("XCMOCK_RATE") ? strtod(getenv("XCMOCK_RATE"), NULL) : 0.;
+    conring.start = xcmock_now();
+    prefill = env_ul("XCMOCK_PREFILL", 0);
+    for (i = 0; i < prefill; ++i) {
+        conring_put_line(conring.start);
+    }
+    /* Prefilled lines do not count against the rate. */
+    conring.lines = 0;
+
+    path = getenv("XCMOCK_MSI_LOG");
+    if (path) {
+        msi_log = fopen(path, "a");
+        if (!msi_log) {
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+xc_interface *xc_interface_open(struct xentoollog_logger *logger,
+                                struct xentoollog_logger *dombuild_logger,
+                                unsigned open_flags)
+{
+    int rc;
+
+    unused(logger);
+    unused(dombuild_logger);
+    unused(open_flags);
+
+    if (!xcmock.refs) {
+        rc = conring_init();
+        if (rc) {
+            free(conring.buf);
+            errno = -rc;
+            return NULL;
+        }
+    }
+    ++xcmock.refs;
+    return &xcmock;
+}
+
+int xc_interface_close(xc_interface *xch)
+{
+    if (!xch) {
+        return 0;
+    }
+    if (--xch->refs) {
+        return 0;
+    }
+    free(conring.buf);
+    free(msis);
+    if (msi_log) {
+        fclose(msi_log);
+    }
+    memset(&conring, 0, sizeof (conring));
+    msis = NULL;
+    msis_len = msis_size = 0;
+    msi_log = NULL;
+    return 0;
+}
+
+int xc_readconsolering(xc_interface *xch, char *buffer, unsigned int *pnr_chars,
+                       int clear, int incremental, uint32_t *pindex)
+{
+    uint32_t c, n = 0, off, len;
+
+    if (!xch || !pnr_chars || (incremental && !pindex)) {
+        errno = EINVAL;
+        return -1;
+    }
+    conring_produce();
+
+    c = conring.cons;
+    if (incremental && (int32_t)(*pindex - c) > 0) {
+        c = *pindex;
+    }
+    if ((int32_t)(conring.prod - c) < 0) {
+        c = conring.prod;
+    }
+    while (c != conring.prod && n < *pnr_chars) {
+        off = c % conring.size;
+        len = conring.size - off;
+        if (len > conring.prod - c) {
+            len = conring.prod - c;
+        }
+        if (len > *pnr_chars - n) {
+            len = *pnr_chars - n;
+        }
+        memcpy(buffer + n, conring.buf + off, len);
+        n += len;
+        c += len;
+    }
+    *pnr_chars = n;
+    if (incremental) {
+        *pindex = c;
+    }
+    if (clear) {
+        conring.cons = conring.prod;
+    }
+    return 0;
+}
+
+int xc_hvm_inject_msi(xc_interface *xch, domid_t dom, uint64_t addr, uint32_t msi_data)
+{
+    struct xcmock_msi *m;
+
+    if (!xch) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (msis_len == msis_size) {
+        msis_size = msis_size ? msis_size * 2 : 64;
+        msis = m_realloc(msis, msis_size * sizeof (*msis));
+    }
+    m = &msis[msis_len++];
+    m->ts = xcmock_now();
+    m->domid = dom;
+    m->addr = addr;
+    m->data = msi_data;
+    if (msi_log) {
+        fprintf(msi_log, "%llu.%09llu d%u %#llx %#x\n",
+                (unsigned long long)(m->ts / 1000000000ULL),
+                (unsigned long long)(m->ts % 1000000000ULL),
+                dom, (unsigned long long)addr, msi_data);
+        fflush(msi_log);
+    }
+    return 0;
+}
+
+const struct xcmock_msi *xcmock_msis(unsigned int *n)
+{
+    *n = msis_len;
+    return msis;
+}
+
+uint32_t xcmock_console_produced(void)
+{
+    return conring.prod;
+}
@@ -0,0 +1,46 @@
+#ifndef _XCMOCK_XENCTRL_H_
+# define _XCMOCK_XENCTRL_H_
+
+/*
+ * Stand-in for the parts of libxc used by the tools, selected with
+ * ./configure --enable-mock-libxc so they can run without Xen.
+ *
+ * The console ring is simulated: XCMOCK_RING_SIZE bytes (a power of 2,
+ * default 16KiB), XCMOCK_PREFILL lines written on the first
+ * xc_interface_open(), then XCMOCK_RATE lines per second (default 0) produced
+ * as time passes, the oldest output being overwritten once the ring is full.
+ *
+ * Injected MSIs are recorded with a CLOCK_MONOTONIC timestamp, and also
+ * appended to the XCMOCK_MSI_LOG file when set.
+ */
+# include <stdint.h>
+
+typedef uint16_t domid_t;
+typedef struct xc_interface_core xc_interface;
+struct xentoollog_logger;
+
+xc_interface *xc_interface_open(struct xentoollog_logger *logger,
+                                struct xentoollog_logger *dombuild_logger,
+                                unsigned open_flags);
+int xc_interface_close(xc_interface *xch);
+
+int xc_readconsolering(xc_interface *xch, char *buffer, unsigned int *pnr_chars,
+                       int clear, int incremental, uint32_t *pindex);
+int xc_hvm_inject_msi(xc_interface *xch, domid_t dom, uint64_t addr, uint32_t msi_data);
+
+/*
+ * Introspection, only provided by the mock.
+ */
+struct xcmock_msi {
+    uint64_t ts;        /* ns, CLOCK_MONOTONIC. */
+    domid_t domid;
+    uint64_t addr;
+    uint32_t data;
+};
+
+/* MSIs injected so far, in order, *@n is set to their number. */
+const struct xcmock_msi *xcmock_msis(unsigned int *n);
+/* Bytes produced on the console ring so far (free running, never reset). */
+uint32_t xcmock_console_produced(void);
+
+#endif /* !_XCMOCK_XENCTRL_H_ */
@@ -0,0 +1,434 @@
+#include "condump.h"
+
+/*
+ * Multi-source aggregation.
+ *
+ * Sources are the hypervisor console ring and any number of files, fifos, ptys
+ * or inherited fds, multiplexed in one event loop. Each source splits its input
+ * in lines, stamped with the time they were completed. Lines are held for
+ * AGG_HOLD so that sources read later (the ring is polled) can catch up, then
+ * merged across sources in timestamp order and written out tagged with the
+ * name of their source:
+ *
+ *   <seconds>.<microseconds> <name>: <line>
+ *
+ * Regular files are read from the start, then followed like tail -f: once at
+ * end of file they are checked for more data every AGG_FILE_POLL. Other
+ * sources are dropped when they reach end of file or fail. Aggregation ends
+ * when no source is left, or on SIGINT, SIGTERM or SIGHUP.
+ */
+#define AGG_HOLD        (200ULL * 1000000ULL)   /* ns */
+#define AGG_FILE_POLL   (200ULL * 1000000ULL)   /* ns */
+#define AGG_LINE_MAX    KB(16)  /* Longer lines are split. */
+#define AGG_OUT_SIZE    KB(64)
+
+struct agg_line {
+    struct list_head l;
+    uint64_t ts;        /* CLOCK_REALTIME, ns. */
+    size_t len;
+    char data[];
+};
+
+struct aggregator;
+
+struct agg_source {
+    struct list_head l;
+    struct aggregator *agg;
+    const char *name;
+    int fd;                 /* -1 for the ring. */
+    int regular;            /* Followed on end of file. */
+    struct event *ev;
+    struct follow *ring;
+    char *partial;          /* Incomplete line. */
+    size_t partial_len;
+    struct list_head lines; /* Complete lines, oldest first. */
+};
+
+struct aggregator {
+    struct evloop loop;
+    struct list_head sources;
+    unsigned int nsources;  /* Sources still open. */
+    struct filter *flt;
+    struct output *dest;    /* Where merged lines go. */
+    char *out;
+    size_t out_len;
+    int stop;
+    int rc;
+};
+
+static inline uint64_t agg_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Input.
+ */
+static void agg_queue_line(struct agg_source *s, const char *p, size_t n, uint64_t ts)
+{
+    struct agg_line *line;
+
+    line = m_malloc(sizeof (*line) + n);
+    line->ts = ts;
+    line->len = n;
+    memcpy(line->data, p, n);
+    list_add_tail(&line->l, &s->lines);
+}
+
+static void agg_feed(struct agg_source *s, const char *buf, size_t n, uint64_t ts)
+{
+    const char *end = buf + n, *nl;
+
+    while (buf < end) {
+        size_t len;
+
+        nl = memchr(buf, '\n', end - buf);
+        len = (nl ? nl + 1 : end) - buf;
+        if (len > AGG_LINE_MAX - s->partial_len) {
+            len = AGG_LINE_MAX - s->partial_len;
+        }
+        if (!s->partial_len && buf[len - 1] == '\n') {
+            /* Whole line, no need to go through the partial buffer. */
+            agg_queue_line(s, buf, len, ts);
+        } else {
+            memcpy(s->partial + s->partial_len, buf, len);
+            s->partial_len += len;
+            if (s->partial[s->partial_len - 1] == '\n' ||
+                s->partial_len == AGG_LINE_MAX) {
+                agg_queue_line(s, s->partial, s->partial_len, ts);
+                s->partial_len = 0;
+            }
+        }
+        buf += len;
+    }
+}
+
+static void agg_source_done(struct agg_source *s)
+{
+    if (s->partial_len) {
+        agg_queue_line(s, s->partial, s->partial_len, agg_now());
+        s->partial_len = 0;
+    }
+    if (s->ev) {
+        event_mark_release(s->ev);
+        s->ev = NULL;
+        if (s->fd > STDERR_FILENO) {
+            close(s->fd);
+        }
+        s->fd = -1;
+    }
+    if (!--s->agg->nsources) {
+        s->agg->stop = 1;
+    }
+}
+
+static int agg_file_resume(struct timer *t)
+{
+    struct agg_source *s = t->arg;
+
+    if (s->ev) {
+        s->ev->want = EV_READ;
+    }
+    return 0;
+}
+
+static int agg_read(struct event *ev)
+{
+    struct agg_source *s = ev->arg;
+    char buf[AGG_LINE_MAX];
+    ssize_t n;
+
+    n = read(ev->fd, buf, sizeof (buf));
+    if (n > 0) {
+        agg_feed(s, buf, n, agg_now());
+        return 0;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    if (!n && s->regular) {
+        /* Regular files are always readable, check again later. */
+        struct timer *t = timer_alloc(AGG_FILE_POLL, 0, s, agg_file_resume);
+
+        if (t) {
+            ev->want = 0;
+            timer_add(ev->loop, t);
+        }
+        return 0;
+    }
+    if (n < 0 && errno != EIO) {
+        /* EIO is how ptys report their other end is gone. */
+        WAR("Dropping source %s (%s).", s->name, strerror(errno));
+    }
+    agg_source_done(s);
+    return 0;
+}
+
+static int agg_ring_out(void *arg, const char *buf, size_t n)
+{
+    struct agg_source *s = arg;
+
+    if (buf) {
+        agg_feed(s, buf, n, agg_now());
+    }
+    return 0;
+}
+
+/*
+ * Output.
+ */
+static int agg_out(struct aggregator *agg, const struct agg_source *s,
+                   const struct agg_line *line)
+{
+    size_t need = 64 + strlen(s->name) + line->len;
+    int rc, n;
+
+    if (!filter_match(agg->flt, line->data, line->len)) {
+        return 0;
+    }
+    if (agg->out_len + need > AGG_OUT_SIZE) {
+        rc = write_all(agg->dest, agg->out, agg->out_len);
+        if (rc) {
+            return rc;
+        }
+        agg->out_len = 0;
+    }
+    n = snprintf(agg->out + agg->out_len, AGG_OUT_SIZE - agg->out_len,
+                 "%llu.%06llu %s: ",
+                 (unsigned long long)(line->ts / 1000000000ULL),
+                 (unsigned long long)(line->ts % 1000000000ULL) / 1000, s->name);
+    agg->out_len += n;
+    memcpy(agg->out + agg->out_len, line->data, line->len);
+    agg->out_len += line->len;
+    if (line->data[line->len - 1] != '\n') {
+        agg->out[agg->out_len++] = '\n';
+    }
+    return 0;
+}
+
+/* Merge and write out every line stamped up to @cutoff. */
+static int agg_emit(struct aggregator *agg, uint64_t cutoff)
+{
+    struct agg_source *s, *oldest;
+    struct agg_line *line;
+    int rc;
+
+    for (;;) {
+        oldest = NULL;
+        list_for_each_entry(s, &agg->sources, l) {
+            if (list_empty(&s->lines)) {
+                continue;
+            }
+            line = list_entry(s->lines.next, struct agg_line, l);
+            if (line->ts <= cutoff &&
+                (!oldest || line->ts < list_entry(oldest->lines.next, struct agg_line, l)->ts)) {
+                oldest = s;
+            }
+        }
+        if (!oldest) {
+            break;
+        }
+        line = list_entry(oldest->lines.next, struct agg_line, l);
+        list_del(&line->l);
+        rc = agg_out(agg, oldest, line);
+        free(line);
+        if (rc) {
+            return rc;
+        }
+    }
+    rc = write_all(agg->dest, agg->out, agg->out_len);
+    agg->out_len = 0;
+    return rc;
+}
+
+static int agg_tick(struct timer *t)
+{
+    struct aggregator *agg = t->arg;
+
+    agg->rc = agg_emit(agg, agg_now() - AGG_HOLD);
+    if (!agg->rc) {
+        agg->rc = output_idle(agg->dest);
+    }
+    if (agg->rc) {
+        ERR("Failed to write aggregated output (%s).", strerror(-agg->rc));
+        agg->stop = 1;
+    }
+    return agg->rc;
+}
+
+/*
+ * Sources.
+ */
+static struct agg_source *agg_source_new(struct aggregator *agg, const char *name, int fd)
+{
+    struct agg_source *s;
+
+    s = m_malloc0(sizeof (*s));
+    s->agg = agg;
+    s->name = name;
+    s->fd = fd;
+    s->partial = m_malloc(AGG_LINE_MAX);
+    INIT_LIST_HEAD(&s->lines);
+    list_add_tail(&s->l, &agg->sources);
+    ++agg->nsources;
+    return s;
+}
+
+/* @spec is [name=]path, path being a file, "-" for stdin or "fd:N". */
+static int agg_add_input(struct aggregator *agg, char *spec)
+{
+    struct agg_source *s;
+    struct stat st;
+    char *name = spec, *path, *eq;
+    unsigned long fd;
+    int rc;
+
+    eq = strchr(spec, '=');
+    if (eq) {
+        *eq = '\0';
+        path = eq + 1;
+    } else {
+        path = spec;
+    }
+
+    if (!strcmp(path, "-")) {
+        fd = STDIN_FILENO;
+    } else if (!strncmp(path, "fd:", 3)) {
+        rc = parse_ul(path + 3, &fd);
+        if (rc || fd > INT_MAX) {
+            ERR("Invalid fd in %s.", path);
+            return rc ? rc : -EINVAL;
+        }
+    } else {
+        int f = open(path, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+
+        if (f < 0) {
+            rc = -errno;
+            ERR("Failed to open %s (%s).", path, strerror(errno));
+            return rc;
+        }
+        fd = f;
+    }
+    if (fstat(fd, &st)) {
+        rc = -errno;
+        ERR("Invalid source %s (%s).", path, strerror(errno));
+        if (fd > STDERR_FILENO) {
+            close(fd);
+        }
+        return rc;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    if (!eq) {
+        /* Name sources after their file name by default. */
+        name = strrchr(path, '/');
+        name = name ? name + 1 : path;
+        if (fd == STDIN_FILENO) {
+            name = "stdin";
+        }
+    }
+    s = agg_source_new(agg, name, fd);
+    s->regular = S_ISREG(st.st_mode);
+    s->ev = event_alloc(fd, s, agg_read);
+    event_add(&agg->loop, s->ev);
+    return 0;
+}
+
+static void agg_source_free(struct agg_source *s)
+{
+    struct agg_line *line, *tl;
+
+    list_for_each_entry_safe(line, tl, &s->lines, l) {
+        list_del(&line->l);
+        free(line);
+    }
+    if (s->fd > STDERR_FILENO) {
+        close(s->fd);
+    }
+    list_del(&s->l);
+    free(s->partial);
+    free(s);
+}
+
+int aggregate_console(xc_interface *xch, char **inputs, unsigned int ninputs,
+                      struct output *out, struct filter *flt, unsigned int *index)
+{
+    struct aggregator agg;
+    struct agg_source *ring = NULL, *s, *ts;
+    struct timer *t;
+    unsigned int i;
+    int rc, err;
+
+    memset(&agg, 0, sizeof (agg));
+    INIT_LIST_HEAD(&agg.sources);
+    agg.flt = flt;
+    agg.dest = out;
+    rc = evloop_init(&agg.loop);
+    if (rc) {
+        ERR("Failed to initialize event loop (%s).", strerror(-rc));
+        return rc;
+    }
+    agg.out = m_malloc(AGG_OUT_SIZE);
+
+    rc = follow_signals(&agg.loop, &agg.stop);
+    if (rc) {
+        goto out;
+    }
+    for (i = 0; i < ninputs; ++i) {
+        rc = agg_add_input(&agg, inputs[i]);
+        if (rc) {
+            goto out;
+        }
+    }
+    if (xch) {
+        ring = agg_source_new(&agg, "xen", -1);
+        ring->ring = follow_start(&agg.loop, xch, CONSOLE_RING_SIZE, *index,
+                                  agg_ring_out, ring, &agg.stop);
+        if (!ring->ring) {
+            rc = -ENOMEM;
+            goto out;
+        }
+    }
+    t = timer_alloc(AGG_HOLD / 2, AGG_HOLD / 2, &agg, agg_tick);
+    if (!t) {
+        rc = -ENOMEM;
+        goto out;
+    }
+    timer_add(&agg.loop, t);
+
+    while (!agg.stop) {
+        struct timeval to = { .tv_sec = 1, .tv_usec = 0 };
+
+        rc = evloop_wait(&agg.loop, &to);
+        if (rc && rc != -EINTR) {
+            ERR("Event loop failed (%s).", strerror(-rc));
+            break;
+        }
+        rc = agg.rc;
+    }
+
+out:
+    if (ring && ring->ring) {
+        err = follow_end(ring->ring, index);
+        rc = rc ? rc : err;
+    }
+    /* Whatever is left, incomplete lines included. */
+    list_for_each_entry(s, &agg.sources, l) {
+        if (s->partial_len) {
+            agg_queue_line(s, s->partial, s->partial_len, agg_now());
+            s->partial_len = 0;
+        }
+    }
+    err = agg_emit(&agg, ~0ULL);
+    rc = rc ? rc : err;
+
+    list_for_each_entry_safe(s, ts, &agg.sources, l) {
+        agg_source_free(s);
+    }
+    free(agg.out);
+    evloop_fini(&agg.loop);
+    return rc;
+}
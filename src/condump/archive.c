@@ -0,0 +1,438 @@
+#include "condump.h"
+
+/*
+ * Console archive.
+ *
+ * The archive is a directory of fixed size segment files (seg-XXXXXXXX), each
+ * starting with a small header and written through a shared mapping, plus a
+ * sparse index file. Segments are filled one after the other, the next one
+ * being created when the current one is full.
+ *
+ * The segment header keeps the number of bytes used, updated after each
+ * append, so an archive left behind by a crash can be re-opened as is.
+ *
+ * Index records are appended when a segment starts, then every
+ * ARCHIVE_IDX_STRIDE bytes or ARCHIVE_IDX_PERIOD of time, whichever comes
+ * first, as long as there is new data. Each maps the wall clock time data was
+ * archived at to its offset in the archive (free running, across segments)
+ * and in its segment. Queries binary search the index to find where to start
+ * and stop reading, and only touch the segments in that range. Appends, so
+ * index records, are not aligned on lines: queries start after the newline
+ * preceding the first record and stop after the first newline at or after
+ * the last one, so they only output whole lines.
+ */
+#define ARCHIVE_SEG_SIZE    MB(16)
+#define ARCHIVE_SEG_MAGIC   0x6367736dU     /* "msgc" */
+#define ARCHIVE_IDX_STRIDE  KB(64)
+#define ARCHIVE_IDX_PERIOD  1000000000ULL   /* ns */
+#define ARCHIVE_IDX_NAME    "index"
+
+struct archive_seg_hdr {
+    uint32_t magic;
+    uint32_t seq;       /* Segment number. */
+    uint64_t base;      /* Archive offset of the first byte. */
+    uint64_t len;       /* Bytes used. */
+} __attribute__((aligned(64)));
+
+#define ARCHIVE_SEG_DATA    (ARCHIVE_SEG_SIZE - sizeof (struct archive_seg_hdr))
+
+struct archive_idx {
+    uint64_t ts;        /* CLOCK_REALTIME, ns. */
+    uint64_t off;       /* Archive offset. */
+    uint32_t seq;       /* Segment number. */
+    uint32_t seg_off;   /* Offset in the segment data. */
+};
+
+struct archive {
+    int dfd;            /* Archive directory. */
+    int ifd;            /* Index, append only. */
+    int sfd;            /* Current segment. */
+    struct archive_seg_hdr *seg;
+    struct archive_idx last;    /* Last index record. */
+};
+
+static inline uint64_t archive_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline char *archive_seg_data(struct archive_seg_hdr *seg)
+{
+    return (char *)(seg + 1);
+}
+
+static void archive_seg_name(char *name, size_t len, uint32_t seq)
+{
+    snprintf(name, len, "seg-%08x", seq);
+}
+
+/*
+ * Map segment @seq: create it (SEG_CREATE, starting at archive offset @base),
+ * re-open it to append more (SEG_APPEND) or read it (SEG_READ).
+ */
+enum { SEG_CREATE, SEG_APPEND, SEG_READ };
+
+static struct archive_seg_hdr *archive_seg_map(int dfd, uint32_t seq, uint64_t base,
+                                               int mode, int *fd)
+{
+    struct archive_seg_hdr *seg;
+    struct stat st;
+    char name[32];
+    size_t len = ARCHIVE_SEG_SIZE;  /* Bytes backed by the file. */
+
+    archive_seg_name(name, sizeof (name), seq);
+    switch (mode) {
+        case SEG_CREATE:
+            *fd = openat(dfd, name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            break;
+        case SEG_APPEND:
+            *fd = openat(dfd, name, O_RDWR | O_CLOEXEC);
+            break;
+        default:
+            *fd = openat(dfd, name, O_RDONLY | O_CLOEXEC);
+            break;
+    }
+    if (*fd < 0) {
+        return NULL;
+    }
+    if (mode == SEG_READ) {
+        if (fstat(*fd, &st)) {
+            goto fail;
+        }
+        len = st.st_size;
+        if (len < sizeof (*seg) || len > ARCHIVE_SEG_SIZE) {
+            errno = EILSEQ;
+            goto fail;
+        }
+    } else if (ftruncate(*fd, ARCHIVE_SEG_SIZE)) {
+        goto fail;
+    }
+    /* Segments are always mapped whole, only the used part is accessed. */
+    seg = mmap(NULL, ARCHIVE_SEG_SIZE, (mode == SEG_READ) ? PROT_READ : PROT_READ | PROT_WRITE,
+               MAP_SHARED, *fd, 0);
+    if (seg == MAP_FAILED) {
+        goto fail;
+    }
+    if (mode == SEG_CREATE) {
+        seg->magic = ARCHIVE_SEG_MAGIC;
+        seg->seq = seq;
+        seg->base = base;
+        seg->len = 0;
+    } else if (seg->magic != ARCHIVE_SEG_MAGIC || seg->seq != seq ||
+               seg->len > len - sizeof (*seg)) {
+        munmap(seg, ARCHIVE_SEG_SIZE);
+        errno = EILSEQ;
+        goto fail;
+    }
+    return seg;
+
+fail:
+    close(*fd);
+    *fd = -1;
+    return NULL;
+}
+
+/* Unmap a segment mapped with SEG_READ. */
+static void archive_seg_release(struct archive_seg_hdr *seg, int fd)
+{
+    munmap(seg, ARCHIVE_SEG_SIZE);
+    close(fd);
+}
+
+/* Trim the unused tail of the current segment and unmap it. */
+static void archive_seg_unmap(struct archive *ar)
+{
+    off_t len = sizeof (*ar->seg) + ar->seg->len;
+
+    munmap(ar->seg, ARCHIVE_SEG_SIZE);
+    if (ftruncate(ar->sfd, len)) {
+        WAR("Failed to trim archive segment (%s).", strerror(errno));
+    }
+    close(ar->sfd);
+    ar->seg = NULL;
+    ar->sfd = -1;
+}
+
+static int archive_index(struct archive *ar, uint64_t ts)
+{
+    struct archive_idx idx = {
+        .ts = ts,
+        .off = ar->seg->base + ar->seg->len,
+        .seq = ar->seg->seq,
+        .seg_off = ar->seg->len,
+    };
+
+    if (write(ar->ifd, &idx, sizeof (idx)) != sizeof (idx)) {
+        return errno ? -errno : -EIO;
+    }
+    ar->last = idx;
+    return 0;
+}
+
+static int archive_rotate(struct archive *ar)
+{
+    uint32_t seq = ar->seg->seq + 1;
+    uint64_t base = ar->seg->base + ar->seg->len;
+
+    archive_seg_unmap(ar);
+    ar->seg = archive_seg_map(ar->dfd, seq, base, SEG_CREATE, &ar->sfd);
+    if (!ar->seg) {
+        return -errno;
+    }
+    return 0;
+}
+
+struct archive *archive_open(const char *dir)
+{
+    struct archive *ar;
+    struct stat st;
+    int rc;
+
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        return NULL;
+    }
+    ar = m_malloc0(sizeof (*ar));
+    ar->sfd = -1;
+    ar->dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ar->dfd < 0) {
+        goto fail_dir;
+    }
+    ar->ifd = openat(ar->dfd, ARCHIVE_IDX_NAME,
+                     O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (ar->ifd < 0) {
+        goto fail_idx;
+    }
+    if (fstat(ar->ifd, &st)) {
+        goto fail_seg;
+    }
+
+    if (st.st_size < (off_t)sizeof (ar->last)) {
+        /* New archive. */
+        ar->seg = archive_seg_map(ar->dfd, 0, 0, SEG_CREATE, &ar->sfd);
+        if (!ar->seg) {
+            goto fail_seg;
+        }
+        rc = archive_index(ar, archive_now());
+        if (rc) {
+            errno = -rc;
+            goto fail_index;
+        }
+        return ar;
+    }
+
+    /* Resume after the last segment the index knows about. */
+    if (pread(ar->ifd, &ar->last, sizeof (ar->last),
+              (st.st_size / sizeof (ar->last) - 1) * sizeof (ar->last)) !=
+        sizeof (ar->last)) {
+        goto fail_seg;
+    }
+    ar->seg = archive_seg_map(ar->dfd, ar->last.seq, 0, SEG_APPEND, &ar->sfd);
+    if (!ar->seg) {
+        goto fail_seg;
+    }
+    return ar;
+
+fail_index:
+    archive_seg_unmap(ar);
+fail_seg:
+    close(ar->ifd);
+fail_idx:
+    close(ar->dfd);
+fail_dir:
+    free(ar);
+    return NULL;
+}
+
+int archive_append(struct archive *ar, const char *buf, size_t n)
+{
+    uint64_t now = archive_now();
+    size_t len;
+    int rc;
+
+    /* Keep the index sorted if the clock steps back. */
+    if (now < ar->last.ts) {
+        now = ar->last.ts;
+    }
+    while (n) {
+        if (ar->seg->len == ARCHIVE_SEG_DATA) {
+            rc = archive_rotate(ar);
+            if (rc) {
+                return rc;
+            }
+            rc = archive_index(ar, now);
+            if (rc) {
+                return rc;
+            }
+        } else if (ar->seg->base + ar->seg->len - ar->last.off >= ARCHIVE_IDX_STRIDE ||
+                   (now - ar->last.ts >= ARCHIVE_IDX_PERIOD &&
+                    ar->seg->base + ar->seg->len != ar->last.off)) {
+            rc = archive_index(ar, now);
+            if (rc) {
+                return rc;
+            }
+        }
+
+        len = ARCHIVE_SEG_DATA - ar->seg->len;
+        len = (len < n) ? len : n;
+        memcpy(archive_seg_data(ar->seg) + ar->seg->len, buf, len);
+        ar->seg->len += len;
+        buf += len;
+        n -= len;
+    }
+    return 0;
+}
+
+void archive_close(struct archive *ar)
+{
+    archive_seg_unmap(ar);
+    close(ar->ifd);
+    close(ar->dfd);
+    free(ar);
+}
+
+/*
+ * Queries.
+ */
+/* First record with a timestamp above @ts, @n if there is none. */
+static size_t archive_idx_upper(const struct archive_idx *idx, size_t n, uint64_t ts)
+{
+    size_t lo = 0, hi = n;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (idx[mid].ts <= ts) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int archive_query(const char *dir, uint64_t since, uint64_t until,
+                  struct output *out, struct filter *flt)
+{
+    struct archive_idx *idx;
+    struct archive_seg_hdr *seg;
+    struct stat st;
+    size_t n, first, last;
+    uint64_t off, end;
+    uint32_t seq;
+    int dfd, ifd, sfd, skip, done, rc = 0;
+
+    dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) {
+        rc = -errno;
+        ERR("Failed to open archive %s (%s).", dir, strerror(errno));
+        return rc;
+    }
+    ifd = openat(dfd, ARCHIVE_IDX_NAME, O_RDONLY | O_CLOEXEC);
+    if (ifd < 0 || fstat(ifd, &st)) {
+        rc = -errno;
+        ERR("Failed to open archive index (%s).", strerror(errno));
+        goto out_dir;
+    }
+    n = st.st_size / sizeof (*idx);
+    if (!n) {
+        goto out_idx;
+    }
+    idx = mmap(NULL, n * sizeof (*idx), PROT_READ, MAP_SHARED, ifd, 0);
+    if (idx == MAP_FAILED) {
+        rc = -errno;
+        ERR("Failed to map archive index (%s).", strerror(errno));
+        goto out_idx;
+    }
+
+    /* Start at the last record at or before @since, stop at the first after @until. */
+    first = archive_idx_upper(idx, n, since);
+    first = first ? first - 1 : 0;
+    last = archive_idx_upper(idx, n, until);
+    end = (last < n) ? idx[last].off : ~0ULL;
+    seq = idx[first].seq;
+    off = idx[first].off;
+    done = (off >= end);
+    /* Skip to the end of the line the byte before @off is in. */
+    skip = (off != 0);
+    if (skip) {
+        if (!idx[first].seg_off) {
+            --seq;
+        }
+        --off;
+    }
+    munmap(idx, n * sizeof (*idx));
+
+    while (!done) {
+        uint64_t len, base, cut;
+        const char *data, *nl;
+        int full;
+
+        seg = archive_seg_map(dfd, seq, 0, SEG_READ, &sfd);
+        if (!seg) {
+            if (errno != ENOENT) {
+                rc = -errno;
+                ERR("Failed to map archive segment %u (%s).", seq, strerror(errno));
+            }
+            break;
+        }
+        base = seg->base;
+        if (off < base || off - base > seg->len) {
+            /* Index and segments out of sync, do not read out of the map. */
+            rc = -EILSEQ;
+            ERR("Archive segment %u does not hold offset %llu.", seq,
+                (unsigned long long)off);
+            archive_seg_release(seg, sfd);
+            break;
+        }
+        full = (seg->len == ARCHIVE_SEG_DATA);
+        data = archive_seg_data(seg) + (off - base);
+        len = seg->len - (off - base);
+        if (skip) {
+            nl = memchr(data, '\n', len);
+            skip = !nl;
+            cut = nl ? (uint64_t)(nl + 1 - data) : len;
+            data += cut;
+            off += cut;
+            len -= cut;
+            if (off >= end) {
+                /* No line starts before @end. */
+                len = 0;
+                done = 1;
+            }
+        }
+        if (!skip && !done && end - off <= len) {
+            /* Stop at the first line boundary at or after @end. */
+            nl = memchr(data + (end - 1 - off), '\n', len - (end - 1 - off));
+            if (nl) {
+                len = nl + 1 - data;
+                done = 1;
+            }
+        }
+        rc = len ? filter_write(flt, out, data, len) : 0;
+        archive_seg_release(seg, sfd);
+        if (rc) {
+            ERR("Failed to write console output (%s).", strerror(-rc));
+            break;
+        }
+        off += len;
+        if (!full) {
+            /* Segment still being filled, that was the last one. */
+            break;
+        }
+        ++seq;
+    }
+    if (!rc) {
+        rc = filter_finish(flt, out);
+    }
+
+out_idx:
+    if (ifd >= 0) {
+        close(ifd);
+    }
+out_dir:
+    close(dfd);
+    return rc;
+}
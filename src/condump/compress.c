@@ -0,0 +1,436 @@
+#include "condump.h"
+
+/*
+ * Block compressed output.
+ *
+ * Output is cut in blocks of ZBLOCK_SIZE bytes, each compressed on its own with
+ * a small LZ77 codec (LZ4 like sequences, no entropy coding) so any block can
+ * be decoded without the ones before it. Every block starts with a header
+ * giving its compressed and raw lengths and the offset of its first byte in
+ * the uncompressed stream, so a reader can skip from header to header to the
+ * block holding a given offset.
+ *
+ * Sequences are a token byte (literal run length in the high nibble, match
+ * length - ZMIN_MATCH in the low one, 15 meaning more length bytes follow, each
+ * adding up to 255), the literals, then a 16-bit little endian match offset
+ * and the extra match length bytes. The last sequence of a block only has
+ * literals.
+ *
+ * Writers fill raw blocks from a small pool, a worker thread compresses and
+ * writes them out in order, so the console reader only pays for a memcpy.
+ * While following, a block is handed over short once it has been open for
+ * ZBLOCK_IDLE_FLUSH, so a quiet console does not hold output back.
+ */
+#define ZBLOCK_SIZE     KB(64)
+#define ZBLOCK_MAGIC    0x6b6c627aU     /* "zblk" */
+#define ZBLOCK_RAW      (1U << 0)       /* Stored as is, did not compress. */
+#define ZPOOL_SIZE      4
+#define ZBLOCK_IDLE_FLUSH   (1000ULL * 1000000ULL)  /* ns */
+#define ZMIN_MATCH      4
+#define ZHASH_BITS      14
+
+struct zblock_hdr {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t raw_len;
+    uint32_t comp_len;
+    uint64_t raw_off;   /* Offset of the block in the uncompressed stream. */
+};
+
+/* Worst case, incompressible data gets stored. */
+#define ZCOMP_BOUND     (ZBLOCK_SIZE + ZBLOCK_SIZE / 255 + 16)
+
+/*
+ * Codec.
+ */
+static inline uint32_t zread32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof (v));
+    return v;
+}
+
+static inline uint32_t zhash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - ZHASH_BITS);
+}
+
+static uint8_t *zput_len(uint8_t *op, size_t len)
+{
+    for (; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+static uint8_t *zput_seq(uint8_t *op, const uint8_t *lit, size_t lit_len,
+                         size_t off, size_t match_len)
+{
+    uint8_t *token = op++;
+    size_t ml = match_len ? match_len - ZMIN_MATCH : 0;
+
+    *token = ((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15);
+    if (lit_len >= 15) {
+        op = zput_len(op, lit_len - 15);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (!match_len) {
+        return op;
+    }
+    *op++ = off & 0xff;
+    *op++ = off >> 8;
+    if (ml >= 15) {
+        op = zput_len(op, ml - 15);
+    }
+    return op;
+}
+
+/* Compress @n <= ZBLOCK_SIZE bytes, returns the compressed size. */
+static size_t zcompress(const uint8_t *src, size_t n, uint8_t *dst)
+{
+    uint16_t table[1 << ZHASH_BITS];
+    const uint8_t *ip = src, *anchor = src, *iend = src + n;
+    const uint8_t *ilimit = (n >= ZMIN_MATCH) ? iend - ZMIN_MATCH : src;
+    uint8_t *op = dst;
+
+    memset(table, 0, sizeof (table));
+    while (ip < ilimit) {
+        uint32_t h = zhash(zread32(ip));
+        const uint8_t *ref = src + table[h];
+        size_t len;
+
+        table[h] = ip - src;
+        if (ref >= ip || ip - ref > 0xffff || zread32(ref) != zread32(ip)) {
+            ++ip;
+            continue;
+        }
+        for (len = ZMIN_MATCH; ip + len < iend && ref[len] == ip[len]; ++len);
+        op = zput_seq(op, anchor, ip - anchor, ip - ref, len);
+        ip += len;
+        anchor = ip;
+    }
+    return zput_seq(op, anchor, iend - anchor, 0, 0) - dst;
+}
+
+static int zget_len(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+    uint8_t b;
+
+    do {
+        if (*ip >= iend) {
+            return -EILSEQ;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/* Decompress a block, returns the raw size or -EILSEQ. */
+static ssize_t zdecompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4, ml = token & 0xf, off;
+
+        if (lit == 15 && zget_len(&ip, iend, &lit)) {
+            return -EILSEQ;
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) {
+            return -EILSEQ;
+        }
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -EILSEQ;
+        }
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (ml == 15 && zget_len(&ip, iend, &ml)) {
+            return -EILSEQ;
+        }
+        ml += ZMIN_MATCH;
+        if (!off || off > (size_t)(op - dst) || ml > (size_t)(oend - op)) {
+            return -EILSEQ;
+        }
+        /* Matches can overlap what they produce. */
+        for (; ml; --ml, ++op) {
+            *op = op[-off];
+        }
+    }
+    return op - dst;
+}
+
+/*
+ * Writer.
+ */
+struct zbuf {
+    uint8_t data[ZBLOCK_SIZE];
+    size_t len;
+};
+
+struct zstream {
+    int fd;
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct zbuf pool[ZPOOL_SIZE];
+    unsigned int head;      /* Next buffer to compress. */
+    unsigned int count;     /* Buffers waiting to be compressed. */
+    struct zbuf *cur;       /* Being filled, not in the queue yet. */
+    uint64_t started;       /* When the first byte of cur came in. */
+    uint64_t raw_off;
+    int done;
+    int rc;                 /* First write error of the worker. */
+};
+
+static int zstream_write_block(struct zstream *zs, const struct zbuf *b, uint8_t *comp)
+{
+    struct zblock_hdr hdr = {
+        .magic = ZBLOCK_MAGIC,
+        .flags = 0,
+        .raw_len = b->len,
+        .raw_off = zs->raw_off,
+    };
+    const uint8_t *payload = comp;
+    int rc;
+
+    hdr.comp_len = zcompress(b->data, b->len, comp);
+    if (hdr.comp_len >= b->len) {
+        hdr.flags |= ZBLOCK_RAW;
+        hdr.comp_len = b->len;
+        payload = b->data;
+    }
+    zs->raw_off += b->len;
+    rc = __write_all(zs->fd, (const char *)&hdr, sizeof (hdr));
+    if (!rc) {
+        rc = __write_all(zs->fd, (const char *)payload, hdr.comp_len);
+    }
+    return rc;
+}
+
+static void *zstream_worker(void *arg)
+{
+    struct zstream *zs = arg;
+    uint8_t *comp = m_malloc(ZCOMP_BOUND);
+    struct zbuf *b;
+    int rc;
+
+    pthread_mutex_lock(&zs->lock);
+    for (;;) {
+        while (!zs->count && !zs->done) {
+            pthread_cond_wait(&zs->cond, &zs->lock);
+        }
+        if (!zs->count) {
+            break;
+        }
+        b = &zs->pool[zs->head];
+        pthread_mutex_unlock(&zs->lock);
+
+        rc = zs->rc ? zs->rc : zstream_write_block(zs, b, comp);
+
+        pthread_mutex_lock(&zs->lock);
+        zs->rc = rc;
+        zs->head = (zs->head + 1) % ZPOOL_SIZE;
+        --zs->count;
+        pthread_cond_broadcast(&zs->cond);
+    }
+    pthread_mutex_unlock(&zs->lock);
+    free(comp);
+    return NULL;
+}
+
+/* Hand the current buffer to the worker, wait for a free one. */
+static int zstream_submit(struct zstream *zs)
+{
+    int rc;
+
+    pthread_mutex_lock(&zs->lock);
+    if (zs->cur) {
+        ++zs->count;
+        zs->cur = NULL;
+        pthread_cond_broadcast(&zs->cond);
+    }
+    while (zs->count == ZPOOL_SIZE) {
+        pthread_cond_wait(&zs->cond, &zs->lock);
+    }
+    zs->cur = &zs->pool[(zs->head + zs->count) % ZPOOL_SIZE];
+    zs->cur->len = 0;
+    rc = zs->rc;
+    pthread_mutex_unlock(&zs->lock);
+    return rc;
+}
+
+struct zstream *zstream_open(int fd)
+{
+    struct zstream *zs;
+    int rc;
+
+    zs = m_malloc0(sizeof (*zs));
+    zs->fd = fd;
+    pthread_mutex_init(&zs->lock, NULL);
+    pthread_cond_init(&zs->cond, NULL);
+    zs->cur = &zs->pool[0];
+    rc = pthread_create(&zs->worker, NULL, zstream_worker, zs);
+    if (rc) {
+        free(zs);
+        errno = rc;
+        return NULL;
+    }
+    return zs;
+}
+
+int zstream_write(struct zstream *zs, const char *buf, size_t n)
+{
+    size_t len;
+    int rc;
+
+    while (n) {
+        if (!zs->cur->len) {
+            zs->started = evloop_now();
+        }
+        len = ZBLOCK_SIZE - zs->cur->len;
+        len = (len < n) ? len : n;
+        memcpy(zs->cur->data + zs->cur->len, buf, len);
+        zs->cur->len += len;
+        buf += len;
+        n -= len;
+        if (zs->cur->len == ZBLOCK_SIZE) {
+            rc = zstream_submit(zs);
+            if (rc) {
+                return rc;
+            }
+        }
+    }
+    return 0;
+}
+
+int zstream_idle(struct zstream *zs)
+{
+    if (!zs->cur->len || evloop_now() - zs->started < ZBLOCK_IDLE_FLUSH) {
+        return 0;
+    }
+    return zstream_submit(zs);
+}
+
+int zstream_close(struct zstream *zs)
+{
+    int rc = 0;
+
+    if (!zs) {
+        return 0;
+    }
+    if (zs->cur->len) {
+        rc = zstream_submit(zs);
+    }
+    pthread_mutex_lock(&zs->lock);
+    zs->done = 1;
+    pthread_cond_broadcast(&zs->cond);
+    pthread_mutex_unlock(&zs->lock);
+    pthread_join(zs->worker, NULL);
+
+    rc = rc ? rc : zs->rc;
+    pthread_cond_destroy(&zs->cond);
+    pthread_mutex_destroy(&zs->lock);
+    free(zs);
+    return rc;
+}
+
+/*
+ * Read back, from the block holding uncompressed offset @off on.
+ */
+static ssize_t read_full(int fd, void *buf, size_t n)
+{
+    size_t got = 0;
+    ssize_t nr;
+
+    while (got < n) {
+        nr = read(fd, (char *)buf + got, n - got);
+        if (nr < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (!nr) {
+            break;
+        }
+        got += nr;
+    }
+    return got;
+}
+
+int zstream_decode(int in, int out, uint64_t off)
+{
+    struct zblock_hdr hdr;
+    uint8_t *comp, *raw;
+    ssize_t n;
+    int rc = 0, seekable;
+
+    comp = m_malloc(ZCOMP_BOUND);
+    raw = m_malloc(ZBLOCK_SIZE);
+    seekable = (lseek(in, 0, SEEK_CUR) >= 0);
+    for (;;) {
+        n = read_full(in, &hdr, sizeof (hdr));
+        if (!n) {
+            break;
+        }
+        if (n != sizeof (hdr) || hdr.magic != ZBLOCK_MAGIC ||
+            hdr.raw_len > ZBLOCK_SIZE || hdr.comp_len > ZCOMP_BOUND) {
+            rc = (n < 0) ? -errno : -EILSEQ;
+            break;
+        }
+        if (hdr.raw_off + hdr.raw_len <= off && seekable) {
+            /* Not there yet, skip the payload. */
+            if (lseek(in, hdr.comp_len, SEEK_CUR) < 0) {
+                rc = -errno;
+                break;
+            }
+            continue;
+        }
+        n = read_full(in, comp, hdr.comp_len);
+        if (n != hdr.comp_len) {
+            rc = (n < 0) ? -errno : -EILSEQ;
+            break;
+        }
+        if (hdr.flags & ZBLOCK_RAW) {
+            memcpy(raw, comp, hdr.comp_len);
+            n = hdr.comp_len;
+        } else {
+            n = zdecompress(comp, hdr.comp_len, raw, ZBLOCK_SIZE);
+        }
+        if (n != hdr.raw_len) {
+            rc = -EILSEQ;
+            break;
+        }
+        if (hdr.raw_off + hdr.raw_len <= off) {
+            continue;
+        }
+        if (hdr.raw_off < off) {
+            rc = __write_all(out, (const char *)raw + (off - hdr.raw_off),
+                             hdr.raw_len - (off - hdr.raw_off));
+        } else {
+            rc = __write_all(out, (const char *)raw, hdr.raw_len);
+        }
+        if (rc) {
+            break;
+        }
+    }
+    if (rc == -EILSEQ) {
+        ERR("Corrupted compressed stream.");
+    }
+    free(raw);
+    free(comp);
+    return rc;
+}
@@ -1,68 +1,451 @@
 #include "condump.h"
 
-int read_console(xc_interface *xch, unsigned int ring_size)
+/*
+ * Stream the console ring to @out, from *@index on (see xc_readconsolering(),
+ * 0 for everything the ring holds). *@index is moved past what was read.
+ * Chunks returned by xc_readconsolering() are gathered in a fixed, page
+ * aligned buffer which is written out every time it fills up, so memory use
+ * does not depend on the ring size and writes are large.
+ */
+int read_console(xc_interface *xch, struct output *out, struct filter *flt,
+                 unsigned int *index)
 {
     char *buf;
-    unsigned int buf_size = ring_size;
-    unsigned int index = 0; /* See xc_readconsolering() */
-    unsigned int n;         /* Character to be read or read when returned by xc_readconsolerin). */
-    int rc = 0;
-
-    buf = m_malloc(buf_size);
-    INF("alloc'ed %dB buffer.", buf_size);
-
-    n = ring_size;
-    rc = xc_readconsolering(xch, buf, &n, 0, 1, &index);
-    if (rc < 0) {
-        rc = -errno;
-        ERR("xc_readconsolering(): failed (%s).", strerror(errno));
-        free(buf);
-        return rc;
-    }
-    INF("read %dB from console ring, index @%d.", n, index);
-
-    while ((n == ring_size) && (rc >= 0)) {
-        buf_size += ring_size;
-        if (buf_size < ring_size) {  /* Test overflow. */
-            INF("buffer size overflowed, leaving.");
-            errno = ERANGE;
-            break;
-        }
-        buf = m_realloc(buf, buf_size);
-        INF("realloc'ed %dB buffer.", buf_size);
-        rc = xc_readconsolering(xch, &buf[index], &n, 0, 1, &index);
-        INF("read %dB buffer, index@%d, buf@%d", n, index, buf_size - ring_size);
-    }
-    if ((rc < 0) || (buf_size < ring_size)) {
-        rc = -errno;
-        ERR("xc_readconsolering(): failed (%s).", strerror(errno));
-        free(buf);
-        return rc;
-    }
-    buf[buf_size - ring_size + n] = '\0';
-    fprintf(stdout, "%s\n", buf);
+    unsigned int fill = 0;  /* Bytes pending in buf. */
+    unsigned int n, want;
+    int rc;
+
+    rc = posix_memalign((void **)&buf, CONSOLE_BUF_ALIGN, CONSOLE_BUF_SIZE);
+    if (rc) {
+        ERR("posix_memalign(): failed (%s).", strerror(rc));
+        return -rc;
+    }
+
+    do {
+        want = CONSOLE_BUF_SIZE - fill;
+        n = want;
+        if (xc_readconsolering(xch, buf + fill, &n, 0, 1, index) < 0) {
+            rc = -errno;
+            ERR("xc_readconsolering(): failed (%s).", strerror(errno));
+            goto out;
+        }
+        fill += n;
+        if (fill == CONSOLE_BUF_SIZE) {
+            rc = filter_write(flt, out, buf, fill);
+            if (rc) {
+                goto fail_write;
+            }
+            fill = 0;
+        }
+    } while (n == want);
+
+    rc = filter_write(flt, out, buf, fill);
+    if (!rc) {
+        rc = filter_finish(flt, out);
+    }
+    if (rc) {
+        goto fail_write;
+    }
+    goto out;
+
+fail_write:
+    ERR("Failed to write console output (%s).", strerror(-rc));
+out:
     free(buf);
     return rc;
 }
 
-int main(void)
+static int usage(int rc)
+{
+    INF("Usage:");
+    INF("condump [options]");
+    INF("condump -f -a dir");
+    INF("condump -a dir [-s since] [-u until]");
+    INF("condump [-R] -i [name=]path [-i [name=]path ...]");
+    INF("condump -x file [-O offset]");
+    INF("condump -r file");
+    INF("condump -S path [-k backlog]");
+    INF("Options:");
+    INF("	-f, --follow	keep polling the console ring for new output.");
+    INF("	-a, --archive	with -f, store output in the archive directory, query it otherwise.");
+    INF("	-L, --level	only keep \"xen\" (hypervisor) or \"guest\" lines, can be repeated.");
+    INF("	-d, --domain	only keep lines tagged with that domain id.");
+    INF("	-m, --match	only keep lines containing that string.");
+    INF("	-i, --input	also follow that file, fifo, pty, \"-\" (stdin) or \"fd:N\", can be repeated.");
+    INF("	-R, --no-ring	with -i, leave the hypervisor console ring out.");
+    INF("	-c, --cursor	only output what previous runs using that state file did not, then update it.");
+    INF("	-s, --since	query output archived from that time on (seconds since the Epoch).");
+    INF("	-u, --until	query output archived up to that time (seconds since the Epoch).");
+    INF("	-o, --output	write output to that file instead of stdout.");
+    INF("	-z, --compress	compress output in independently decodable blocks.");
+    INF("	-x, --decompress	write the uncompressed content of that file (\"-\" for stdin).");
+    INF("	-O, --offset	with -x, start at that offset of the uncompressed stream.");
+    INF("	-b, --records	output binary records (see records.h) instead of text.");
+    INF("	-r, --read-records	write the records of that file as text.");
+    INF("	-S, --serve	publish the console ring to subscribers of that UNIX socket.");
+    INF("	-k, --backlog	with -S, bytes of past output new subscribers get first (default 64KiB).");
+    INF("	-h, --help	display this help.");
+
+    return rc;
+}
+
+/*
+ * Supported options, assumes there is always a short format for every long
+ * one.
+ */
+#define OPT_STR "hfa:s:u:L:d:m:c:i:Ro:zx:O:br:S:k:"
+static struct option long_options[] = {
+    { "follow",   no_argument,          0,  'f' },
+    { "archive",  required_argument,    0,  'a' },
+    { "since",    required_argument,    0,  's' },
+    { "until",    required_argument,    0,  'u' },
+    { "level",    required_argument,    0,  'L' },
+    { "domain",   required_argument,    0,  'd' },
+    { "match",    required_argument,    0,  'm' },
+    { "cursor",   required_argument,    0,  'c' },
+    { "input",    required_argument,    0,  'i' },
+    { "no-ring",  no_argument,          0,  'R' },
+    { "output",   required_argument,    0,  'o' },
+    { "compress", no_argument,          0,  'z' },
+    { "decompress", required_argument,  0,  'x' },
+    { "offset",   required_argument,    0,  'O' },
+    { "records",  no_argument,          0,  'b' },
+    { "read-records", required_argument, 0, 'r' },
+    { "serve",    required_argument,    0,  'S' },
+    { "backlog",  required_argument,    0,  'k' },
+    { "help",     no_argument,          0,  'h' },
+    { 0,            0,                  0,  0 },
+};
+
+int main(int argc, char *argv[])
 {
     xc_interface *xch;
-    int rc = 0;
+    int follow = 0;
+    const char *archive = NULL;
+    struct archive *ar = NULL;
+    unsigned long long since = 0, until = ULLONG_MAX / 1000000000ULL;
+    struct filter *flt = NULL;
+    unsigned int classes = 0;
+    unsigned long domid;
+    long filter_domid = -1;
+    const char *match = NULL;
+    const char *cursor = NULL;
+    unsigned int index = 0;
+    char **inputs = NULL;
+    unsigned int ninputs = 0;
+    int no_ring = 0;
+    const char *output = NULL;
+    int compress = 0;
+    const char *decompress = NULL;
+    unsigned long long offset = 0;
+    int records = 0;
+    const char *read_records = NULL;
+    const char *serve = NULL;
+    unsigned long backlog = KB(64);
+    struct output out = { .fd = STDOUT_FILENO };
+    int fd, rc = 0, zrc;
+
+    do {
+        int opt, longindex;
+
+        opt = getopt_long(argc, argv, OPT_STR, long_options, &longindex);
+        switch (opt) {
+            case -1:
+                goto getopt_done;
+            case 0:
+                WAR("Malformated option \"%s\", please fix the code.",
+                    long_options[longindex].name);
+                continue;
+
+            case 'h':
+                free(inputs);
+                return usage(0);
+            case 'f':
+                follow = 1;
+                continue;
+            case 'a':
+                archive = optarg;
+                continue;
+            case 's':
+                rc = parse_ull(optarg, &since);
+                if (rc) {
+                    ERR("Invalid time %s.", optarg);
+                    free(inputs);
+                    return -rc;
+                }
+                continue;
+            case 'u':
+                rc = parse_ull(optarg, &until);
+                if (rc) {
+                    ERR("Invalid time %s.", optarg);
+                    free(inputs);
+                    return -rc;
+                }
+                continue;
+            case 'L':
+                if (!strcmp(optarg, "xen")) {
+                    classes |= FILTER_XEN;
+                } else if (!strcmp(optarg, "guest")) {
+                    classes |= FILTER_GUEST;
+                } else {
+                    ERR("Invalid level %s, expected \"xen\" or \"guest\".", optarg);
+                    free(inputs);
+                    return EINVAL;
+                }
+                continue;
+            case 'd':
+                rc = parse_ul(optarg, &domid);
+                if (rc || domid > 0x7fff) {
+                    ERR("Invalid domain id %s.", optarg);
+                    free(inputs);
+                    return rc ? -rc : EINVAL;
+                }
+                filter_domid = domid;
+                continue;
+            case 'm':
+                match = optarg;
+                continue;
+            case 'c':
+                cursor = optarg;
+                continue;
+            case 'i':
+                inputs = m_realloc(inputs, (ninputs + 1) * sizeof (*inputs));
+                inputs[ninputs++] = optarg;
+                continue;
+            case 'R':
+                no_ring = 1;
+                continue;
+            case 'o':
+                output = optarg;
+                continue;
+            case 'z':
+                compress = 1;
+                continue;
+            case 'x':
+                decompress = optarg;
+                continue;
+            case 'O':
+                rc = parse_ull(optarg, &offset);
+                if (rc) {
+                    ERR("Invalid offset %s.", optarg);
+                    free(inputs);
+                    return -rc;
+                }
+                continue;
+            case 'b':
+                records = 1;
+                continue;
+            case 'r':
+                read_records = optarg;
+                continue;
+            case 'S':
+                serve = optarg;
+                continue;
+            case 'k':
+                rc = parse_ul(optarg, &backlog);
+                if (rc || backlog > MB(256)) {
+                    ERR("Invalid backlog %s.", optarg);
+                    free(inputs);
+                    return rc ? -rc : EINVAL;
+                }
+                continue;
+
+            default:
+                ERR("Unknown option '%c'.", opt);
+                free(inputs);
+                return usage(EINVAL);
+        }
+    } while (1);
+getopt_done:
+
+    if (output) {
+        fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+            rc = errno;
+            ERR("Failed to open %s (%s).", output, strerror(errno));
+            free(inputs);
+            return rc;
+        }
+        close(fd);
+    }
+
+    if (read_records) {
+        rc = records_dump(read_records, STDOUT_FILENO);
+        if (rc) {
+            ERR("failed to read records from %s (%s).", read_records, strerror(-rc));
+        }
+        free(inputs);
+        return -rc;
+    }
+
+    if (decompress) {
+        fd = strcmp(decompress, "-") ? open(decompress, O_RDONLY) : STDIN_FILENO;
+        if (fd < 0) {
+            rc = errno;
+            ERR("Failed to open %s (%s).", decompress, strerror(errno));
+            free(inputs);
+            return rc;
+        }
+        rc = zstream_decode(fd, STDOUT_FILENO, offset);
+        if (rc) {
+            ERR("failed to decompress %s (%s).", decompress, strerror(-rc));
+        }
+        close(fd);
+        free(inputs);
+        return -rc;
+    }
+
+    if (no_ring && !ninputs) {
+        ERR("--no-ring requires at least one --input.");
+        free(inputs);
+        return EINVAL;
+    }
+    if (serve && (ninputs || archive || records || compress || output)) {
+        ERR("--serve only publishes the console ring, other outputs do not apply.");
+        free(inputs);
+        return EINVAL;
+    }
+    if (ninputs && archive) {
+        ERR("--input cannot be used with --archive.");
+        free(inputs);
+        return EINVAL;
+    }
+
+    if (classes || filter_domid >= 0 || match) {
+        if (serve) {
+            WAR("Filters do not apply when serving, subscribers get everything.");
+        } else if (archive && follow) {
+            WAR("Filters do not apply when archiving, everything is kept.");
+        } else {
+            flt = filter_new(classes, filter_domid, match);
+        }
+    }
+
+    if (records && compress) {
+        ERR("--records output is meant to be mapped, it cannot be compressed.");
+        free(inputs);
+        return EINVAL;
+    }
+    if (records) {
+        if (archive && follow) {
+            WAR("Archive segments hold text, --records ignored.");
+        } else {
+            out.rw = recwriter_open(STDOUT_FILENO);
+            if (!out.rw) {
+                ERR("Failed to set up records output (%s).", strerror(errno));
+                free(inputs);
+                filter_free(flt);
+                return errno;
+            }
+        }
+    }
+    if (compress) {
+        if (archive && follow) {
+            WAR("Archive segments are not compressed, --compress ignored.");
+        } else {
+            out.zs = zstream_open(STDOUT_FILENO);
+            if (!out.zs) {
+                ERR("Failed to set up compressed output (%s).", strerror(errno));
+                free(inputs);
+                filter_free(flt);
+                return errno;
+            }
+        }
+    }
+
+    if (archive && !follow) {
+        if (cursor) {
+            WAR("Cursors do not apply to archive queries, ignored.");
+        }
+        if (since > until || until > ULLONG_MAX / 1000000000ULL) {
+            ERR("Invalid time range.");
+            rc = -EINVAL;
+            goto done;
+        }
+        rc = archive_query(archive, since * 1000000000ULL, until * 1000000000ULL,
+                           &out, flt);
+        if (rc) {
+            ERR("failed to query console archive (%s).", strerror(-rc));
+        }
+        goto done;
+    }
+
+    if (no_ring) {
+        rc = aggregate_console(NULL, inputs, ninputs, &out, flt, &index);
+        if (rc) {
+            ERR("failed to aggregate console sources (%s).", strerror(-rc));
+        }
+        goto done;
+    }
 
     xch = xc_interface_open(NULL, NULL, 0);
     if (!xch) {
         ERR("xc_interface_open failed (%s)", strerror(errno));
-        return 1;
+        rc = -EPERM;
+        goto done;
     }
 
-    rc = read_console(xch, KB(32));
-    if (rc) {
-        ERR("failed to read console ring (%s).", strerror(errno));
+    if (cursor) {
+        rc = cursor_resume(xch, cursor, &index);
+        if (rc) {
+            ERR("failed to resume from cursor %s (%s).", cursor, strerror(-rc));
+            goto out;
+        }
     }
 
+    if (serve) {
+        rc = serve_console(xch, serve, backlog, &index);
+        if (rc) {
+            ERR("failed to serve console ring (%s).", strerror(-rc));
+        }
+    } else if (ninputs) {
+        rc = aggregate_console(xch, inputs, ninputs, &out, flt, &index);
+        if (rc) {
+            ERR("failed to aggregate console sources (%s).", strerror(-rc));
+        }
+    } else if (follow) {
+        if (archive) {
+            ar = archive_open(archive);
+            if (!ar) {
+                rc = -errno;
+                ERR("Failed to open console archive %s (%s).", archive, strerror(errno));
+                goto out;
+            }
+        }
+        rc = follow_console(xch, CONSOLE_RING_SIZE, ar, &out, flt, &index);
+        if (ar) {
+            archive_close(ar);
+        }
+        if (rc) {
+            ERR("failed to follow console ring (%s).", strerror(-rc));
+        }
+    } else {
+        rc = read_console(xch, &out, flt, &index);
+        if (rc) {
+            ERR("failed to read console ring (%s).", strerror(-rc));
+        }
+    }
+
+    /* Only move the cursor past what was actually output. */
+    if (cursor && !rc) {
+        rc = cursor_save(xch, cursor, index);
+    }
+
+out:
     xc_interface_close(xch);
+done:
+    zrc = recwriter_close(out.rw);
+    if (zrc) {
+        ERR("Failed to write records output (%s).", strerror(-zrc));
+        rc = rc ? rc : zrc;
+    }
+    zrc = zstream_close(out.zs);
+    if (zrc) {
+        ERR("Failed to write compressed output (%s).", strerror(-zrc));
+        rc = rc ? rc : zrc;
+    }
+    free(inputs);
+    filter_free(flt);
 
     return -rc;
 }
-
@@ -3,6 +3,8 @@
 
 # include "config.h"
 
+# define _GNU_SOURCE
+
 # ifdef HAVE_ASSERT_H
 #  include <assert.h>
 # endif
@@ -51,11 +53,197 @@
 #  include <unistd.h>
 # endif
 
+# ifdef HAVE_FCNTL_H
+#  include <fcntl.h>
+# endif
+
+# ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+# endif
+
+# ifdef HAVE_TIME_H
+#  include <time.h>
+# endif
+
+# ifdef HAVE_SIGNAL_H
+#  include <signal.h>
+# endif
+
+# ifdef HAVE_SYS_TIME_H
+#  include <sys/time.h>
+# endif
+
+# ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+# endif
+
+# ifdef HAVE_LIMITS_H
+#  include <limits.h>
+# endif
+
+# ifdef HAVE_SYS_SOCKET_H
+#  include <sys/socket.h>
+# endif
+
+# ifdef HAVE_SYS_UN_H
+#  include <sys/un.h>
+# endif
+
+# ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+# endif
+
 # ifdef HAVE_XENCTRL_H
 #  include <xenctrl.h>
 # endif
 
 # include "utils.h"
+# include "evloop.h"
+# include "records.h"
+
+struct filter;
+struct output;
+
+/*
+ * Console ring.
+ */
+# define CONSOLE_RING_SIZE  KB(32)
+# define CONSOLE_BUF_SIZE   KB(64)  /* Streaming buffer, fixed. */
+# define CONSOLE_BUF_ALIGN  KB(4)
+
+int read_console(xc_interface *xch, struct output *out, struct filter *flt,
+                 unsigned int *index);
+
+/*
+ * Compressed output (compress.c).
+ * Independently decodable LZ77 blocks, compressed and written by a worker
+ * thread.
+ */
+struct zstream;
+
+/* Returns NULL and sets errno on failure. */
+struct zstream *zstream_open(int fd);
+int zstream_write(struct zstream *zs, const char *buf, size_t n);
+/* Hand the current block over short if it was started more than a second ago. */
+int zstream_idle(struct zstream *zs);
+/* Write out the last partial block and stop the worker, no-op if @zs is NULL. */
+int zstream_close(struct zstream *zs);
+/* Decompress @in to @out, starting at offset @off of the uncompressed stream. */
+int zstream_decode(int in, int out, uint64_t off);
+
+/*
+ * Binary records output (recwrite.c, layout and reader in records.h).
+ * Text written to the writer is parsed in lines and stored as records on @fd.
+ */
+struct recwriter;
+
+/* Returns NULL and sets errno on failure. */
+struct recwriter *recwriter_open(int fd);
+int recwriter_write(struct recwriter *rw, const char *buf, size_t n);
+/* Write out the current block if it was started more than a second ago. */
+int recwriter_idle(struct recwriter *rw);
+/* Record an incomplete last line and write the last block, no-op if @rw is NULL. */
+int recwriter_close(struct recwriter *rw);
+/* Write the records of @path to @fd as text, one line each. */
+int records_dump(const char *path, int fd);
+
+/*
+ * Output stream.
+ * Text goes through the records writer or the compressed stream when one is
+ * set, straight to @fd otherwise.
+ */
+struct output {
+    int fd;
+    struct recwriter *rw;
+    struct zstream *zs;
+};
+
+/* Write @n bytes of @buf to @out, returns 0 or -errno. */
+int write_all(struct output *out, const char *buf, size_t n);
+/* From idle ticks of the follow loops, write out what was held back too long. */
+int output_idle(struct output *out);
+/* Write @n bytes of @buf to @fd as is. */
+int __write_all(int fd, const char *buf, size_t n);
+
+/*
+ * Console archive (archive.c).
+ * Rotating segment files with a sparse time/offset index.
+ */
+struct archive;
+
+struct archive *archive_open(const char *dir);
+int archive_append(struct archive *ar, const char *buf, size_t n);
+void archive_close(struct archive *ar);
+/* Write what was archived between @since and @until (ns, CLOCK_REALTIME) to @out. */
+int archive_query(const char *dir, uint64_t since, uint64_t until,
+                  struct output *out, struct filter *flt);
+
+/*
+ * Line filters (filter.c).
+ * Lines are kept when they match every criterion given, output written
+ * through a NULL filter is passed as is.
+ */
+# define FILTER_XEN     (1U << 0)   /* "(XEN) " hypervisor lines. */
+# define FILTER_GUEST   (1U << 1)   /* "(dN) " guest lines. */
+
+struct filter *filter_new(unsigned int classes, long domid, const char *match);
+int filter_write(struct filter *f, struct output *out, const char *buf, size_t n);
+/* Single line check for callers doing their own output. */
+int filter_match(struct filter *f, const char *p, size_t n);
+/* Write out the matched lines buffered so far. */
+int filter_flush(struct filter *f, struct output *out);
+/* End of stream, an incomplete last line is filtered too before flushing. */
+int filter_finish(struct filter *f, struct output *out);
+/* Report matched/skipped line counts and release @f. */
+void filter_free(struct filter *f);
+
+/*
+ * Follow mode (follow.c).
+ * Poll the console ring for new output from a timer of @loop, starting at
+ * @index. Fetched bytes are passed to @out, called with a NULL buffer at the
+ * end of each poll. *@stop is set when polling fails. follow_end() must be
+ * called before the loop is finalised.
+ */
+typedef int (*follow_out_fn)(void *arg, const char *buf, size_t n);
+struct follow;
+
+struct follow *follow_start(struct evloop *loop, xc_interface *xch,
+                            unsigned int ring_size, unsigned int index,
+                            follow_out_fn out, void *arg, int *stop);
+/* Returns the polling error if any, *@index is set to where it stopped. */
+int follow_end(struct follow *f, unsigned int *index);
+/* Set *@stop on SIGINT, SIGTERM and SIGHUP, ignore SIGPIPE. */
+int follow_signals(struct evloop *loop, int *stop);
+
+/* Until interrupted, output goes to @ar when not NULL, @out otherwise. */
+int follow_console(xc_interface *xch, unsigned int ring_size, struct archive *ar,
+                   struct output *out, struct filter *flt, unsigned int *index);
+
+/*
+ * Console server (serve.c).
+ * Follow the console ring and publish its output to subscribers of the UNIX
+ * socket @path, late ones first get up to @backlog bytes of past output.
+ */
+int serve_console(xc_interface *xch, const char *path, unsigned long backlog,
+                  unsigned int *index);
+
+/*
+ * Multi-source aggregation (aggregate.c).
+ * Merge the console ring (unless @xch is NULL) and @inputs ([name=]path, "-"
+ * for stdin, "fd:N" for an inherited fd) in a single timestamp ordered,
+ * source tagged stream on @out.
+ */
+int aggregate_console(xc_interface *xch, char **inputs, unsigned int ninputs,
+                      struct output *out, struct filter *flt, unsigned int *index);
+
+/*
+ * Persistent cursor (cursor.c).
+ * A state file keeping the ring index reached and a hash of the bytes before
+ * it, so the next run only outputs what is new.
+ */
+/* Set *@index to where the previous run stopped, 0 to dump the whole ring. */
+int cursor_resume(xc_interface *xch, const char *path, unsigned int *index);
+int cursor_save(xc_interface *xch, const char *path, unsigned int index);
 
 #endif /* !_CONDUMP_H_ */
 
@@ -0,0 +1,184 @@
+#include "condump.h"
+
+/*
+ * Persistent read cursor.
+ *
+ * The console ring index is a free running position kept by the hypervisor,
+ * so the index reached by a run is still meaningful for the next one, unless
+ * the host rebooted in between (the index starts over and the same positions
+ * now hold other text) or the ring wrapped past it.
+ *
+ * Along with the index, the state file keeps a polynomial (Rabin-Karp) hash of
+ * the CURSOR_WINDOW bytes preceding it. On resume, these bytes are read again
+ * from the ring: if the hypervisor returns them from the expected position and
+ * they hash the same, output carries on from the saved index. If they have
+ * been overwritten, carry on anyway and report the gap, if any: the ring may
+ * still hold the saved index. If they differ, or the ring does not reach the
+ * saved index anymore, the ring is not the one we were reading, start over.
+ *
+ * The state file is replaced atomically (written aside, then renamed).
+ */
+#define CURSOR_WINDOW   64
+#define CURSOR_BASE     0x100000001b3ULL    /* Odd multiplier, mod 2^64. */
+#define CURSOR_MAGIC    "condump-cursor 1"
+
+struct cursor {
+    unsigned int index;
+    unsigned int len;       /* Window length, shorter at the start of the ring. */
+    uint64_t hash;
+};
+
+static uint64_t cursor_hash(const char *buf, size_t n)
+{
+    uint64_t h = 0;
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        h = h * CURSOR_BASE + (unsigned char)buf[i];
+    }
+    return h;
+}
+
+/*
+ * Hash the window ending at @index, as the ring holds it now. Returns 0,
+ * -ESPIPE when it was (partly) overwritten or the ring does not reach @index,
+ * or -errno. [@start, @end) is what was read.
+ */
+static int cursor_window(xc_interface *xch, unsigned int index, unsigned int len,
+                         uint64_t *hash, unsigned int *start, unsigned int *end)
+{
+    char buf[CURSOR_WINDOW];
+    unsigned int n = len, idx = index - len;
+
+    if (xc_readconsolering(xch, buf, &n, 0, 1, &idx) < 0) {
+        return -errno;
+    }
+    *start = idx - n;
+    *end = idx;
+    if (*start != index - len || n != len) {
+        return -ESPIPE;
+    }
+    *hash = cursor_hash(buf, n);
+    return 0;
+}
+
+static int cursor_load(const char *path, struct cursor *c)
+{
+    FILE *f;
+    char magic[32];
+    unsigned long long hash;
+    int rc = 0;
+
+    f = fopen(path, "r");
+    if (!f) {
+        return -errno;
+    }
+    if (!fgets(magic, sizeof (magic), f) || strncmp(magic, CURSOR_MAGIC, strlen(CURSOR_MAGIC)) ||
+        fscanf(f, "index %u\nwindow %u\nhash %llx\n", &c->index, &c->len, &hash) != 3 ||
+        c->len > CURSOR_WINDOW || c->len > c->index) {
+        rc = -EILSEQ;
+    }
+    c->hash = hash;
+    fclose(f);
+    return rc;
+}
+
+int cursor_resume(xc_interface *xch, const char *path, unsigned int *index)
+{
+    struct cursor c;
+    unsigned int start, end;
+    uint64_t hash;
+    int rc;
+
+    *index = 0;
+    rc = cursor_load(path, &c);
+    if (rc == -ENOENT) {
+        return 0;
+    }
+    if (rc) {
+        WAR("Ignoring cursor %s (%s), dumping the whole ring.", path, strerror(-rc));
+        return 0;
+    }
+    if (!c.len) {
+        *index = c.index;
+        return 0;
+    }
+
+    rc = cursor_window(xch, c.index, c.len, &hash, &start, &end);
+    switch (rc) {
+        case 0:
+            if (hash != c.hash) {
+                WAR("Console ring changed since the cursor was saved, dumping the whole ring.");
+                return 0;
+            }
+            *index = c.index;
+            return 0;
+        case -ESPIPE:
+            if ((int)(end - c.index) < 0) {
+                /* The ring does not reach the cursor anymore, rebooted. */
+                WAR("Console ring changed since the cursor was saved, dumping the whole ring.");
+                return 0;
+            }
+            if ((int)(start - c.index) > 0) {
+                WAR("Console ring overwritten since the cursor was saved, %u bytes lost.",
+                    start - c.index);
+            }
+            /* Otherwise only the window was overwritten, nothing is lost. */
+            *index = c.index;
+            return 0;
+        default:
+            ERR("Failed to check cursor against the console ring (%s).", strerror(-rc));
+            return rc;
+    }
+}
+
+int cursor_save(xc_interface *xch, const char *path, unsigned int index)
+{
+    struct cursor c = {
+        .index = index,
+        .len = (index < CURSOR_WINDOW) ? index : CURSOR_WINDOW,
+        .hash = 0,
+    };
+    char tmp[PATH_MAX];
+    unsigned int start, end;
+    FILE *f;
+    int rc;
+
+    if (c.len) {
+        rc = cursor_window(xch, c.index, c.len, &c.hash, &start, &end);
+        if (rc == -ESPIPE) {
+            /* Wrapped already, the next run will report the loss. */
+            c.len = 0;
+        } else if (rc) {
+            ERR("Failed to read cursor window (%s).", strerror(-rc));
+            return rc;
+        }
+    }
+
+    if (snprintf(tmp, sizeof (tmp), "%s.tmp", path) >= (int)sizeof (tmp)) {
+        return -ENAMETOOLONG;
+    }
+    f = fopen(tmp, "w");
+    if (!f) {
+        rc = -errno;
+        ERR("Failed to create %s (%s).", tmp, strerror(errno));
+        return rc;
+    }
+    fprintf(f, CURSOR_MAGIC "\nindex %u\nwindow %u\nhash %016llx\n",
+            c.index, c.len, (unsigned long long)c.hash);
+    if (fflush(f) || fsync(fileno(f))) {
+        rc = -errno;
+        fclose(f);
+        unlink(tmp);
+        ERR("Failed to write %s (%s).", tmp, strerror(-rc));
+        return rc;
+    }
+    fclose(f);
+    if (rename(tmp, path)) {
+        rc = -errno;
+        unlink(tmp);
+        ERR("Failed to update cursor %s (%s).", path, strerror(-rc));
+        return rc;
+    }
+    return 0;
+}
@@ -0,0 +1,414 @@
+#include "condump.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define FILTER_X86
+#endif
+
+/*
+ * Console output filtering.
+ *
+ * The hypervisor strips log level markers before the text reaches the
+ * console ring, what is left to classify lines is their prefix: "(XEN) " for
+ * the hypervisor, optionally followed by a "[timestamp] " and a "dN"/"dNvM"
+ * tag when the message is about a domain, and "(dN) " for guest output
+ * going through the console hypercall.
+ *
+ * Chunks are processed as a whole: newlines are found with vector compares,
+ * and the substring is searched for across the chunk rather than line by
+ * line, a line matching when the next occurrence falls within it. Matched
+ * lines are gathered in an output buffer written out when full.
+ */
+#define FILTER_OUT_SIZE     KB(64)
+#define FILTER_LINE_MAX     KB(64)  /* Longer lines are split. */
+
+struct filter {
+    unsigned int classes;   /* FILTER_XEN | FILTER_GUEST, 0 for any. */
+    long domid;             /* -1 for any. */
+    const char *match;      /* Literal substring, NULL for any. */
+    size_t match_len;
+
+    char *carry;            /* Incomplete line from the previous chunk. */
+    size_t carry_len;
+    char *out;
+    size_t out_len;
+
+    unsigned long long matched;
+    unsigned long long skipped;
+};
+
+/*
+ * Scanners, the best one the CPU supports is picked at runtime.
+ */
+static const char *nl_scalar(const char *p, const char *end)
+{
+    for (; p < end; ++p) {
+        if (*p == '\n') {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static const char *sub_scalar(const char *p, const char *end,
+                              const char *s, size_t len)
+{
+    const char *last = end - len;
+
+    if (end - p < (ptrdiff_t)len) {
+        return NULL;
+    }
+    for (; p <= last; ++p) {
+        if (*p == s[0] && !memcmp(p, s, len)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+#ifdef FILTER_X86
+__attribute__((target("sse2")))
+static const char *nl_sse2(const char *p, const char *end)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned int m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+
+        if (m) {
+            return p + __builtin_ctz(m);
+        }
+    }
+    return nl_scalar(p, end);
+}
+
+/*
+ * Candidates are positions where both the first and the last byte of the
+ * substring match, only those are compared in full.
+ */
+__attribute__((target("sse2")))
+static const char *sub_sse2(const char *p, const char *end,
+                            const char *s, size_t len)
+{
+    const __m128i first = _mm_set1_epi8(s[0]);
+    const __m128i last = _mm_set1_epi8(s[len - 1]);
+
+    for (; end - p >= (ptrdiff_t)(16 + len - 1); p += 16) {
+        __m128i f = _mm_loadu_si128((const __m128i *)p);
+        __m128i l = _mm_loadu_si128((const __m128i *)(p + len - 1));
+        unsigned int m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(f, first),
+                                                         _mm_cmpeq_epi8(l, last)));
+
+        while (m) {
+            unsigned int i = __builtin_ctz(m);
+
+            if (!memcmp(p + i, s, len)) {
+                return p + i;
+            }
+            m &= m - 1;
+        }
+    }
+    return sub_scalar(p, end, s, len);
+}
+
+__attribute__((target("avx2")))
+static const char *nl_avx2(const char *p, const char *end)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned int m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+
+        if (m) {
+            return p + __builtin_ctz(m);
+        }
+    }
+    return nl_sse2(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *sub_avx2(const char *p, const char *end,
+                            const char *s, size_t len)
+{
+    const __m256i first = _mm256_set1_epi8(s[0]);
+    const __m256i last = _mm256_set1_epi8(s[len - 1]);
+
+    for (; end - p >= (ptrdiff_t)(32 + len - 1); p += 32) {
+        __m256i f = _mm256_loadu_si256((const __m256i *)p);
+        __m256i l = _mm256_loadu_si256((const __m256i *)(p + len - 1));
+        unsigned int m = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(f, first),
+                                                               _mm256_cmpeq_epi8(l, last)));
+
+        while (m) {
+            unsigned int i = __builtin_ctz(m);
+
+            if (!memcmp(p + i, s, len)) {
+                return p + i;
+            }
+            m &= m - 1;
+        }
+    }
+    return sub_sse2(p, end, s, len);
+}
+#endif /* FILTER_X86 */
+
+static const char *(*find_nl)(const char *p, const char *end) = nl_scalar;
+static const char *(*find_sub)(const char *p, const char *end,
+                               const char *s, size_t len) = sub_scalar;
+
+static void filter_pick_scanners(void)
+{
+#ifdef FILTER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_nl = nl_avx2;
+        find_sub = sub_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        find_nl = nl_sse2;
+        find_sub = sub_sse2;
+    }
+#endif
+}
+
+/*
+ * Line classification.
+ */
+static inline int is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static const char *parse_domid(const char *p, const char *end, long *domid)
+{
+    long d = 0;
+
+    if (p >= end || !is_digit(*p)) {
+        return NULL;
+    }
+    for (; p < end && is_digit(*p); ++p) {
+        d = d * 10 + (*p - '0');
+    }
+    *domid = d;
+    return p;
+}
+
+static unsigned int line_class(const char *p, const char *end, long *domid)
+{
+    const char *q;
+
+    *domid = -1;
+    if (end - p >= 6 && !memcmp(p, "(XEN) ", 6)) {
+        p += 6;
+        if (p < end && *p == '[') {
+            while (p < end && *p != ']') {
+                ++p;
+            }
+            while (++p < end && *p == ' ');
+        }
+        if (p < end && *p == 'd') {
+            q = parse_domid(p + 1, end, domid);
+            if (!q || (q < end && *q != 'v' && *q != ' ' && *q != ':')) {
+                *domid = -1;
+            }
+        }
+        return FILTER_XEN;
+    }
+    if (end - p >= 2 && p[0] == '(' && p[1] == 'd') {
+        q = parse_domid(p + 2, end, domid);
+        if (q && q < end && *q == ')') {
+            return FILTER_GUEST;
+        }
+        *domid = -1;
+    }
+    return 0;
+}
+
+/*
+ * Output.
+ */
+static int filter_out(struct filter *f, struct output *out, const char *p, size_t n)
+{
+    int rc;
+
+    if (f->out_len + n > FILTER_OUT_SIZE) {
+        rc = write_all(out, f->out, f->out_len);
+        if (rc) {
+            return rc;
+        }
+        f->out_len = 0;
+    }
+    if (n > FILTER_OUT_SIZE) {
+        return write_all(out, p, n);
+    }
+    memcpy(f->out + f->out_len, p, n);
+    f->out_len += n;
+    return 0;
+}
+
+static inline int filter_keep_tag(const struct filter *f, const char *p, const char *eol)
+{
+    long domid;
+    unsigned int c;
+
+    if (!f->classes && f->domid < 0) {
+        return 1;
+    }
+    c = line_class(p, eol, &domid);
+    return (!f->classes || (c & f->classes)) && (f->domid < 0 || domid == f->domid);
+}
+
+int filter_match(struct filter *f, const char *p, size_t n)
+{
+    int keep;
+
+    if (!f) {
+        return 1;
+    }
+    keep = filter_keep_tag(f, p, p + n) &&
+           (!f->match || find_sub(p, p + n, f->match, f->match_len));
+    if (keep) {
+        ++f->matched;
+    } else {
+        ++f->skipped;
+    }
+    return keep;
+}
+
+/* Filter the complete lines in [p, end). */
+static int filter_lines(struct filter *f, struct output *out, const char *p, const char *end)
+{
+    const char *hit = NULL;     /* Next substring match in the chunk. */
+    int rc;
+
+    while (p < end) {
+        const char *nl = find_nl(p, end);
+        const char *eol = nl ? nl + 1 : end;
+        int keep = filter_keep_tag(f, p, eol);
+
+        if (keep && f->match) {
+            if (!hit || hit < p) {
+                hit = find_sub(p, end, f->match, f->match_len);
+                if (!hit) {
+                    /* Nothing left to match in this chunk. */
+                    hit = end;
+                }
+            }
+            keep = (hit + f->match_len <= eol);
+        }
+        if (keep) {
+            ++f->matched;
+            rc = filter_out(f, out, p, eol - p);
+            if (rc) {
+                return rc;
+            }
+        } else {
+            ++f->skipped;
+        }
+        p = eol;
+    }
+    return 0;
+}
+
+struct filter *filter_new(unsigned int classes, long domid, const char *match)
+{
+    struct filter *f;
+
+    filter_pick_scanners();
+    f = m_malloc0(sizeof (*f));
+    f->classes = classes;
+    f->domid = domid;
+    if (match && *match) {
+        f->match = match;
+        f->match_len = strlen(match);
+    }
+    f->carry = m_malloc(FILTER_LINE_MAX);
+    f->out = m_malloc(FILTER_OUT_SIZE);
+    return f;
+}
+
+int filter_write(struct filter *f, struct output *out, const char *buf, size_t n)
+{
+    const char *end = buf + n, *nl, *last;
+    int rc;
+
+    if (!f) {
+        return write_all(out, buf, n);
+    }
+
+    /* Complete the line carried over from the previous chunk. */
+    while (f->carry_len && buf < end) {
+        size_t len;
+
+        nl = find_nl(buf, end);
+        len = (nl ? nl + 1 : end) - buf;
+        if (len > FILTER_LINE_MAX - f->carry_len) {
+            len = FILTER_LINE_MAX - f->carry_len;
+        }
+        memcpy(f->carry + f->carry_len, buf, len);
+        f->carry_len += len;
+        buf += len;
+        if (f->carry[f->carry_len - 1] != '\n' && f->carry_len < FILTER_LINE_MAX) {
+            return 0;
+        }
+        rc = filter_lines(f, out, f->carry, f->carry + f->carry_len);
+        f->carry_len = 0;
+        if (rc) {
+            return rc;
+        }
+    }
+
+    /* Keep the trailing incomplete line for later. */
+    for (last = end; last > buf && last[-1] != '\n'; --last);
+    if (end - last >= FILTER_LINE_MAX) {
+        last = end;
+    }
+    rc = filter_lines(f, out, buf, last);
+    if (rc) {
+        return rc;
+    }
+    memcpy(f->carry, last, end - last);
+    f->carry_len = end - last;
+    return 0;
+}
+
+int filter_flush(struct filter *f, struct output *out)
+{
+    int rc;
+
+    if (!f) {
+        return 0;
+    }
+    rc = write_all(out, f->out, f->out_len);
+    f->out_len = 0;
+    return rc;
+}
+
+int filter_finish(struct filter *f, struct output *out)
+{
+    int rc;
+
+    if (!f) {
+        return 0;
+    }
+    if (f->carry_len) {
+        rc = filter_lines(f, out, f->carry, f->carry + f->carry_len);
+        f->carry_len = 0;
+        if (rc) {
+            return rc;
+        }
+    }
+    return filter_flush(f, out);
+}
+
+void filter_free(struct filter *f)
+{
+    if (!f) {
+        return;
+    }
+    fprintf(stderr, "%llu lines matched, %llu skipped.\n", f->matched, f->skipped);
+    free(f->out);
+    free(f->carry);
+    free(f);
+}
@@ -0,0 +1,320 @@
+#include "condump.h"
+
+/*
+ * Follow the hypervisor console ring.
+ *
+ * In incremental mode, xc_readconsolering() starts reading at *index and moves
+ * it past what was returned. The index is a free running position in the
+ * ring, so when the ring got overwritten since the previous call the
+ * hypervisor starts at the oldest byte still available instead, and the gap
+ * between where we asked to start and where the returned data starts is
+ * what was lost.
+ *
+ * Polls are timer driven and their interval adapts to the output rate: aim at
+ * fetching a share of the ring per poll while the console is busy, back off
+ * exponentially while it is quiet. The actual size of the hypervisor ring is
+ * not known, so the share shrinks every time bytes are lost.
+ */
+#define FOLLOW_POLL_MIN     (10ULL * 1000000ULL)    /* ns */
+#define FOLLOW_POLL_MAX     (1000ULL * 1000000ULL)  /* ns */
+#define FOLLOW_SHARE_MIN    4       /* 1/4th of the ring per poll. */
+#define FOLLOW_SHARE_MAX    64
+
+struct follow {
+    struct evloop *loop;
+    struct timer *timer;    /* Next poll. */
+    xc_interface *xch;
+    follow_out_fn out;      /* Where fetched bytes go. */
+    void *arg;
+    int *stop;              /* Set on error. */
+    char *buf;
+    unsigned int size;
+    unsigned int index;     /* See xc_readconsolering(). */
+    int primed;             /* The index is ours (first poll done, or resumed). */
+    uint64_t interval;      /* ns */
+    unsigned int share;     /* Fetch 1/share of the ring per poll. */
+    uint64_t last;          /* Time of the previous poll. */
+    double rate;            /* B/s, moving average. */
+    unsigned long long lost;
+    int rc;
+};
+
+int __write_all(int fd, const char *buf, size_t n)
+{
+    ssize_t nw;
+
+    while (n) {
+        nw = write(fd, buf, n);
+        if (nw < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        buf += nw;
+        n -= nw;
+    }
+    return 0;
+}
+
+int write_all(struct output *out, const char *buf, size_t n)
+{
+    if (out->rw) {
+        return recwriter_write(out->rw, buf, n);
+    }
+    if (out->zs) {
+        return zstream_write(out->zs, buf, n);
+    }
+    return __write_all(out->fd, buf, n);
+}
+
+int output_idle(struct output *out)
+{
+    /* Records and compressed data are only readable once their block is out. */
+    if (out->rw) {
+        return recwriter_idle(out->rw);
+    }
+    return out->zs ? zstream_idle(out->zs) : 0;
+}
+
+static int follow_poll(struct follow *f, uint64_t *got, unsigned int *lost_out)
+{
+    unsigned int n, start, lost;
+    int rc;
+
+    *got = 0;
+    *lost_out = 0;
+    do {
+        start = f->index;
+        n = f->size;
+        if (xc_readconsolering(f->xch, f->buf, &n, 0, 1, &f->index) < 0) {
+            rc = -errno;
+            ERR("xc_readconsolering(): failed (%s).", strerror(errno));
+            return rc;
+        }
+        /* History overwritten before the first poll is not lost. */
+        lost = f->primed ? f->index - n - start : 0;
+        if (lost) {
+            f->lost += lost;
+            *lost_out += lost;
+            WAR("console ring overwritten, %u bytes lost.", lost);
+        }
+        f->primed = 1;
+        rc = f->out(f->arg, f->buf, n);
+        if (rc) {
+            ERR("Failed to output console ring (%s).", strerror(-rc));
+            return rc;
+        }
+        /* Lost bytes were produced too, count them for the rate. */
+        *got += n + lost;
+    } while (n == f->size);
+
+    /* End of the batch, output is not held back until the next poll. */
+    return f->out(f->arg, NULL, 0);
+}
+
+static void follow_adapt(struct follow *f, uint64_t got, unsigned int lost,
+                         uint64_t now)
+{
+    uint64_t elapsed = now - f->last;
+
+    if (lost && f->share < FOLLOW_SHARE_MAX) {
+        f->share *= 2;
+    }
+    if (!got) {
+        f->interval = (f->interval * 2 < FOLLOW_POLL_MAX) ?
+                      f->interval * 2 : FOLLOW_POLL_MAX;
+        return;
+    }
+    if (elapsed) {
+        double r = got * 1e9 / elapsed;
+
+        f->rate = f->rate ? (3 * f->rate + r) / 4 : r;
+    }
+    if (f->rate) {
+        f->interval = (f->size / f->share) * 1e9 / f->rate;
+    }
+    if (f->interval < FOLLOW_POLL_MIN) {
+        f->interval = FOLLOW_POLL_MIN;
+    } else if (f->interval > FOLLOW_POLL_MAX) {
+        f->interval = FOLLOW_POLL_MAX;
+    }
+}
+
+static int follow_tick(struct timer *t)
+{
+    struct follow *f = t->arg;
+    uint64_t got, now;
+    unsigned int lost;
+
+    f->timer = NULL;
+    f->rc = follow_poll(f, &got, &lost);
+    if (f->rc) {
+        *f->stop = 1;
+        return f->rc;
+    }
+    now = evloop_now();
+    follow_adapt(f, got, lost, now);
+    f->last = now;
+
+    f->timer = timer_alloc(f->interval, 0, f, follow_tick);
+    if (!f->timer) {
+        f->rc = -ENOMEM;
+        *f->stop = 1;
+        return f->rc;
+    }
+    timer_add(f->loop, f->timer);
+    return 0;
+}
+
+struct follow *follow_start(struct evloop *loop, xc_interface *xch,
+                            unsigned int ring_size, unsigned int index,
+                            follow_out_fn out, void *arg, int *stop)
+{
+    struct follow *f;
+
+    f = m_malloc0(sizeof (*f));
+    f->loop = loop;
+    f->xch = xch;
+    f->out = out;
+    f->arg = arg;
+    f->stop = stop;
+    f->index = index;
+    f->primed = !!index;
+    f->size = ring_size;
+    f->interval = FOLLOW_POLL_MIN;
+    f->share = FOLLOW_SHARE_MIN;
+    f->buf = m_malloc(f->size);
+    f->last = evloop_now();
+    f->timer = timer_alloc(0, 0, f, follow_tick);
+    if (!f->timer) {
+        free(f->buf);
+        free(f);
+        return NULL;
+    }
+    timer_add(loop, f->timer);
+    return f;
+}
+
+int follow_end(struct follow *f, unsigned int *index)
+{
+    int rc = f->rc;
+
+    if (f->timer) {
+        timer_cancel(f->timer);
+    }
+    if (f->lost) {
+        WAR("%llu bytes lost to console ring overwrites.", f->lost);
+    }
+    *index = f->index;
+    free(f->buf);
+    free(f);
+    return rc;
+}
+
+/*
+ * Standalone follow mode.
+ */
+struct follow_dest {
+    struct archive *ar;     /* Archive output goes to, @out if NULL. */
+    struct output *out;
+    struct filter *flt;     /* Filter for @out. */
+};
+
+static int follow_dest_out(void *arg, const char *buf, size_t n)
+{
+    struct follow_dest *d = arg;
+    int rc;
+
+    if (d->ar) {
+        return buf ? archive_append(d->ar, buf, n) : 0;
+    }
+    if (buf) {
+        return filter_write(d->flt, d->out, buf, n);
+    }
+    /* Matched lines are not held back until the next poll. */
+    rc = filter_flush(d->flt, d->out);
+    return rc ? rc : output_idle(d->out);
+}
+
+static int follow_signal(struct evsignal *s)
+{
+    int *stop = s->arg;
+
+    *stop = 1;
+    return 0;
+}
+
+int follow_signals(struct evloop *loop, int *stop)
+{
+    const int sigs[] = { SIGINT, SIGTERM, SIGHUP };
+    unsigned int i;
+    int rc;
+
+    for (i = 0; i < ARRAY_LEN(sigs); ++i) {
+        struct evsignal *s = evsignal_alloc(sigs[i], stop, follow_signal);
+
+        if (!s) {
+            return -ENOMEM;
+        }
+        rc = evsignal_add(loop, s);
+        if (rc) {
+            ERR("Failed to handle signal %d (%s).", sigs[i], strerror(-rc));
+            free(s);
+            return rc;
+        }
+    }
+    /* Dead readers are reported by write() instead. */
+    signal(SIGPIPE, SIG_IGN);
+    return 0;
+}
+
+int follow_console(xc_interface *xch, unsigned int ring_size, struct archive *ar,
+                   struct output *out, struct filter *flt, unsigned int *index)
+{
+    struct evloop loop;
+    struct follow_dest d = {
+        .ar = ar,
+        .out = out,
+        .flt = flt,
+    };
+    struct follow *f;
+    int stop = 0;
+    int rc, err;
+
+    rc = evloop_init(&loop);
+    if (rc) {
+        ERR("Failed to initialize event loop (%s).", strerror(-rc));
+        return rc;
+    }
+    rc = follow_signals(&loop, &stop);
+    if (rc) {
+        evloop_fini(&loop);
+        return rc;
+    }
+    f = follow_start(&loop, xch, ring_size, *index, follow_dest_out, &d, &stop);
+    if (!f) {
+        evloop_fini(&loop);
+        return -ENOMEM;
+    }
+
+    while (!stop) {
+        struct timeval to = { .tv_sec = 1, .tv_usec = 0 };
+
+        rc = evloop_wait(&loop, &to);
+        if (rc && rc != -EINTR) {
+            ERR("Event loop failed (%s).", strerror(-rc));
+            break;
+        }
+        rc = 0;
+    }
+    err = follow_end(f, index);
+    rc = rc ? rc : err;
+    if (!ar) {
+        err = filter_finish(flt, out);
+        rc = rc ? rc : err;
+    }
+
+    evloop_fini(&loop);
+    return rc;
+}
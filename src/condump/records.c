@@ -0,0 +1,127 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "records.h"
+
+/*
+ * Console records file reader, see records.h for the layout.
+ * Only depends on libc so it can be built into analysis tools as is.
+ */
+struct rec_file {
+    const uint8_t *map;
+    size_t size;
+    size_t pos;             /* Next block. */
+};
+
+struct rec_file *rec_open(const char *path)
+{
+    struct rec_file *f;
+    const struct rec_file_hdr *hdr;
+    struct stat st;
+    int fd, err;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st)) {
+        goto fail;
+    }
+    if ((size_t)st.st_size < sizeof (*hdr)) {
+        errno = EILSEQ;
+        goto fail;
+    }
+    f = calloc(1, sizeof (*f));
+    if (!f) {
+        goto fail;
+    }
+    f->size = st.st_size;
+    f->map = mmap(NULL, f->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (f->map == MAP_FAILED) {
+        free(f);
+        goto fail;
+    }
+    close(fd);
+
+    hdr = (const struct rec_file_hdr *)f->map;
+    if (memcmp(hdr->magic, REC_FILE_MAGIC, sizeof (hdr->magic)) ||
+        hdr->hdr_size < sizeof (*hdr) || hdr->hdr_size > f->size ||
+        hdr->hdr_size != REC_ALIGN(hdr->hdr_size)) {
+        rec_close(f);
+        errno = EILSEQ;
+        return NULL;
+    }
+    f->pos = hdr->hdr_size;
+    return f;
+
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+}
+
+static const void *rec_column(const uint8_t **p, size_t len)
+{
+    const void *col = *p;
+
+    *p += REC_ALIGN(len);
+    return col;
+}
+
+int rec_next(struct rec_file *f, struct rec_block *b)
+{
+    const struct rec_block_hdr *hdr;
+    const uint8_t *p;
+    uint32_t i;
+
+    if (f->size - f->pos < sizeof (*hdr)) {
+        return 0;
+    }
+    hdr = (const struct rec_block_hdr *)(f->map + f->pos);
+    if (hdr->magic != REC_BLOCK_MAGIC ||
+        hdr->size != rec_block_size(hdr->count, hdr->heap_len)) {
+        return -EILSEQ;
+    }
+    if (hdr->size > f->size - f->pos) {
+        /* Still being written. */
+        return 0;
+    }
+
+    p = (const uint8_t *)(hdr + 1);
+    b->count = hdr->count;
+    b->ts = rec_column(&p, hdr->count * sizeof (uint64_t));
+    b->off = rec_column(&p, hdr->count * sizeof (uint64_t));
+    b->text = rec_column(&p, hdr->count * sizeof (uint32_t));
+    b->len = rec_column(&p, hdr->count * sizeof (uint32_t));
+    b->msg = rec_column(&p, hdr->count * sizeof (uint16_t));
+    b->domain = rec_column(&p, hdr->count * sizeof (uint16_t));
+    b->cpu = rec_column(&p, hdr->count * sizeof (uint16_t));
+    b->level = rec_column(&p, hdr->count * sizeof (uint8_t));
+    b->flags = rec_column(&p, hdr->count * sizeof (uint8_t));
+    b->heap = rec_column(&p, hdr->heap_len);
+    b->heap_len = hdr->heap_len;
+
+    for (i = 0; i < b->count; ++i) {
+        if (b->text[i] > b->heap_len || b->len[i] > b->heap_len - b->text[i] ||
+            b->msg[i] > b->len[i]) {
+            return -EILSEQ;
+        }
+    }
+    f->pos += hdr->size;
+    return 1;
+}
+
+void rec_close(struct rec_file *f)
+{
+    if (!f) {
+        return;
+    }
+    munmap((void *)f->map, f->size);
+    free(f);
+}
@@ -0,0 +1,109 @@
+#ifndef _RECORDS_H_
+# define _RECORDS_H_
+
+/*
+ * Console records file (condump -b).
+ *
+ * Each console line is parsed once into a fixed layout record. Records are
+ * stored by column, in blocks appended as they fill up, so the file can be
+ * mapped and scanned without parsing text again:
+ *
+ *   struct rec_file_hdr
+ *   block: struct rec_block_hdr
+ *          uint64_t ts[count]        timestamp, ns, see REC_TS_*
+ *          uint64_t off[count]       offset of the line in the text output
+ *          uint32_t text[count]      offset of the line in the heap
+ *          uint32_t len[count]       length of the line, newline excluded
+ *          uint16_t msg[count]       offset of the message in the line,
+ *                                    past the prefixes parsed
+ *          uint16_t domain[count]    REC_NONE when not tagged
+ *          uint16_t cpu[count]       vcpu or pcpu, REC_NONE when not given
+ *          uint8_t level[count]      syslog like 0-7, REC_LEVEL_NONE
+ *          uint8_t flags[count]      REC_*
+ *          char heap[heap_len]       line text
+ *   block...
+ *
+ * Every column starts on an 8 byte boundary (REC_ALIGN). Values are in host
+ * byte order. A block still being written when the file is read is ignored.
+ *
+ * This header only depends on <stdint.h> and <stddef.h> so analysis tools can
+ * use the reader (records.c) on its own.
+ */
+# include <stdint.h>
+# include <stddef.h>
+
+# define REC_FILE_MAGIC     "CDRECS01"
+# define REC_BLOCK_MAGIC    0x6b6c6263U     /* "cblk" */
+
+# define REC_ALIGN(x)       (((x) + 7) & ~(size_t)7)
+
+# define REC_NONE           0xffff
+# define REC_LEVEL_NONE     0xff
+
+/* Line source. */
+# define REC_XEN            (1U << 0)   /* "(XEN) " hypervisor line. */
+# define REC_GUEST          (1U << 1)   /* "(dN) " guest line. */
+/* Timestamp, none of these when ts is 0. */
+# define REC_TS_UPTIME      (1U << 2)   /* Hypervisor "[s.us]" stamp, since boot. */
+# define REC_TS_DATE        (1U << 3)   /* Hypervisor "[Y-m-d H:M:S]" stamp, UTC. */
+# define REC_TS_REALTIME    (1U << 4)   /* condump -i "s.us name: " stamp, UTC. */
+# define REC_SPLIT          (1U << 5)   /* Line too long, continued in the next record. */
+
+struct rec_file_hdr {
+    char magic[8];
+    uint32_t hdr_size;
+    uint32_t pad;
+};
+
+struct rec_block_hdr {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t heap_len;
+    uint32_t size;          /* Whole block, header included. */
+    uint64_t pad;
+};
+
+/* Size of a block holding @count records and @heap_len bytes of text. */
+static inline size_t rec_block_size(uint32_t count, uint32_t heap_len)
+{
+    return sizeof (struct rec_block_hdr) +
+           2 * REC_ALIGN(count * sizeof (uint64_t)) +
+           2 * REC_ALIGN(count * sizeof (uint32_t)) +
+           3 * REC_ALIGN(count * sizeof (uint16_t)) +
+           2 * REC_ALIGN(count * sizeof (uint8_t)) +
+           REC_ALIGN(heap_len);
+}
+
+/*
+ * Reader.
+ */
+struct rec_block {
+    uint32_t count;
+    const uint64_t *ts;
+    const uint64_t *off;
+    const uint32_t *text;
+    const uint32_t *len;
+    const uint16_t *msg;
+    const uint16_t *domain;
+    const uint16_t *cpu;
+    const uint8_t *level;
+    const uint8_t *flags;
+    const char *heap;
+    uint32_t heap_len;
+};
+
+struct rec_file;
+
+/* Map @path, returns NULL with errno set on failure. */
+struct rec_file *rec_open(const char *path);
+/* Point @b at the next block, returns 1, 0 past the last one, or -EILSEQ. */
+int rec_next(struct rec_file *f, struct rec_block *b);
+void rec_close(struct rec_file *f);
+
+/* Text of record @i, not NUL terminated, rec_block.len[i] bytes long. */
+static inline const char *rec_text(const struct rec_block *b, uint32_t i)
+{
+    return b->heap + b->text[i];
+}
+
+#endif /* !_RECORDS_H_ */
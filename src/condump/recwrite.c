@@ -0,0 +1,468 @@
+#include "condump.h"
+
+/*
+ * Console records writer (condump -b).
+ *
+ * Text written to the output goes through here instead: it is cut in lines,
+ * each parsed once for the prefixes the hypervisor and condump put in front
+ * of messages, and stored as a record in column arrays. Full blocks are laid
+ * out as described in records.h and written in one go. While following, a
+ * block is also written out once it has been open for REC_IDLE_FLUSH, so
+ * readers of the file are not kept waiting on a quiet console.
+ *
+ * Recognised prefixes, in order:
+ *   "<s>.<us> <name>: "        condump -i aggregation stamp (REC_TS_REALTIME)
+ *   "(XEN) "                   hypervisor line (REC_XEN)
+ *     "[<s>.<us>] "            uptime stamp (REC_TS_UPTIME)
+ *     "[Y-m-d H:M:S[.ms]] "    date stamp (REC_TS_DATE)
+ *   "(dN) "                    guest line (REC_GUEST), domain N
+ *   "<L> "                     log level, 0-7, when not stripped already
+ * The message then gives the domain and cpu when it starts with a "dNvM" tag
+ * (domain N, vcpu M) or a "CPUn" one (physical cpu n).
+ */
+#define REC_BLOCK_RECORDS   KB(8)
+#define REC_HEAP_SIZE       MB(1)
+#define REC_LINE_MAX        KB(16)  /* Longer lines are split (REC_SPLIT). */
+#define REC_IDLE_FLUSH      (1000ULL * 1000000ULL)  /* ns */
+
+struct record {
+    uint64_t ts;
+    uint16_t msg;
+    uint16_t domain;
+    uint16_t cpu;
+    uint8_t level;
+    uint8_t flags;
+};
+
+struct recwriter {
+    int fd;
+    uint64_t off;           /* Text offset of the next line. */
+    char *carry;            /* Incomplete line from the previous write. */
+    size_t carry_len;
+
+    uint32_t count;
+    uint64_t started;       /* When the first record of the block came in. */
+    uint64_t ts[REC_BLOCK_RECORDS];
+    uint64_t offs[REC_BLOCK_RECORDS];
+    uint32_t text[REC_BLOCK_RECORDS];
+    uint32_t len[REC_BLOCK_RECORDS];
+    uint16_t msg[REC_BLOCK_RECORDS];
+    uint16_t domain[REC_BLOCK_RECORDS];
+    uint16_t cpu[REC_BLOCK_RECORDS];
+    uint8_t level[REC_BLOCK_RECORDS];
+    uint8_t flags[REC_BLOCK_RECORDS];
+    char *heap;
+    uint32_t heap_len;
+
+    char *out;              /* Block being laid out. */
+};
+
+/*
+ * Parsing.
+ */
+static inline int is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+/* Parse a decimal number, returns the end of it or NULL. */
+static const char *parse_num(const char *p, const char *end, uint64_t *v,
+                             unsigned int *ndigits)
+{
+    const char *s = p;
+
+    *v = 0;
+    for (; p < end && is_digit(*p); ++p) {
+        *v = *v * 10 + (*p - '0');
+    }
+    if (ndigits) {
+        *ndigits = p - s;
+    }
+    return (p == s) ? NULL : p;
+}
+
+/* "<s>.<frac>", returns the end of it or NULL, @ts in ns. */
+static const char *parse_stamp(const char *p, const char *end, uint64_t *ts)
+{
+    uint64_t s, frac;
+    unsigned int n;
+
+    p = parse_num(p, end, &s, NULL);
+    if (!p || p >= end || *p != '.') {
+        return NULL;
+    }
+    p = parse_num(p + 1, end, &frac, &n);
+    if (!p || n > 9) {
+        return NULL;
+    }
+    for (; n < 9; ++n) {
+        frac *= 10;
+    }
+    *ts = s * 1000000000ULL + frac;
+    return p;
+}
+
+/* "Y-m-d H:M:S[.ms]", returns the end of it or NULL, @ts in ns. */
+static const char *parse_date(const char *p, const char *end, uint64_t *ts)
+{
+    static const char seps[] = "-- ::";
+    uint64_t v[6], ms = 0;
+    unsigned int i, n;
+    struct tm tm;
+    time_t t;
+
+    for (i = 0; i < ARRAY_LEN(v); ++i) {
+        p = parse_num(p, end, &v[i], NULL);
+        if (!p || (i < 5 && (p >= end || *p++ != seps[i]))) {
+            return NULL;
+        }
+    }
+    if (p < end && *p == '.') {
+        p = parse_num(p + 1, end, &ms, &n);
+        if (!p || n != 3) {
+            return NULL;
+        }
+    }
+    memset(&tm, 0, sizeof (tm));
+    tm.tm_year = v[0] - 1900;
+    tm.tm_mon = v[1] - 1;
+    tm.tm_mday = v[2];
+    tm.tm_hour = v[3];
+    tm.tm_min = v[4];
+    tm.tm_sec = v[5];
+    t = timegm(&tm);
+    if (t == (time_t)-1) {
+        return NULL;
+    }
+    *ts = (uint64_t)t * 1000000000ULL + ms * 1000000ULL;
+    return p;
+}
+
+static const char *skip_spaces(const char *p, const char *end)
+{
+    while (p < end && *p == ' ') {
+        ++p;
+    }
+    return p;
+}
+
+/* "dN[vM]" or "CPUn" at the start of the message. */
+static void parse_tag(const char *p, const char *end, struct record *r)
+{
+    uint64_t d, c;
+
+    if (end - p >= 3 && !memcmp(p, "CPU", 3)) {
+        p = parse_num(p + 3, end, &c, NULL);
+        if (p && c < REC_NONE) {
+            r->cpu = c;
+        }
+        return;
+    }
+    if (p >= end || *p != 'd') {
+        return;
+    }
+    p = parse_num(p + 1, end, &d, NULL);
+    if (!p || d >= REC_NONE) {
+        return;
+    }
+    if (p < end && *p == 'v') {
+        p = parse_num(p + 1, end, &c, NULL);
+        if (!p || c >= REC_NONE) {
+            return;
+        }
+        r->cpu = c;
+    }
+    if (p == end || *p == ' ' || *p == ':') {
+        r->domain = d;
+    } else {
+        r->cpu = REC_NONE;
+    }
+}
+
+static void rec_parse(const char *line, size_t n, struct record *r)
+{
+    const char *p = line, *end = line + n, *q;
+    uint64_t v;
+
+    r->ts = 0;
+    r->domain = REC_NONE;
+    r->cpu = REC_NONE;
+    r->level = REC_LEVEL_NONE;
+    r->flags = 0;
+
+    /* condump -i stamp and source name. */
+    q = parse_stamp(p, end, &v);
+    if (q && q < end && *q == ' ') {
+        const char *name = q + 1;
+
+        for (q = name; q < end && *q != ' ' && *q != ':'; ++q);
+        if (end - q >= 2 && q[0] == ':' && q[1] == ' ' && q > name) {
+            r->ts = v;
+            r->flags |= REC_TS_REALTIME;
+            p = q + 2;
+        }
+    }
+
+    if (end - p >= 6 && !memcmp(p, "(XEN) ", 6)) {
+        r->flags |= REC_XEN;
+        p += 6;
+        if (p < end && *p == '[') {
+            q = skip_spaces(p + 1, end);
+            if (!(r->flags & REC_TS_REALTIME)) {
+                const char *s;
+
+                if ((s = parse_stamp(q, end, &v)) && s < end && *s == ']') {
+                    r->ts = v;
+                    r->flags |= REC_TS_UPTIME;
+                } else if ((s = parse_date(q, end, &v)) && s < end && *s == ']') {
+                    r->ts = v;
+                    r->flags |= REC_TS_DATE;
+                }
+            }
+            q = memchr(q, ']', end - q);
+            if (q) {
+                p = skip_spaces(q + 1, end);
+            }
+        }
+    } else if (end - p >= 2 && p[0] == '(' && p[1] == 'd') {
+        q = parse_num(p + 2, end, &v, NULL);
+        if (q && end - q >= 2 && q[0] == ')' && q[1] == ' ' && v < REC_NONE) {
+            r->flags |= REC_GUEST;
+            r->domain = v;
+            p = q + 2;
+        }
+    }
+
+    if (end - p >= 3 && p[0] == '<' && p[1] >= '0' && p[1] <= '7' && p[2] == '>') {
+        r->level = p[1] - '0';
+        p = skip_spaces(p + 3, end);
+    }
+    if (r->domain == REC_NONE) {
+        parse_tag(p, end, r);
+    }
+    r->msg = p - line;
+}
+
+/*
+ * Output.
+ */
+static int recwriter_flush(struct recwriter *rw)
+{
+    struct rec_block_hdr hdr = {
+        .magic = REC_BLOCK_MAGIC,
+        .count = rw->count,
+        .heap_len = rw->heap_len,
+        .size = rec_block_size(rw->count, rw->heap_len),
+        .pad = 0,
+    };
+    char *p = rw->out;
+    int rc;
+
+    if (!rw->count) {
+        return 0;
+    }
+#define REC_PUT(src, len)                           \
+    do {                                            \
+        memcpy(p, (src), (len));                    \
+        memset(p + (len), 0, REC_ALIGN(len) - (len)); \
+        p += REC_ALIGN(len);                        \
+    } while (0)
+    REC_PUT(&hdr, sizeof (hdr));
+    REC_PUT(rw->ts, rw->count * sizeof (rw->ts[0]));
+    REC_PUT(rw->offs, rw->count * sizeof (rw->offs[0]));
+    REC_PUT(rw->text, rw->count * sizeof (rw->text[0]));
+    REC_PUT(rw->len, rw->count * sizeof (rw->len[0]));
+    REC_PUT(rw->msg, rw->count * sizeof (rw->msg[0]));
+    REC_PUT(rw->domain, rw->count * sizeof (rw->domain[0]));
+    REC_PUT(rw->cpu, rw->count * sizeof (rw->cpu[0]));
+    REC_PUT(rw->level, rw->count * sizeof (rw->level[0]));
+    REC_PUT(rw->flags, rw->count * sizeof (rw->flags[0]));
+    REC_PUT(rw->heap, rw->heap_len);
+#undef REC_PUT
+    assert((size_t)(p - rw->out) == hdr.size);
+
+    rc = __write_all(rw->fd, rw->out, hdr.size);
+    rw->count = 0;
+    rw->heap_len = 0;
+    return rc;
+}
+
+/* Record one line, @n excludes the newline, @eol_len is 0 or 1. */
+static int recwriter_line(struct recwriter *rw, const char *line, size_t n,
+                          size_t eol_len, int split)
+{
+    struct record r;
+    uint32_t i;
+    int rc;
+
+    if (rw->count == REC_BLOCK_RECORDS || n > REC_HEAP_SIZE - rw->heap_len) {
+        rc = recwriter_flush(rw);
+        if (rc) {
+            return rc;
+        }
+    }
+    rec_parse(line, n, &r);
+
+    if (!rw->count) {
+        rw->started = evloop_now();
+    }
+    i = rw->count++;
+    rw->ts[i] = r.ts;
+    rw->offs[i] = rw->off;
+    rw->text[i] = rw->heap_len;
+    rw->len[i] = n;
+    rw->msg[i] = r.msg;
+    rw->domain[i] = r.domain;
+    rw->cpu[i] = r.cpu;
+    rw->level[i] = r.level;
+    rw->flags[i] = r.flags | (split ? REC_SPLIT : 0);
+    memcpy(rw->heap + rw->heap_len, line, n);
+    rw->heap_len += n;
+    rw->off += n + eol_len;
+    return 0;
+}
+
+struct recwriter *recwriter_open(int fd)
+{
+    struct rec_file_hdr hdr = {
+        .hdr_size = sizeof (hdr),
+        .pad = 0,
+    };
+    struct recwriter *rw;
+    int rc;
+
+    memcpy(hdr.magic, REC_FILE_MAGIC, sizeof (hdr.magic));
+    rc = __write_all(fd, (const char *)&hdr, sizeof (hdr));
+    if (rc) {
+        errno = -rc;
+        return NULL;
+    }
+    rw = m_malloc0(sizeof (*rw));
+    rw->fd = fd;
+    rw->carry = m_malloc(REC_LINE_MAX);
+    rw->heap = m_malloc(REC_HEAP_SIZE);
+    rw->out = m_malloc(rec_block_size(REC_BLOCK_RECORDS, REC_HEAP_SIZE));
+    return rw;
+}
+
+int recwriter_write(struct recwriter *rw, const char *buf, size_t n)
+{
+    const char *end = buf + n, *nl;
+    size_t len;
+    int rc;
+
+    while (buf < end) {
+        nl = memchr(buf, '\n', end - buf);
+        len = (nl ? nl : end) - buf;
+
+        if (!rw->carry_len && nl && len <= REC_LINE_MAX) {
+            /* Whole line in the buffer, the common case. */
+            rc = recwriter_line(rw, buf, len, 1, 0);
+            if (rc) {
+                return rc;
+            }
+            buf = nl + 1;
+            continue;
+        }
+
+        if (len > REC_LINE_MAX - rw->carry_len) {
+            len = REC_LINE_MAX - rw->carry_len;
+            nl = NULL;
+        }
+        memcpy(rw->carry + rw->carry_len, buf, len);
+        rw->carry_len += len;
+        buf += len + (nl ? 1 : 0);
+        if (nl || rw->carry_len == REC_LINE_MAX) {
+            rc = recwriter_line(rw, rw->carry, rw->carry_len, nl ? 1 : 0, !nl);
+            rw->carry_len = 0;
+            if (rc) {
+                return rc;
+            }
+        }
+    }
+    return 0;
+}
+
+int recwriter_idle(struct recwriter *rw)
+{
+    if (!rw->count || evloop_now() - rw->started < REC_IDLE_FLUSH) {
+        return 0;
+    }
+    return recwriter_flush(rw);
+}
+
+int recwriter_close(struct recwriter *rw)
+{
+    int rc = 0;
+
+    if (!rw) {
+        return 0;
+    }
+    if (rw->carry_len) {
+        rc = recwriter_line(rw, rw->carry, rw->carry_len, 0, 0);
+    }
+    if (!rc) {
+        rc = recwriter_flush(rw);
+    }
+    free(rw->out);
+    free(rw->heap);
+    free(rw->carry);
+    free(rw);
+    return rc;
+}
+
+/*
+ * Read back as text, one record per line:
+ *   <ts> <xen|guest|-> <domain|-> <cpu|-> <level|-> <message>
+ */
+int records_dump(const char *path, int fd)
+{
+    struct rec_file *f;
+    struct rec_block b;
+    FILE *out;
+    uint32_t i;
+    int rc;
+
+    f = rec_open(path);
+    if (!f) {
+        return -errno;
+    }
+    out = fdopen(dup(fd), "w");
+    if (!out) {
+        rc = -errno;
+        rec_close(f);
+        return rc;
+    }
+    while ((rc = rec_next(f, &b)) > 0) {
+        for (i = 0; i < b.count; ++i) {
+            const char *src = (b.flags[i] & REC_XEN) ? "xen" :
+                              (b.flags[i] & REC_GUEST) ? "guest" : "-";
+
+            fprintf(out, "%llu.%09llu %s ",
+                    (unsigned long long)(b.ts[i] / 1000000000ULL),
+                    (unsigned long long)(b.ts[i] % 1000000000ULL), src);
+            if (b.domain[i] != REC_NONE) {
+                fprintf(out, "%u ", b.domain[i]);
+            } else {
+                fputs("- ", out);
+            }
+            if (b.cpu[i] != REC_NONE) {
+                fprintf(out, "%u ", b.cpu[i]);
+            } else {
+                fputs("- ", out);
+            }
+            if (b.level[i] != REC_LEVEL_NONE) {
+                fprintf(out, "%u ", b.level[i]);
+            } else {
+                fputs("- ", out);
+            }
+            fwrite(rec_text(&b, i) + b.msg[i], 1, b.len[i] - b.msg[i], out);
+            fputc('\n', out);
+        }
+    }
+    if (fclose(out) && !rc) {
+        rc = -errno;
+    }
+    rec_close(f);
+    return rc;
+}
@@ -0,0 +1,359 @@
+#include "condump.h"
+
+/*
+ * Console server.
+ *
+ * The console ring is followed once, and what it produces is published to any
+ * number of local subscribers connected to a UNIX stream socket, so agents on
+ * the host no longer poll the hypervisor each on their own.
+ *
+ * Published data is kept in a ring of its own, larger than the hypervisor's,
+ * with a free running head. Every subscriber has a position in it: new ones
+ * start up to the backlog asked for back (on a line boundary), then are fed
+ * from the event loop as their socket accepts data, never blocking the
+ * reader. A subscriber falling more than the ring size behind skips ahead to
+ * the oldest line still held, and is told how much it missed with a line of
+ * its own:
+ *
+ *   (condump) <n> bytes dropped, subscriber too slow.
+ *
+ * Subscribers are only expected to read, anything they send is discarded. One
+ * shutting down its sending side is still fed, it is only dropped once
+ * sending to it fails.
+ */
+#define SERVE_RING_MIN      MB(1)
+#define SERVE_LISTEN_BACKLOG 16
+#define SERVE_SUBS_MAX      256     /* select() based loop, keep well under FD_SETSIZE. */
+#define SERVE_NOTE_MAX      80
+
+struct server;
+
+struct serve_sub {
+    struct list_head l;
+    struct server *srv;
+    struct event *ev;
+    uint64_t pos;               /* Next byte to send, in published bytes. */
+    char note[SERVE_NOTE_MAX];  /* Drop notice, sent before data. */
+    size_t note_len;
+    size_t note_off;
+    unsigned long long dropped; /* Not reported in a notice yet. */
+    int mid_line;               /* Last byte sent was not a newline. */
+    int reading;                /* The subscriber did not shut down its side. */
+};
+
+struct server {
+    struct evloop loop;
+    const char *path;
+    int fd;
+    struct event *ev;
+    char *ring;
+    uint64_t size;              /* Power of 2. */
+    uint64_t head;              /* Bytes published since start. */
+    uint64_t backlog;
+    struct list_head subs;
+    unsigned int nsubs;
+    unsigned long long dropped;
+    int stop;
+};
+
+static inline uint64_t serve_tail(const struct server *srv)
+{
+    return (srv->head > srv->size) ? srv->head - srv->size : 0;
+}
+
+/* Move @pos just past the next newline, if the ring holds one. */
+static uint64_t serve_skip_line(const struct server *srv, uint64_t pos)
+{
+    uint64_t p;
+
+    if (!pos) {
+        return pos;
+    }
+    /* The byte before the tail is gone, it could have been anything. */
+    if (pos > serve_tail(srv) && srv->ring[(pos - 1) & (srv->size - 1)] == '\n') {
+        return pos;
+    }
+    for (p = pos; p < srv->head; ++p) {
+        if (srv->ring[p & (srv->size - 1)] == '\n') {
+            return p + 1;
+        }
+    }
+    return pos;
+}
+
+static void serve_sub_free(struct serve_sub *sub)
+{
+    struct server *srv = sub->srv;
+
+    event_mark_release(sub->ev);
+    close(sub->ev->fd);
+    list_del(&sub->l);
+    --srv->nsubs;
+    free(sub);
+}
+
+/* Send what @sub has pending, returns 0 or -errno when it should be dropped. */
+static int serve_sub_send(struct serve_sub *sub)
+{
+    struct server *srv = sub->srv;
+    uint64_t off, len;
+    ssize_t n;
+
+    if (sub->pos < serve_tail(srv)) {
+        uint64_t skip = serve_skip_line(srv, serve_tail(srv));
+
+        sub->dropped += skip - sub->pos;
+        srv->dropped += skip - sub->pos;
+        sub->pos = skip;
+    }
+
+    /* A notice being sent is never rewritten, later drops get the next one. */
+    for (;;) {
+        while (sub->note_off < sub->note_len) {
+            n = send(sub->ev->fd, sub->note + sub->note_off, sub->note_len - sub->note_off,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0) {
+                return (errno == EAGAIN || errno == EINTR) ? 0 : -errno;
+            }
+            sub->note_off += n;
+        }
+        if (!sub->dropped) {
+            break;
+        }
+        sub->note_len = snprintf(sub->note, sizeof (sub->note),
+                                 "%s(condump) %llu bytes dropped, subscriber too slow.\n",
+                                 sub->mid_line ? "\n" : "", sub->dropped);
+        sub->note_off = 0;
+        sub->dropped = 0;
+        sub->mid_line = 0;
+    }
+
+    while (sub->pos < srv->head) {
+        off = sub->pos & (srv->size - 1);
+        len = srv->head - sub->pos;
+        if (len > srv->size - off) {
+            len = srv->size - off;
+        }
+        n = send(sub->ev->fd, srv->ring + off, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EINTR) ? 0 : -errno;
+        }
+        sub->pos += n;
+        sub->mid_line = n && (srv->ring[off + n - 1] != '\n');
+    }
+    return 0;
+}
+
+static void serve_sub_update(struct serve_sub *sub)
+{
+    int pending = (sub->pos < sub->srv->head) || (sub->note_off < sub->note_len);
+
+    sub->ev->want = (sub->reading ? EV_READ : 0) | (pending ? EV_WRITE : 0);
+}
+
+static int serve_sub_ready(struct event *ev)
+{
+    struct serve_sub *sub = ev->arg;
+    char buf[256];
+    ssize_t n;
+    int rc;
+
+    if (sub->reading) {
+        n = recv(ev->fd, buf, sizeof (buf), MSG_DONTWAIT);
+        /* Nothing more will come in, whether it still reads is up to send(). */
+        if (!n || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            sub->reading = 0;
+        }
+    }
+    rc = serve_sub_send(sub);
+    if (rc) {
+        if (rc != -EPIPE && rc != -ECONNRESET) {
+            WAR("Dropping subscriber (%s).", strerror(-rc));
+        }
+        serve_sub_free(sub);
+        return 0;
+    }
+    serve_sub_update(sub);
+    return 0;
+}
+
+static int serve_accept(struct event *ev)
+{
+    struct server *srv = ev->arg;
+    struct serve_sub *sub;
+    uint64_t back;
+    int fd;
+
+    fd = accept4(ev->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            WAR("accept(): failed (%s).", strerror(errno));
+        }
+        return 0;
+    }
+    if (srv->nsubs >= SERVE_SUBS_MAX) {
+        WAR("Too many subscribers, refusing a new one.");
+        close(fd);
+        return 0;
+    }
+
+    sub = m_malloc0(sizeof (*sub));
+    sub->srv = srv;
+    back = (srv->backlog < srv->head) ? srv->backlog : srv->head;
+    if (back > srv->size) {
+        back = srv->size;
+    }
+    sub->pos = serve_skip_line(srv, srv->head - back);
+    sub->reading = 1;
+    sub->ev = event_alloc(fd, sub, serve_sub_ready);
+    if (!sub->ev) {
+        close(fd);
+        free(sub);
+        return 0;
+    }
+    list_add_tail(&sub->l, &srv->subs);
+    ++srv->nsubs;
+    event_add(&srv->loop, sub->ev);
+    serve_sub_update(sub);
+    return 0;
+}
+
+static int serve_publish(void *arg, const char *buf, size_t n)
+{
+    struct server *srv = arg;
+    struct serve_sub *sub;
+    uint64_t off, len;
+
+    if (!buf) {
+        return 0;
+    }
+    if (n > srv->size) {
+        srv->head += n - srv->size;
+        buf += n - srv->size;
+        n = srv->size;
+    }
+    while (n) {
+        off = srv->head & (srv->size - 1);
+        len = (n < srv->size - off) ? n : srv->size - off;
+        memcpy(srv->ring + off, buf, len);
+        srv->head += len;
+        buf += len;
+        n -= len;
+    }
+    list_for_each_entry(sub, &srv->subs, l) {
+        sub->ev->want |= EV_WRITE;
+    }
+    return 0;
+}
+
+static int serve_listen(struct server *srv)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int rc;
+
+    if (strlen(srv->path) >= sizeof (addr.sun_path)) {
+        ERR("Socket path %s is too long.", srv->path);
+        return -ENAMETOOLONG;
+    }
+    memset(&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, srv->path);
+
+    /* Left over by a previous server. */
+    if (!lstat(srv->path, &st) && S_ISSOCK(st.st_mode)) {
+        unlink(srv->path);
+    }
+
+    srv->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (srv->fd < 0) {
+        rc = -errno;
+        ERR("socket(): failed (%s).", strerror(errno));
+        return rc;
+    }
+    if (bind(srv->fd, (struct sockaddr *)&addr, sizeof (addr)) ||
+        listen(srv->fd, SERVE_LISTEN_BACKLOG)) {
+        rc = -errno;
+        ERR("Failed to listen on %s (%s).", srv->path, strerror(errno));
+        close(srv->fd);
+        srv->fd = -1;
+        return rc;
+    }
+    srv->ev = event_alloc(srv->fd, srv, serve_accept);
+    if (!srv->ev) {
+        close(srv->fd);
+        srv->fd = -1;
+        unlink(srv->path);
+        return -ENOMEM;
+    }
+    event_add(&srv->loop, srv->ev);
+    return 0;
+}
+
+int serve_console(xc_interface *xch, const char *path, unsigned long backlog,
+                  unsigned int *index)
+{
+    struct server srv;
+    struct serve_sub *sub, *tsub;
+    struct follow *f = NULL;
+    int rc, err;
+
+    memset(&srv, 0, sizeof (srv));
+    INIT_LIST_HEAD(&srv.subs);
+    srv.path = path;
+    srv.fd = -1;
+    srv.backlog = backlog;
+    for (srv.size = SERVE_RING_MIN; srv.size < backlog; srv.size <<= 1);
+    srv.ring = m_malloc(srv.size);
+
+    rc = evloop_init(&srv.loop);
+    if (rc) {
+        ERR("Failed to initialize event loop (%s).", strerror(-rc));
+        free(srv.ring);
+        return rc;
+    }
+    rc = follow_signals(&srv.loop, &srv.stop);
+    if (rc) {
+        goto out;
+    }
+    rc = serve_listen(&srv);
+    if (rc) {
+        goto out;
+    }
+    f = follow_start(&srv.loop, xch, CONSOLE_RING_SIZE, *index,
+                     serve_publish, &srv, &srv.stop);
+    if (!f) {
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    while (!srv.stop) {
+        struct timeval to = { .tv_sec = 1, .tv_usec = 0 };
+
+        rc = evloop_wait(&srv.loop, &to);
+        if (rc && rc != -EINTR) {
+            ERR("Event loop failed (%s).", strerror(-rc));
+            break;
+        }
+        rc = 0;
+    }
+
+out:
+    if (f) {
+        err = follow_end(f, index);
+        rc = rc ? rc : err;
+    }
+    list_for_each_entry_safe(sub, tsub, &srv.subs, l) {
+        serve_sub_free(sub);
+    }
+    if (srv.fd >= 0) {
+        close(srv.fd);
+        unlink(srv.path);
+    }
+    if (srv.dropped) {
+        WAR("%llu bytes dropped for slow subscribers.", srv.dropped);
+    }
+    evloop_fini(&srv.loop);
+    free(srv.ring);
+    return rc;
+}
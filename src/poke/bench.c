@@ -0,0 +1,292 @@
+#include "poke.h"
+
+/*
+ * Register access latency benchmark.
+ *
+ * Every access is timed on its own, between two reads of the time stamp
+ * counter fenced so the access can neither start before the first one nor
+ * be retired after the second one. Writes are posted: their cost as seen by
+ * the CPU is what is measured, use write-read to include reading the register
+ * back, which waits for the write to reach the device.
+ *
+ * The cost of the time stamp pair itself, measured beforehand, is taken off
+ * every sample, and counter ticks are converted to ns against the monotonic
+ * clock over the whole run.
+ */
+#define BENCH_COUNT_DEFAULT     10000UL
+#define BENCH_COUNT_MAX         (10UL * 1000UL * 1000UL)
+#define BENCH_CALIBRATE_COUNT   1000UL
+#define BENCH_HIST_BUCKETS      64
+#define BENCH_HIST_WIDTH        50
+
+enum bench_op {
+    BENCH_READ,
+    BENCH_WRITE,
+    BENCH_WRITE_READ,
+};
+
+struct bench {
+    enum bench_op op;
+    const struct poke_access *a;
+    unsigned long count;
+    uint64_t *samples;      /* Ticks. */
+    uint64_t sink;          /* Last value read, keeps reads from going away. */
+};
+
+#if defined(__i386__) || defined(__x86_64__)
+static inline uint64_t bench_ts(void)
+{
+    uint32_t lo, hi;
+
+    __asm__ __volatile__("lfence; rdtsc; lfence" : "=a" (lo), "=d" (hi) :: "memory");
+    return ((uint64_t)hi << 32) | lo;
+}
+#else
+# define bench_ts() poke_now()
+#endif
+
+/*
+ * Time b->count accesses, @load reading the register in @v, @store writing
+ * @v to it. The value written is the one read first.
+ */
+#define BENCH_LOOP(b, type, load, store)                        \
+    do {                                                        \
+        type v = (load);                                        \
+        unsigned long i;                                        \
+        uint64_t t;                                             \
+                                                                \
+        for (i = 0; i < (b)->count; ++i) {                      \
+            t = bench_ts();                                     \
+            if ((b)->op == BENCH_READ) {                        \
+                v = (load);                                     \
+            } else {                                            \
+                store;                                          \
+                if ((b)->op == BENCH_WRITE_READ) {              \
+                    v = (load);                                 \
+                }                                               \
+            }                                                   \
+            (b)->samples[i] = bench_ts() - t;                   \
+        }                                                       \
+        (b)->sink = v;                                          \
+    } while (0)
+
+/*
+ * One loop per access size, the accesses are inlined rather than going
+ * through the poke_access pointers so only the access itself gets timed.
+ */
+#define BENCH_MMIO(s, type)                                     \
+    static void bench_mmio_##s(struct bench *b, void *p)        \
+    {                                                           \
+        BENCH_LOOP(b, type, *(volatile type *)p, *(volatile type *)p = v); \
+    }
+
+#define BENCH_IO(s, type)                                       \
+    static void bench_io_##s(struct bench *b, unsigned short port) \
+    {                                                           \
+        BENCH_LOOP(b, type, in##s(port), out##s(v, port));      \
+    }
+
+BENCH_MMIO(b, uint8_t)
+BENCH_MMIO(w, uint16_t)
+BENCH_MMIO(l, uint32_t)
+BENCH_MMIO(q, uint64_t)
+BENCH_IO(b, uint8_t)
+BENCH_IO(w, uint16_t)
+BENCH_IO(l, uint32_t)
+
+static const struct bench_loops {
+    char size;
+    void (*mmio)(struct bench *b, void *p);
+    void (*io)(struct bench *b, unsigned short port);
+} bench_loops[] = {
+    { 'b', bench_mmio_b, bench_io_b },
+    { 'w', bench_mmio_w, bench_io_w },
+    { 'l', bench_mmio_l, bench_io_l },
+    { 'q', bench_mmio_q, NULL },
+};
+
+static const struct bench_loops *bench_loops_of(const struct poke_access *a)
+{
+    size_t i;
+
+    for (i = 0; bench_loops[i].size != a->size; ++i);
+    return &bench_loops[i];
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Median cost of an empty time stamp pair, in ticks. */
+static uint64_t bench_overhead(void)
+{
+    uint64_t s[BENCH_CALIBRATE_COUNT], t;
+    unsigned long i;
+
+    for (i = 0; i < ARRAY_LEN(s); ++i) {
+        t = bench_ts();
+        s[i] = bench_ts() - t;
+    }
+    qsort(s, ARRAY_LEN(s), sizeof (s[0]), bench_cmp);
+    return s[ARRAY_LEN(s) / 2];
+}
+
+/*
+ * Report latency @samples, in units of @ns_per_unit ns: min, median, p99, max
+ * and a histogram with log2 ns buckets. @samples gets sorted.
+ */
+void poke_latency_report(const char *tag, uint64_t *samples, unsigned long n,
+                         double ns_per_unit)
+{
+    unsigned long hist[BENCH_HIST_BUCKETS] = { 0 };
+    unsigned long i, top = 0;
+    unsigned int k, first = BENCH_HIST_BUCKETS, last = 0;
+    char bar[BENCH_HIST_WIDTH + 1];
+
+    if (!n) {
+        return;
+    }
+    qsort(samples, n, sizeof (*samples), bench_cmp);
+    for (i = 0; i < n; ++i) {
+        uint64_t ns = samples[i] * ns_per_unit;
+
+        for (k = 0; ns > 1 && k < BENCH_HIST_BUCKETS - 1; ++k, ns >>= 1);
+        ++hist[k];
+    }
+    for (k = 0; k < BENCH_HIST_BUCKETS; ++k) {
+        if (hist[k]) {
+            first = (k < first) ? k : first;
+            last = k;
+            top = (hist[k] > top) ? hist[k] : top;
+        }
+    }
+
+    INF("%s: min %.1fns, median %.1fns, p99 %.1fns, max %.1fns.", tag,
+        samples[0] * ns_per_unit, samples[n / 2] * ns_per_unit,
+        samples[(n * 99) / 100] * ns_per_unit, samples[n - 1] * ns_per_unit);
+    for (k = first; k <= last; ++k) {
+        unsigned int w = hist[k] * BENCH_HIST_WIDTH / top;
+
+        memset(bar, '#', w);
+        bar[w] = '\0';
+        INF("%s: %8llu - %8lluns %10lu %s", tag, k ? 1ULL << k : 0ULL, (1ULL << (k + 1)) - 1,
+            hist[k], bar);
+    }
+}
+
+/*
+ * bench <mmio <pci-bdf> <BAR-id>|file <path>|io> <address> <b|w|l|q>
+ *       <read|write|write-read> [count]
+ */
+int poke_bench(int argc, char *argv[])
+{
+    struct bench b = { .count = BENCH_COUNT_DEFAULT };
+    struct pci_bdf bdf;
+    struct pci_handle *h = NULL;
+    unsigned long bar = 0;
+    unsigned long long addr, ns;
+    uint64_t ticks, overhead;
+    double ns_per_tick = 1.;
+    unsigned long i;
+    char what[256];
+    char **a;
+    int nargs, io = 0, rc;
+
+    test_or_failret(argc < 1, -EINVAL, "bench: Invalid parameters for `bench' command.");
+    if (!strcmp(argv[0], "mmio")) {
+        nargs = 3;
+    } else if (!strcmp(argv[0], "file")) {
+        nargs = 2;
+    } else if (!strcmp(argv[0], "io")) {
+        nargs = 1;
+        io = 1;
+    } else {
+        ERR("bench: Unknown target `%s', expected mmio, file or io.", argv[0]);
+        return -EINVAL;
+    }
+    test_or_failret(argc != nargs + 3 && argc != nargs + 4, -EINVAL, "bench: Invalid parameters for `bench %s' command.", argv[0]);
+
+    if (nargs == 3) {
+        rc = parse_bdf(argv[1], &bdf);
+        test_or_failret(rc < 0, rc, "bench: Could not parse PCI BDF `%s' (%s).", argv[1], strerror(-rc));
+        rc = parse_ul(argv[2], &bar);
+        test_or_failret(rc < 0, rc, "bench: Could not parse PCI BAR `%s' (%s).", argv[2], strerror(-rc));
+    }
+    a = &argv[nargs];
+    rc = parse_ull(a[0], &addr);
+    test_or_failret(rc < 0, rc, "bench: Could not parse address `%s' (%s).", a[0], strerror(-rc));
+    b.a = io ? poke_io_access(a[1]) : poke_access(a[1]);
+    test_or_failret(!b.a, -EINVAL, "bench: Could not parse access size `%s' (%s).", a[1], strerror(EINVAL));
+    if (!strcmp(a[2], "read")) {
+        b.op = BENCH_READ;
+    } else if (!strcmp(a[2], "write")) {
+        b.op = BENCH_WRITE;
+    } else if (!strcmp(a[2], "write-read")) {
+        b.op = BENCH_WRITE_READ;
+    } else {
+        ERR("bench: Unknown access `%s', expected read, write or write-read.", a[2]);
+        return -EINVAL;
+    }
+    if (argc == nargs + 4) {
+        rc = parse_ul(a[3], &b.count);
+        test_or_failret(rc < 0, rc, "bench: Could not parse count `%s' (%s).", a[3], strerror(-rc));
+        test_or_failret(!b.count || b.count > BENCH_COUNT_MAX, -ERANGE, "bench: Count must be within 1-%lu.", BENCH_COUNT_MAX);
+    }
+    test_or_failret(addr & (b.a->width - 1), -EINVAL, "bench: Address %#llx is not aligned on the access size (%u).", addr, b.a->width);
+
+    if (io) {
+        test_or_failret(addr > 0xffff - b.a->width + 1, -ERANGE, "bench: Invalid IO port address %#llx.", addr);
+        rc = poke_ioperm(addr, b.a->width);
+        test_or_failret(rc < 0, rc, "bench: Could not access IO port address %#llx (%s).", addr, strerror(-rc));
+    } else if (nargs == 3) {
+        h = pci_get_bar(&bdf, bar, addr, b.a->width, 0);
+        test_or_failret(!h, -errno, "bench: Could not map %s BAR%lu at %#llx (%s).", argv[1], bar, addr, strerror(errno));
+    } else {
+        h = pci_open_file(argv[1], addr, b.a->width);
+        test_or_failret(!h, -errno, "bench: Could not map %s at %#llx (%s).", argv[1], addr, strerror(errno));
+    }
+
+    b.samples = m_malloc(b.count * sizeof (*b.samples));
+    overhead = bench_overhead();
+    ns = poke_now();
+    ticks = bench_ts();
+    if (io) {
+        bench_loops_of(b.a)->io(&b, addr);
+    } else {
+        bench_loops_of(b.a)->mmio(&b, pci_bar_ptr(h, addr));
+    }
+    ticks = bench_ts() - ticks;
+    ns = poke_now() - ns;
+#if defined(__i386__) || defined(__x86_64__)
+    if (ticks) {
+        ns_per_tick = (double)ns / ticks;
+    }
+#endif
+
+    /* IO port access is kept, poke_release() drops it. */
+    if (nargs == 3) {
+        pci_put_bar(h);
+    } else if (!io) {
+        pci_close_handle(h);
+    }
+
+    for (i = 0; i < b.count; ++i) {
+        b.samples[i] = (b.samples[i] > overhead) ? b.samples[i] - overhead : 0;
+    }
+    if (io) {
+        snprintf(what, sizeof (what), "io %#llx.%c", addr, b.a->size);
+    } else if (nargs == 3) {
+        snprintf(what, sizeof (what), "mmio %s BAR%lu %#llx.%c", argv[1], bar, addr, b.a->size);
+    } else {
+        snprintf(what, sizeof (what), "file %s %#llx.%c", argv[1], addr, b.a->size);
+    }
+    INF("bench: %s %s, %.3f ticks/ns.", what, a[2], 1. / ns_per_tick);
+    INF("bench: %lu accesses, timer overhead %.1fns.", b.count, overhead * ns_per_tick);
+    poke_latency_report("bench", b.samples, b.count, ns_per_tick);
+
+    free(b.samples);
+    return 0;
+}
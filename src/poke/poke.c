@@ -10,38 +10,236 @@ struct poke_op {
 enum poke_cmd {
     POKE_HELP = 0,
     POKE_INJECT_MSI,
+    POKE_MSI_STORM,
     POKE_IOPORT_READ,
     POKE_IOPORT_WRITE,
+    POKE_IOPORT_INS,
+    POKE_IOPORT_OUTS,
+    POKE_IOPORT_WAIT,
     POKE_MMIO_READ,
     POKE_MMIO_WRITE,
+    POKE_MMIO_DUMP,
+    POKE_MMIO_FILL,
+    POKE_MMIO_LOAD,
+    POKE_MMIO_SNAP,
+    POKE_MMIO_DIFF,
+    POKE_MMIO_WAIT,
+    POKE_BENCH,
+    POKE_BATCH,
 };
 
 static int usage(int argc, char *argv[]);
 static int poke_inject_msi(int argc, char *argv[]);
+static int poke_msi_storm(int argc, char *argv[]);
 static int poke_io_port_read(int argc, char *argv[]);
 static int poke_io_port_write(int argc, char *argv[]);
+static int poke_io_ins(int argc, char *argv[]);
+static int poke_io_outs(int argc, char *argv[]);
+static int poke_io_wait(int argc, char *argv[]);
 static int poke_mmio_read(int argc, char *argv[]);
 static int poke_mmio_write(int argc, char *argv[]);
+static int poke_mmio_dump(int argc, char *argv[]);
+static int poke_mmio_fill(int argc, char *argv[]);
+static int poke_mmio_load(int argc, char *argv[]);
+static int poke_mmio_snap(int argc, char *argv[]);
+static int poke_mmio_diff(int argc, char *argv[]);
+static int poke_mmio_wait(int argc, char *argv[]);
+static int poke_batch(int argc, char *argv[]);
 
 static const struct poke_op poke_ops[] = {
     [POKE_HELP] = { "help", "", "Display usage.", &usage },
     [POKE_INJECT_MSI] = { "msi", "<domid> <address> <data>",
                           "Inject an MSI in domain <domid>, using <data> at <address>.",
                           &poke_inject_msi },
+    [POKE_MSI_STORM] = { "msi-storm", "<domid> <address> <data> [--rate <per-s>] [--count <n>] [--vectors <v[-v],...>]",
+                         "Inject <n> (default 1000) MSIs in domain <domid>, <per-s> a second (default unthrottled), cycling the vector of <data> through <v>s.",
+                         &poke_msi_storm },
     [POKE_IOPORT_READ] = { "io-read", "<address> <b|w|l>",
                            "Read 1|2|4 bytes from IO port at <address>." ,
                            &poke_io_port_read },
     [POKE_IOPORT_WRITE] = { "io-write", "<address> <b|w|l> <value>",
                             "Write 1|2|4 bytes <value> to IO port at <address>.",
                             &poke_io_port_write },
-    [POKE_MMIO_READ] = { "mmio-read", "<pci-bdf> <BAR-id> <register-address> <b|w|l>",
-                         "Read 1|2|4 bytes from device <pci-bdf> <BAR-id> at <register-address>.",
+    [POKE_IOPORT_INS] = { "io-ins", "<address> <b|w|l> <count> [file|-]",
+                          "Read 1|2|4 bytes <count> times from IO port at <address> (ins), to <file> or as hexdump.",
+                          &poke_io_ins },
+    [POKE_IOPORT_OUTS] = { "io-outs", "<address> <b|w|l> <value>...|@<file>",
+                           "Write 1|2|4 bytes <value>s, or the content of <file>, to IO port at <address> (outs).",
+                           &poke_io_outs },
+    [POKE_IOPORT_WAIT] = { "io-wait", "<address> <b|w|l> <mask> <value> [timeout-ms]",
+                           "Wait until (IO port & <mask>) == <value>, for <timeout-ms> (default 1000, 0 for ever).",
+                           &poke_io_wait },
+    [POKE_MMIO_READ] = { "mmio-read", "<pci-bdf> <BAR-id> <register-address> <b|w|l|q>",
+                         "Read 1|2|4|8 bytes from device <pci-bdf> <BAR-id> at <register-address>.",
                          &poke_mmio_read },
-    [POKE_MMIO_WRITE] = { "mmio-write", "<pci-bdf> <BAR-id> <register-address> <b|w|l> <value>",
-                          "Write 1|2|4 bytes from <value> to device <pci-bdf> <BAR-id> at <register-address>.",
+    [POKE_MMIO_WRITE] = { "mmio-write", "<pci-bdf> <BAR-id> <register-address> <b|w|l|q> <value>",
+                          "Write 1|2|4|8 bytes from <value> to device <pci-bdf> <BAR-id> at <register-address>.",
                           &poke_mmio_write },
+    [POKE_MMIO_DUMP] = { "mmio-dump", "<pci-bdf> <BAR-id> <offset> <length> <l|q> [file|-]",
+                         "Copy <length> bytes of device <pci-bdf> <BAR-id> from <offset>, using 4|8 bytes reads, to <file> or as hexdump.",
+                         &poke_mmio_dump },
+    [POKE_MMIO_FILL] = { "mmio-fill", "<pci-bdf> <BAR-id> <offset> <length> <b|w|l|q> <pattern>",
+                         "Fill <length> bytes of device <pci-bdf> <BAR-id> from <offset> with the 1|2|4|8 bytes <pattern>.",
+                         &poke_mmio_fill },
+    [POKE_MMIO_LOAD] = { "mmio-load", "<pci-bdf> <BAR-id> <offset> <b|w|l|q> <file|->",
+                         "Copy <file> to device <pci-bdf> <BAR-id> from <offset>, using 1|2|4|8 bytes writes.",
+                         &poke_mmio_load },
+    [POKE_MMIO_SNAP] = { "mmio-snap", "<pci-bdf> <BAR-id> <offset> <length> <l|q> <file>",
+                         "Save <length> bytes of device <pci-bdf> <BAR-id> from <offset>, using 4|8 bytes reads, to snapshot <file>.",
+                         &poke_mmio_snap },
+    [POKE_MMIO_DIFF] = { "mmio-diff", "<file> [-u]",
+                         "List the words of the range saved in snapshot <file> that changed since; -u updates the snapshot.",
+                         &poke_mmio_diff },
+    [POKE_MMIO_WAIT] = { "mmio-wait", "<pci-bdf> <BAR-id> <register-address> <b|w|l|q> <mask> <value> [timeout-ms]",
+                         "Wait until (register & <mask>) == <value> on device <pci-bdf> <BAR-id>, for <timeout-ms> (default 1000, 0 for ever).",
+                         &poke_mmio_wait },
+    [POKE_BENCH] = { "bench", "<mmio <pci-bdf> <BAR-id>|file <path>|io> <address> <b|w|l|q> <read|write|write-read> [count]",
+                     "Time <count> (default 10000) accesses to a register, a file mapped the same way, or an IO port; report latency min/median/p99 and histogram.",
+                     &poke_bench },
+    [POKE_BATCH] = { "batch", "<script|->",
+                     "Run the commands of <script> (stdin for -), one per line, in a single process. Also `-f'.",
+                     &poke_batch },
 };
 
+/*
+ * State kept across the commands of a batch.
+ */
+/* libxc handle, opened on first use. */
+static xc_interface *poke_xch = NULL;
+
+static xc_interface *poke_xc(void)
+{
+    if (!poke_xch) {
+        poke_xch = xc_interface_open(NULL, NULL, 0);
+    }
+    return poke_xch;
+}
+
+/* BAR mappings are kept by the libpci cache, see pci_get_bar(). */
+static void poke_io_release(void);
+
+static void poke_release(void)
+{
+    pci_cache_flush();
+    poke_io_release();
+    if (poke_xch) {
+        xc_interface_close(poke_xch);
+        poke_xch = NULL;
+    }
+}
+
+static const struct poke_op *poke_find_op(const char *cmd)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_LEN(poke_ops); ++i) {
+        if (!strcmp(poke_ops[i].cmd_str, cmd)) {
+            return &poke_ops[i];
+        }
+    }
+    return NULL;
+}
+
+static void poke_hexdump(FILE *f, unsigned long long base, const void *buf, size_t len,
+                         unsigned int width)
+{
+    size_t i;
+
+    for (i = 0; i < len; i += width) {
+        if (!(i % 16)) {
+            fprintf(f, "%s%08llx:", i ? "\n" : "", base + i);
+        }
+        switch (width) {
+            case 1:
+                fprintf(f, " %02" PRIx8, *(const uint8_t *)((const char *)buf + i));
+                break;
+            case 2:
+                fprintf(f, " %04" PRIx16, *(const uint16_t *)((const char *)buf + i));
+                break;
+            case 4:
+                fprintf(f, " %08" PRIx32, *(const uint32_t *)((const char *)buf + i));
+                break;
+            default:
+                fprintf(f, " %016" PRIx64, *(const uint64_t *)((const char *)buf + i));
+                break;
+        }
+    }
+    if (len) {
+        fprintf(f, "\n");
+    }
+}
+
+static int poke_write_file(const char *path, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+    int fd, rc = 0;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+    while (len) {
+        n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rc = -errno;
+            break;
+        }
+        p += n;
+        len -= n;
+    }
+    if (close(fd) && !rc) {
+        rc = -errno;
+    }
+    return rc;
+}
+
+/* Read the whole of @path (stdin for -) in a buffer allocated for the caller. */
+static int poke_read_file(const char *path, void **buf, size_t *len)
+{
+    size_t size = KB(4);
+    ssize_t n;
+    char *b;
+    int fd, rc = 0;
+
+    fd = strcmp(path, "-") ? open(path, O_RDONLY) : STDIN_FILENO;
+    if (fd < 0) {
+        return -errno;
+    }
+    b = m_malloc(size);
+    *len = 0;
+    for (;;) {
+        if (*len == size) {
+            size *= 2;
+            b = m_realloc(b, size);
+        }
+        n = read(fd, b + *len, size - *len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rc = -errno;
+            break;
+        }
+        if (!n) {
+            break;
+        }
+        *len += n;
+    }
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    if (rc) {
+        free(b);
+        return rc;
+    }
+    *buf = b;
+    return 0;
+}
+
 /*
  * Display usage.
  */
@@ -78,60 +276,328 @@ static int poke_inject_msi(int argc, char *argv[])
     rc = parse_ul(argv[2], &data);
     test_or_failret(rc < 0, rc, "msi: Could not parse data `%s' (%s).", argv[2], strerror(-rc));
 
-    xch = xc_interface_open(NULL, NULL, 0);
-    test_or_failerrno(rc < 0, "msi: Could not get xencrtl handle (%s).", strerror(errno));
+    xch = poke_xc();
+    test_or_failret(!xch, -errno, "msi: Could not get xencrtl handle (%s).", strerror(errno));
 
     /* 0 | -1 as hypercall are handler through privcmd doing ioctl(). */
     rc = xc_hvm_inject_msi(xch, domid, address, data);
     if (rc) {
         rc = -errno;
         ERR("msi: Could not inject MSI @%#llx %#lx (%s).", address, data, strerror(-rc));
-        xc_interface_close(xch);
+        return rc;
     }
     INF("xc_hvm_inject_msi(xch, %lu, %#llx, %#lx);", domid, address, data);
 
     return rc;
 }
 
+/*
+ * Inject MSIs in a row, through the same libxc handle.
+ * Injections are paced against absolute deadlines on the monotonic clock, so
+ * latency does not accumulate: the thread sleeps until shortly before each
+ * deadline then spins to it. Every hypercall is timed.
+ */
+#define POKE_STORM_COUNT_DEFAULT    1000UL
+#define POKE_STORM_COUNT_MAX        (10UL * 1000UL * 1000UL)
+#define POKE_STORM_SPIN_NS          (50ULL * 1000ULL)
+#define POKE_STORM_RATE_MAX         1000000000UL    /* One per ns. */
+#define POKE_STORM_VECTORS_MAX      256
+
+/* Parse a vector list like 0x30,0x40-0x4f. */
+static int poke_parse_vectors(const char *s, uint8_t *vectors, unsigned int *n)
+{
+    unsigned long lo, hi;
+    char *end;
+
+    *n = 0;
+    for (;;) {
+        lo = strtoul(s, &end, 0);
+        if (end == s || lo > 0xff) {
+            return -EINVAL;
+        }
+        hi = lo;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtoul(s, &end, 0);
+            if (end == s || hi > 0xff || hi < lo) {
+                return -EINVAL;
+            }
+        }
+        for (; lo <= hi; ++lo) {
+            if (*n == POKE_STORM_VECTORS_MAX) {
+                return -E2BIG;
+            }
+            vectors[(*n)++] = lo;
+        }
+        if (!*end) {
+            return 0;
+        }
+        if (*end != ',') {
+            return -EINVAL;
+        }
+        s = end + 1;
+    }
+}
+
+static void poke_wait_until(unsigned long long deadline)
+{
+    unsigned long long now = poke_now();
+
+    if (now + POKE_STORM_SPIN_NS < deadline) {
+        struct timespec ts = {
+            .tv_sec = (deadline - POKE_STORM_SPIN_NS) / 1000000000ULL,
+            .tv_nsec = (deadline - POKE_STORM_SPIN_NS) % 1000000000ULL,
+        };
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+    }
+    while (poke_now() < deadline) {
+        cpu_relax();
+    }
+}
+
+static int poke_msi_storm(int argc, char *argv[])
+{
+    unsigned long domid, data, rate = 0, count = POKE_STORM_COUNT_DEFAULT;
+    unsigned long long address, start, t, elapsed;
+    uint8_t vectors[POKE_STORM_VECTORS_MAX];
+    unsigned int nvectors = 0;
+    unsigned long i, failed = 0;
+    uint64_t *samples;
+    xc_interface *xch;
+    int err = 0, rc = 0;
+
+    test_or_failret(argc < 3 || (argc - 3) % 2, -EINVAL, "msi-storm: Invalid parameters for `msi-storm' command.");
+
+    rc = parse_ul(argv[0], &domid);
+    test_or_failret(rc < 0, rc, "msi-storm: Could not parse domid `%s' (%s).", argv[0], strerror(-rc));
+    rc = parse_ull(argv[1], &address);
+    test_or_failret(rc < 0, rc, "msi-storm: Could not parse address `%s' (%s).", argv[1], strerror(-rc));
+    rc = parse_ul(argv[2], &data);
+    test_or_failret(rc < 0, rc, "msi-storm: Could not parse data `%s' (%s).", argv[2], strerror(-rc));
+    for (i = 3; i < (unsigned long)argc; i += 2) {
+        if (!strcmp(argv[i], "--rate")) {
+            rc = parse_ul(argv[i + 1], &rate);
+            test_or_failret(rc < 0, rc, "msi-storm: Could not parse rate `%s' (%s).", argv[i + 1], strerror(-rc));
+            test_or_failret(rate > POKE_STORM_RATE_MAX, -ERANGE, "msi-storm: Rate must be at most %lu/s.", POKE_STORM_RATE_MAX);
+        } else if (!strcmp(argv[i], "--count")) {
+            rc = parse_ul(argv[i + 1], &count);
+            test_or_failret(rc < 0, rc, "msi-storm: Could not parse count `%s' (%s).", argv[i + 1], strerror(-rc));
+            test_or_failret(!count || count > POKE_STORM_COUNT_MAX, -ERANGE, "msi-storm: Count must be within 1-%lu.", POKE_STORM_COUNT_MAX);
+        } else if (!strcmp(argv[i], "--vectors")) {
+            rc = poke_parse_vectors(argv[i + 1], vectors, &nvectors);
+            test_or_failret(rc < 0, rc, "msi-storm: Could not parse vectors `%s' (%s).", argv[i + 1], strerror(-rc));
+        } else {
+            ERR("msi-storm: Unknown option `%s'.", argv[i]);
+            return -EINVAL;
+        }
+    }
+    xch = poke_xc();
+    test_or_failret(!xch, -errno, "msi-storm: Could not get xencrtl handle (%s).", strerror(errno));
+
+    samples = m_malloc(count * sizeof (*samples));
+    start = poke_now();
+    for (i = 0; i < count; ++i) {
+        unsigned long d = nvectors ? (data & ~0xffUL) | vectors[i % nvectors] : data;
+
+        /* Scheduled from the start, a rounded period would drift. */
+        if (rate) {
+            poke_wait_until(start + i * 1000000000ULL / rate);
+        }
+        t = poke_now();
+        rc = xc_hvm_inject_msi(xch, domid, address, d);
+        samples[i] = poke_now() - t;
+        if (rc) {
+            err = errno;
+            ++failed;
+        }
+    }
+    elapsed = poke_now() - start;
+
+    if (rate) {
+        INF("msi-storm: %lu MSIs to domain %lu in %lluns, %.0f/s, asked for %lu/s.", count, domid,
+            elapsed, elapsed ? count * 1e9 / elapsed : 0., rate);
+    } else {
+        INF("msi-storm: %lu MSIs to domain %lu in %lluns, %.0f/s.", count, domid,
+            elapsed, elapsed ? count * 1e9 / elapsed : 0.);
+    }
+    poke_latency_report("msi-storm", samples, count, 1.);
+    free(samples);
+
+    if (failed) {
+        ERR("msi-storm: %lu injections failed, last with: %s.", failed, strerror(err));
+        return -err;
+    }
+    return 0;
+}
+
+/*
+ * Register accessors, generated from a single template for each access size.
+ * MMIO accesses are volatile, so they are neither merged nor split. There is
+ * no 8 bytes IO port access.
+ */
+#define POKE_IO_WIDTH_MAX   4
+
+#define POKE_ACCESSORS(s, type)                                 \
+    static uint64_t poke_load_##s(const void *p)                \
+    {                                                           \
+        return *(const volatile type *)p;                       \
+    }                                                           \
+    static void poke_store_##s(void *p, uint64_t v)             \
+    {                                                           \
+        *(volatile type *)p = v;                                \
+    }                                                           \
+    static void poke_copy_##s(void *dst, const void *src, size_t len) \
+    {                                                           \
+        const volatile type *from = src;                        \
+        type *to = dst;                                         \
+        size_t i;                                               \
+                                                                \
+        for (i = 0; i < len / sizeof (type); ++i) {             \
+            to[i] = from[i];                                    \
+        }                                                       \
+    }
+
+#define POKE_IO_ACCESSORS(s)                                    \
+    static uint32_t poke_in_##s(unsigned long port)             \
+    {                                                           \
+        return in##s(port);                                     \
+    }                                                           \
+    static void poke_out_##s(unsigned long port, uint32_t v)    \
+    {                                                           \
+        out##s(v, port);                                        \
+    }                                                           \
+    static void poke_ins_##s(unsigned long port, void *buf, unsigned long n) \
+    {                                                           \
+        ins##s(port, buf, n);                                   \
+    }                                                           \
+    static void poke_outs_##s(unsigned long port, const void *buf, unsigned long n) \
+    {                                                           \
+        outs##s(port, buf, n);                                  \
+    }
+
+POKE_ACCESSORS(b, uint8_t)
+POKE_ACCESSORS(w, uint16_t)
+POKE_ACCESSORS(l, uint32_t)
+POKE_ACCESSORS(q, uint64_t)
+POKE_IO_ACCESSORS(b)
+POKE_IO_ACCESSORS(w)
+POKE_IO_ACCESSORS(l)
+
+#define POKE_ACCESS(s, type)                                    \
+    { #s[0], sizeof (type), poke_load_##s, poke_store_##s, poke_copy_##s, \
+      poke_in_##s, poke_out_##s, poke_ins_##s, poke_outs_##s }
+#define POKE_MMIO_ACCESS(s, type)                               \
+    { #s[0], sizeof (type), poke_load_##s, poke_store_##s, poke_copy_##s, \
+      NULL, NULL, NULL, NULL }
+
+static const struct poke_access poke_accesses[] = {
+    POKE_ACCESS(b, uint8_t),
+    POKE_ACCESS(w, uint16_t),
+    POKE_ACCESS(l, uint32_t),
+    POKE_MMIO_ACCESS(q, uint64_t),
+};
+
+const struct poke_access *poke_access(const char *s)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_LEN(poke_accesses); ++i) {
+        if (s[0] == poke_accesses[i].size && !s[1]) {
+            return &poke_accesses[i];
+        }
+    }
+    return NULL;
+}
+
+const struct poke_access *poke_io_access(const char *s)
+{
+    const struct poke_access *a = poke_access(s);
+
+    return (a && a->width <= POKE_IO_WIDTH_MAX) ? a : NULL;
+}
+
+/* Accessors of a snapshot width, read back from a file. */
+static const struct poke_access *poke_access_width(unsigned int width)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_LEN(poke_accesses); ++i) {
+        if (poke_accesses[i].width == width) {
+            return &poke_accesses[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * IO ports.
+ * Access to ports is granted on first use with ioperm() over the exact ports
+ * touched, and kept for the rest of the process, so a batch of accesses costs
+ * no extra system call. poke_release() drops it.
+ */
+#define POKE_IO_PORTS       0x10000
+#define POKE_IO_COUNT_MAX   (1UL << 24)
+
+static uint8_t poke_io_granted[POKE_IO_PORTS / 8];
+static int poke_io_any = 0;
+
+static inline int poke_io_is_granted(unsigned long port)
+{
+    return poke_io_granted[port / 8] & (1 << (port % 8));
+}
+
+int poke_ioperm(unsigned long port, unsigned long n)
+{
+    unsigned long i;
+
+    if (!n || port >= POKE_IO_PORTS || n > POKE_IO_PORTS - port) {
+        return -ERANGE;
+    }
+    for (i = port; i < port + n && poke_io_is_granted(i); ++i);
+    if (i == port + n) {
+        return 0;
+    }
+    if (ioperm(port, n, 1)) {
+        return -errno;
+    }
+    for (i = port; i < port + n; ++i) {
+        poke_io_granted[i / 8] |= 1 << (i % 8);
+    }
+    poke_io_any = 1;
+    return 0;
+}
+
+static void poke_io_release(void)
+{
+    if (poke_io_any) {
+        ioperm(0, POKE_IO_PORTS, 0);
+        memset(poke_io_granted, 0, sizeof (poke_io_granted));
+        poke_io_any = 0;
+    }
+}
+
 /*
  * Read an IO port.
  */
 static int poke_io_port_read(int argc, char *argv[])
 {
     unsigned long addr;
-    unsigned long val;
+    const struct poke_access *a;
+    uint32_t val;
     int rc;
 
     test_or_failret(argc != 2, -EINVAL, "io-read: Invalid parameters for `io-read' command.");
 
     rc = parse_ul(argv[0], &addr);
-    INF("%s", __FUNCTION__);
     test_or_failret(rc < 0, rc, "io-read: Could not parse IO port address `%s' (%s).", argv[0], strerror(-rc));
+    a = poke_io_access(argv[1]);
+    test_or_failret(!a, -EINVAL, "io-read: Could not parse IO port size `%s' (%s).", argv[1], strerror(EINVAL));
 
-    switch (argv[1][0]) {
-        case 'b':
-            rc = ioperm(addr, 8, 1);
-            test_or_failret(rc < 0, rc, "io-read: Could not access IO port address `%s.%c' (%s).", argv[0], argv[1][0], strerror(-rc));
-            val = inb(addr);
-            ioperm(addr, 8, 0);
-            break;
-        case 'w':
-            rc = ioperm(addr, 16, 1);
-            test_or_failret(rc < 0, rc, "io-read: Could not access IO port address `%s.%c' (%s).", argv[0], argv[1][0], strerror(-rc));
-            val = inw(addr);
-            ioperm(addr, 16, 0);
-            break;
-        case 'l':
-            rc = ioperm(addr, 32, 1);
-            test_or_failret(rc < 0, rc, "io-read: Could not access IO port address `%s.%c' (%s).", argv[0], argv[1][0], strerror(-rc));
-            val = inl(addr);
-            ioperm(addr, 32, 0);
-            break;
-        default:
-            ERR("io-read: Could not parse IO port size `%s' (%s).", argv[1], strerror(EINVAL));
-            return -EINVAL;
-    }
-    INF("io-read: in%c(%#lx) -> %#lx", argv[1][0], addr, val);
+    rc = poke_ioperm(addr, a->width);
+    test_or_failret(rc < 0, rc, "io-read: Could not access IO port address `%s.%c' (%s).", argv[0], a->size, strerror(-rc));
+    val = a->in(addr);
+    INF("io-read: in%c(%#lx) -> %#x", a->size, addr, val);
     return 0;
 }
 
@@ -142,38 +608,120 @@ static int poke_io_port_write(int argc, char *argv[])
 {
     unsigned long addr;
     unsigned long val;
+    const struct poke_access *a;
     int rc;
 
-    test_or_failret(argc != 3, -EINVAL, "io-write: Invalid parameters for `io-read' command.");
+    test_or_failret(argc != 3, -EINVAL, "io-write: Invalid parameters for `io-write' command.");
 
     rc = parse_ul(argv[0], &addr);
     test_or_failret(rc < 0, rc, "io-write: Could not parse IO port address `%s' (%s).", argv[0], strerror(-rc));
     rc = parse_ul(argv[2], &val);
     test_or_failret(rc < 0, rc, "io-write: Could not parse value `%s' (%s).", argv[2], strerror(-rc));
-    switch (argv[1][0]) {
-        case 'b':
-            rc = ioperm(addr, 8, 1);
-            test_or_failret(rc < 0, rc, "io-write: Could not access IO port address `%s.%c' (%s).", argv[0], argv[1][0], strerror(-rc));
-            outb(val, addr);
-            ioperm(addr, 8, 0);
-            break;
-        case 'w':
-            rc = ioperm(addr, 16, 1);
-            test_or_failret(rc < 0, rc, "io-write: Could not access IO port address `%s.%c' (%s).", argv[0], argv[1][0], strerror(-rc));
-            outw(val, addr);
-            ioperm(addr, 8, 0);
-            break;
-        case 'l':
-            rc = ioperm(addr, 32, 1);
-            test_or_failret(rc < 0, rc, "io-write: Could not access IO port address `%s.%c' (%s).", argv[0], argv[1][0], strerror(-rc));
-            outl(val, addr); break;
-            ioperm(addr, 32, 0);
-            break;
-        default:
-            ERR("io-write: Could not parse IO port size `%s' (%s).", argv[1], strerror(EINVAL));
+    a = poke_io_access(argv[1]);
+    test_or_failret(!a, -EINVAL, "io-write: Could not parse IO port size `%s' (%s).", argv[1], strerror(EINVAL));
+
+    rc = poke_ioperm(addr, a->width);
+    test_or_failret(rc < 0, rc, "io-write: Could not access IO port address `%s.%c' (%s).", argv[0], a->size, strerror(-rc));
+    a->out(addr, val);
+    INF("io-write: out%c(%#lx, %#lx)", a->size, val, addr);
+    return 0;
+}
+
+/*
+ * Read an IO port <count> times in a row into a buffer (ins*).
+ */
+static int poke_io_ins(int argc, char *argv[])
+{
+    unsigned long addr, count;
+    const struct poke_access *a;
+    void *buf;
+    int rc;
+
+    test_or_failret(argc != 3 && argc != 4, -EINVAL, "io-ins: Invalid parameters for `io-ins' command.");
+
+    rc = parse_ul(argv[0], &addr);
+    test_or_failret(rc < 0, rc, "io-ins: Could not parse IO port address `%s' (%s).", argv[0], strerror(-rc));
+    a = poke_io_access(argv[1]);
+    test_or_failret(!a, -EINVAL, "io-ins: Could not parse IO port size `%s' (%s).", argv[1], strerror(EINVAL));
+    rc = parse_ul(argv[2], &count);
+    test_or_failret(rc < 0, rc, "io-ins: Could not parse count `%s' (%s).", argv[2], strerror(-rc));
+    test_or_failret(!count || count > POKE_IO_COUNT_MAX, -ERANGE, "io-ins: Count must be within 1-%lu.", POKE_IO_COUNT_MAX);
+
+    rc = poke_ioperm(addr, a->width);
+    test_or_failret(rc < 0, rc, "io-ins: Could not access IO port address `%s.%c' (%s).", argv[0], a->size, strerror(-rc));
+
+    buf = m_malloc(count * a->width);
+    a->ins(addr, buf, count);
+
+    if (argc == 4 && strcmp(argv[3], "-")) {
+        rc = poke_write_file(argv[3], buf, count * a->width);
+        if (rc) {
+            ERR("io-ins: Could not write `%s' (%s).", argv[3], strerror(-rc));
+        }
+    } else {
+        poke_hexdump(stdout, 0, buf, count * a->width, a->width);
+    }
+    free(buf);
+    INF("io-ins: ins%c(%#lx) x %lu.", a->size, addr, count);
+    return rc;
+}
+
+/*
+ * Write values, or the content of a file, to an IO port in a row (outs*).
+ */
+static int poke_io_outs(int argc, char *argv[])
+{
+    unsigned long addr, count, val;
+    const struct poke_access *a;
+    uint8_t *buf = NULL;
+    int i, rc;
+
+    test_or_failret(argc < 3, -EINVAL, "io-outs: Invalid parameters for `io-outs' command.");
+
+    rc = parse_ul(argv[0], &addr);
+    test_or_failret(rc < 0, rc, "io-outs: Could not parse IO port address `%s' (%s).", argv[0], strerror(-rc));
+    a = poke_io_access(argv[1]);
+    test_or_failret(!a, -EINVAL, "io-outs: Could not parse IO port size `%s' (%s).", argv[1], strerror(EINVAL));
+
+    if (argc == 3 && argv[2][0] == '@') {
+        size_t len = 0;
+
+        rc = poke_read_file(argv[2] + 1, (void **)&buf, &len);
+        test_or_failret(rc < 0, rc, "io-outs: Could not read `%s' (%s).", argv[2] + 1, strerror(-rc));
+        if (len % a->width) {
+            ERR("io-outs: `%s' size is not a multiple of %u.", argv[2] + 1, a->width);
+            free(buf);
             return -EINVAL;
+        }
+        count = len / a->width;
+    } else {
+        count = argc - 2;
+        buf = m_malloc(count * a->width);
+        for (i = 2; i < argc; ++i) {
+            rc = parse_ul(argv[i], &val);
+            if (rc < 0) {
+                ERR("io-outs: Could not parse value `%s' (%s).", argv[i], strerror(-rc));
+                free(buf);
+                return rc;
+            }
+            memcpy(buf + (i - 2) * a->width, &val, a->width);
+        }
+    }
+    if (!count || count > POKE_IO_COUNT_MAX) {
+        ERR("io-outs: Count must be within 1-%lu.", POKE_IO_COUNT_MAX);
+        free(buf);
+        return -ERANGE;
     }
-    INF("io-write: out%c(%#lx, %#lx)", argv[1][0], val, addr);
+
+    rc = poke_ioperm(addr, a->width);
+    if (rc < 0) {
+        ERR("io-outs: Could not access IO port address `%s.%c' (%s).", argv[0], a->size, strerror(-rc));
+        free(buf);
+        return rc;
+    }
+    a->outs(addr, buf, count);
+    free(buf);
+    INF("io-outs: outs%c(%#lx) x %lu.", a->size, addr, count);
     return 0;
 }
 
@@ -184,8 +732,8 @@ static int poke_mmio_read(int argc, char *argv[])
 {
     struct pci_bdf bdf;
     unsigned long bar;
-    size_t bar_size;
     unsigned long long reg_addr;
+    const struct poke_access *a;
     struct pci_handle *h;
     int rc = 0;
 
@@ -198,34 +746,16 @@ static int poke_mmio_read(int argc, char *argv[])
     rc = parse_ull(argv[2], &reg_addr);
     test_or_failret(rc < 0, rc, "mmio-read: Could not parse register address `%s' (%s).", argv[2], strerror(-rc));
 
-    bar_size = pci_bar_size(&bdf, bar);
-    test_or_failret(bar_size == 0, -EIO, "mmio-read: Could not determine BAR%s size.", argv[1]);
+    a = poke_access(argv[3]);
+    test_or_failret(!a, -EINVAL, "mmio-read: Could not parse register size `%s' (%s).", argv[3], strerror(EINVAL));
 
-    INF("BITE: %02u:%02x.%1x BAR%lu (size %zuK) %#llx.%c", bdf.bus, bdf.slot, bdf.func,
-        bar, bar_size / 1024, reg_addr, argv[3][0]);
+    h = pci_get_bar(&bdf, bar, reg_addr, a->width, 0);
+    test_or_failret(!h, -errno, "mmio-read: Could not map %s BAR%s at %#llx.%c (%s).", argv[0], argv[1], reg_addr, a->size, strerror(errno));
 
-    h = pci_open_bar(&bdf, bar, bar_size);
-    test_or_failret(!h, -ENOTTY, "mmio-read: Could not map %s BAR%s.", argv[0], argv[1]);
+    INF("mmio-read: %02x:%02x.%1x BAR%lu %#llx.%c -> %#" PRIx64, bdf.bus, bdf.slot, bdf.func, bar,
+        reg_addr, a->size, a->load(pci_bar_ptr(h, reg_addr)));
 
-    switch (argv[3][0]) {
-        case 'b':
-            INF("mmio-read: %02u:%02x.%1x BAR%lu %#llx.%c -> %#x", bdf.bus, bdf.slot, bdf.func, bar,
-                reg_addr, argv[3][0], ((uint8_t*)(h->p))[reg_addr]);
-            break;
-        case 'w':
-            INF("mmio-read: %02u:%02x.%1x BAR%lu %#llx.%c -> %#x", bdf.bus, bdf.slot, bdf.func, bar,
-                reg_addr, argv[3][0], *((uint16_t*)(&(((uint8_t*)(h->p))[reg_addr]))));
-            break;
-        case 'l':
-            INF("mmio-read: %02u:%02x.%1x BAR%lu %#llx.%c -> %#x", bdf.bus, bdf.slot, bdf.func, bar,
-                reg_addr, argv[3][0], *((uint32_t*)(&(((uint8_t*)(h->p))[reg_addr]))));
-            break;
-        default:
-            ERR("mmio-read: Could not parse register size `%s' (%s).", argv[3], strerror(EINVAL));
-            rc = -EINVAL;
-    }
-
-    pci_close_handle(h);
+    pci_put_bar(h);
     return rc;
 }
 
@@ -238,7 +768,8 @@ static int poke_mmio_write(int argc, char *argv[])
     struct pci_bdf bdf;
     unsigned long bar;
     unsigned long long reg_addr;
-    unsigned long reg_data;
+    unsigned long long reg_data;
+    const struct poke_access *a;
     struct pci_handle *h;
     int rc = 0;
 
@@ -250,49 +781,675 @@ static int poke_mmio_write(int argc, char *argv[])
     test_or_failret(rc < 0, rc, "mmio-write: Could not parse PCI BAR `%s' (%s).", argv[1], strerror(-rc));
     rc = parse_ull(argv[2], &reg_addr);
     test_or_failret(rc < 0, rc, "mmio-write: Could not parse register address `%s' (%s).", argv[2], strerror(-rc));
-    rc = parse_ul(argv[4], &reg_data);
+    rc = parse_ull(argv[4], &reg_data);
     test_or_failret(rc < 0, rc, "mmio-write: Could not parse register data `%s' (%s).", argv[4], strerror(-rc));
 
-    h = pci_open_bar(&bdf, bar, 4096);
-    test_or_failret(!h, -ENOTTY, "mmio-write: Could not map %s BAR%s.", argv[0], argv[1]);
+    a = poke_access(argv[3]);
+    test_or_failret(!a, -EINVAL, "mmio-write: Could not parse register size `%s' (%s).", argv[3], strerror(EINVAL));
+
+    h = pci_get_bar(&bdf, bar, reg_addr, a->width, 0);
+    test_or_failret(!h, -errno, "mmio-write: Could not map %s BAR%s at %#llx.%c (%s).", argv[0], argv[1], reg_addr, a->size, strerror(errno));
+
+    a->store(pci_bar_ptr(h, reg_addr), reg_data);
+    INF("mmio-write: %02x:%02x.%1x BAR%lu %#llx.%c <- %#llx.", bdf.bus, bdf.slot, bdf.func, bar,
+        reg_addr, a->size, reg_data);
+
+    pci_put_bar(h);
+    return rc;
+}
+
+/*
+ * Block writes to an MMIO range.
+ * Ranges are stored at the access size asked for, unless the BAR could be
+ * mapped write-combined (prefetchable BARs, see PCI_BAR_WC): the device then
+ * accepts merged writes, so the aligned middle of the range is written with
+ * 16 bytes non-temporal stores that go out as full bursts.
+ */
+#define POKE_BLOCK_MAX  MB(256)
+
+/* Fill @len bytes at @dst with @pattern, or copy them from @src if not NULL. */
+static void poke_mmio_block(void *dst, const void *src, uint64_t pattern, size_t len,
+                            const struct poke_access *a, int wc)
+{
+    uint8_t *d = dst, *end = d + len;
+    const uint8_t *s = src;
+    uint64_t v;
+    unsigned int i;
+
+    for (i = a->width; i < 8; i *= 2) {
+        pattern |= pattern << (i * 8);
+    }
+    v = pattern;
+#ifdef __SSE2__
+    if (wc) {
+        __m128i p = _mm_set1_epi64x(pattern);
+
+        for (; ((uintptr_t)d & 15) && d < end; d += a->width) {
+            if (s) {
+                memcpy(&v, s, a->width);
+                s += a->width;
+            }
+            a->store(d, v);
+        }
+        for (; end - d >= 16; d += 16) {
+            if (s) {
+                p = _mm_loadu_si128((const __m128i *)s);
+                s += 16;
+            }
+            _mm_stream_si128((__m128i *)d, p);
+        }
+        _mm_sfence();
+    }
+#else
+    unused(wc);
+#endif
+    for (; d < end; d += a->width) {
+        if (s) {
+            memcpy(&v, s, a->width);
+            s += a->width;
+        }
+        a->store(d, v);
+    }
+}
+
+/* Parse <pci-bdf> <BAR-id> <offset> and @size of a block command, map @len bytes. */
+static int poke_mmio_block_map(const char *cmd, char *argv[], const char *size, unsigned long long len,
+                               struct pci_bdf *bdf, unsigned long *bar, unsigned long long *off,
+                               const struct poke_access **a, struct pci_handle **h)
+{
+    int rc;
+
+    rc = parse_bdf(argv[0], bdf);
+    test_or_failret(rc < 0, rc, "%s: Could not parse PCI BDF `%s' (%s).", cmd, argv[0], strerror(-rc));
+    rc = parse_ul(argv[1], bar);
+    test_or_failret(rc < 0, rc, "%s: Could not parse PCI BAR `%s' (%s).", cmd, argv[1], strerror(-rc));
+    rc = parse_ull(argv[2], off);
+    test_or_failret(rc < 0, rc, "%s: Could not parse offset `%s' (%s).", cmd, argv[2], strerror(-rc));
+    *a = poke_access(size);
+    test_or_failret(!*a, -EINVAL, "%s: Could not parse access size `%s' (%s).", cmd, size, strerror(EINVAL));
+    test_or_failret(!len || len > POKE_BLOCK_MAX, -ERANGE, "%s: Length must be within 1-%u.", cmd, POKE_BLOCK_MAX);
+    test_or_failret((*off | len) & ((*a)->width - 1), -EINVAL,
+                    "%s: Offset and length must be multiples of the access size (%u).", cmd, (*a)->width);
+
+    *h = pci_get_bar(bdf, *bar, *off, len, PCI_BAR_WC);
+    test_or_failret(!*h, -errno, "%s: Could not map %s BAR%s %#llx-%#llx (%s).", cmd, argv[0], argv[1], *off, *off + len, strerror(errno));
+    return 0;
+}
+
+/*
+ * Fill an MMIO range with a pattern.
+ */
+static int poke_mmio_fill(int argc, char *argv[])
+{
+    struct pci_bdf bdf;
+    unsigned long bar;
+    unsigned long long off, len, pattern, t;
+    const struct poke_access *a;
+    struct pci_handle *h;
+    int rc;
+
+    test_or_failret(argc != 6, -EINVAL, "mmio-fill: Invalid parameters for `mmio-fill' command.");
+
+    rc = parse_ull(argv[3], &len);
+    test_or_failret(rc < 0, rc, "mmio-fill: Could not parse length `%s' (%s).", argv[3], strerror(-rc));
+    rc = parse_ull(argv[5], &pattern);
+    test_or_failret(rc < 0, rc, "mmio-fill: Could not parse pattern `%s' (%s).", argv[5], strerror(-rc));
+    rc = poke_mmio_block_map("mmio-fill", argv, argv[4], len, &bdf, &bar, &off, &a, &h);
+    if (rc) {
+        return rc;
+    }
+    if (a->width < 8) {
+        pattern &= (1ULL << (a->width * 8)) - 1;
+    }
+
+    t = poke_now();
+    poke_mmio_block(pci_bar_ptr(h, off), NULL, pattern, len, a, h->wc);
+    t = poke_now() - t;
+    INF("mmio-fill: %02x:%02x.%1x BAR%lu %#llx-%#llx <- %#llx.%c, %llu bytes in %lluns (%.1fMB/s%s).",
+        bdf.bus, bdf.slot, bdf.func, bar, off, off + len, pattern, a->size, len, t,
+        t ? len * 1e9 / t / MB(1) : 0., h->wc ? ", write-combined" : "");
+
+    pci_put_bar(h);
+    return 0;
+}
+
+/*
+ * Copy a file to an MMIO range.
+ */
+static int poke_mmio_load(int argc, char *argv[])
+{
+    struct pci_bdf bdf;
+    unsigned long bar;
+    unsigned long long off, t;
+    const struct poke_access *a;
+    struct pci_handle *h;
+    void *buf;
+    size_t len;
+    int rc;
+
+    test_or_failret(argc != 5, -EINVAL, "mmio-load: Invalid parameters for `mmio-load' command.");
+
+    rc = poke_read_file(argv[4], &buf, &len);
+    test_or_failret(rc < 0, rc, "mmio-load: Could not read `%s' (%s).", argv[4], strerror(-rc));
+    rc = poke_mmio_block_map("mmio-load", argv, argv[3], len, &bdf, &bar, &off, &a, &h);
+    if (rc) {
+        free(buf);
+        return rc;
+    }
+
+    t = poke_now();
+    poke_mmio_block(pci_bar_ptr(h, off), buf, 0, len, a, h->wc);
+    t = poke_now() - t;
+    INF("mmio-load: %02x:%02x.%1x BAR%lu %#llx-%#llx <- %s, %zu bytes in %lluns (%.1fMB/s%s).",
+        bdf.bus, bdf.slot, bdf.func, bar, off, off + len, argv[4], len, t,
+        t ? len * 1e9 / t / MB(1) : 0., h->wc ? ", write-combined" : "");
+
+    pci_put_bar(h);
+    free(buf);
+    return 0;
+}
+
+/*
+ * Dump an MMIO range.
+ * The range is first copied to memory in a single pass, with reads of the
+ * width asked for only (see poke_copy_*()), then written out raw or as a
+ * hexdump.
+ */
+static int poke_mmio_dump(int argc, char *argv[])
+{
+    struct pci_bdf bdf;
+    unsigned long bar;
+    unsigned long long off, len, t;
+    const struct poke_access *a;
+    struct pci_handle *h;
+    void *buf;
+    int rc = 0;
+
+    test_or_failret(argc != 5 && argc != 6, -EINVAL, "mmio-dump: Invalid parameters for `mmio-dump' command.");
+
+    rc = parse_bdf(argv[0], &bdf);
+    test_or_failret(rc < 0, rc, "mmio-dump: Could not parse PCI BDF `%s' (%s).", argv[0], strerror(-rc));
+    rc = parse_ul(argv[1], &bar);
+    test_or_failret(rc < 0, rc, "mmio-dump: Could not parse PCI BAR `%s' (%s).", argv[1], strerror(-rc));
+    rc = parse_ull(argv[2], &off);
+    test_or_failret(rc < 0, rc, "mmio-dump: Could not parse offset `%s' (%s).", argv[2], strerror(-rc));
+    rc = parse_ull(argv[3], &len);
+    test_or_failret(rc < 0, rc, "mmio-dump: Could not parse length `%s' (%s).", argv[3], strerror(-rc));
+
+    a = poke_access(argv[4]);
+    test_or_failret(!a || a->width < 4, -EINVAL, "mmio-dump: Could not parse access size `%s' (%s).", argv[4], strerror(EINVAL));
+    test_or_failret((off | len) & (a->width - 1), -EINVAL,
+                    "mmio-dump: Offset and length must be multiples of the access size (%u).", a->width);
+
+    h = pci_get_bar(&bdf, bar, off, len, 0);
+    test_or_failret(!h, -errno, "mmio-dump: Could not map %s BAR%s %#llx-%#llx (%s).", argv[0], argv[1], off, off + len, strerror(errno));
+
+    buf = m_malloc(len);
+    t = poke_now();
+    a->copy(buf, pci_bar_ptr(h, off), len);
+    t = poke_now() - t;
+    pci_put_bar(h);
+
+    if (argc == 6 && strcmp(argv[5], "-")) {
+        rc = poke_write_file(argv[5], buf, len);
+        if (rc) {
+            ERR("mmio-dump: Could not write `%s' (%s).", argv[5], strerror(-rc));
+        }
+    } else {
+        poke_hexdump(stdout, off, buf, len, a->width);
+    }
+    free(buf);
+
+    INF("mmio-dump: %02x:%02x.%1x BAR%lu %#llx-%#llx, %llu bytes read in %lluns (%.1fMB/s).",
+        bdf.bus, bdf.slot, bdf.func, bar, off, off + len, len, t,
+        t ? len * 1e9 / t / MB(1) : 0.);
+    return rc;
+}
+
+/*
+ * BAR snapshots.
+ * mmio-snap saves a range, read the same way as mmio-dump, to a file: a
+ * header telling where it comes from followed by the raw bytes. mmio-diff
+ * reads the same range again and lists the words that changed. The compare
+ * skips equal 64 bytes blocks with SSE2 so only changed blocks are looked at
+ * word by word; with -u the snapshot is then updated, to track changes
+ * from one action to the next.
+ */
+#define POKE_SNAP_MAGIC     "POKESNAP"
+#define POKE_SNAP_MAX       MB(256)
+
+struct poke_snap_hdr {
+    char magic[8];
+    uint32_t width;
+    uint32_t bar;
+    uint32_t domain;
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint8_t pad;
+    uint64_t off;
+    uint64_t len;
+};
+
+/* Read [@off, @off + @len) of the BAR in @buf, @t is set to the time it took. */
+static int poke_mmio_read_range(const struct pci_bdf *bdf, unsigned long bar, unsigned long long off,
+                                unsigned long long len, const struct poke_access *a, void *buf,
+                                unsigned long long *t)
+{
+    struct pci_handle *h;
+
+    h = pci_get_bar(bdf, bar, off, len, 0);
+    if (!h) {
+        return -errno;
+    }
+    *t = poke_now();
+    a->copy(buf, pci_bar_ptr(h, off), len);
+    *t = poke_now() - *t;
+    pci_put_bar(h);
+    return 0;
+}
+
+static int poke_mmio_snap(int argc, char *argv[])
+{
+    struct poke_snap_hdr *hdr;
+    struct pci_bdf bdf;
+    unsigned long bar;
+    unsigned long long off, len, t;
+    const struct poke_access *a;
+    int rc;
+
+    test_or_failret(argc != 6, -EINVAL, "mmio-snap: Invalid parameters for `mmio-snap' command.");
+
+    rc = parse_bdf(argv[0], &bdf);
+    test_or_failret(rc < 0, rc, "mmio-snap: Could not parse PCI BDF `%s' (%s).", argv[0], strerror(-rc));
+    rc = parse_ul(argv[1], &bar);
+    test_or_failret(rc < 0, rc, "mmio-snap: Could not parse PCI BAR `%s' (%s).", argv[1], strerror(-rc));
+    rc = parse_ull(argv[2], &off);
+    test_or_failret(rc < 0, rc, "mmio-snap: Could not parse offset `%s' (%s).", argv[2], strerror(-rc));
+    rc = parse_ull(argv[3], &len);
+    test_or_failret(rc < 0, rc, "mmio-snap: Could not parse length `%s' (%s).", argv[3], strerror(-rc));
+    a = poke_access(argv[4]);
+    test_or_failret(!a || a->width < 4, -EINVAL, "mmio-snap: Could not parse access size `%s' (%s).", argv[4], strerror(EINVAL));
+    test_or_failret(!len || len > POKE_SNAP_MAX, -ERANGE, "mmio-snap: Length must be within 1-%u.", POKE_SNAP_MAX);
+    test_or_failret((off | len) & (a->width - 1), -EINVAL,
+                    "mmio-snap: Offset and length must be multiples of the access size (%u).", a->width);
+
+    hdr = m_malloc0(sizeof (*hdr) + len);
+    memcpy(hdr->magic, POKE_SNAP_MAGIC, sizeof (hdr->magic));
+    hdr->width = a->width;
+    hdr->bar = bar;
+    hdr->domain = bdf.domain;
+    hdr->bus = bdf.bus;
+    hdr->slot = bdf.slot;
+    hdr->func = bdf.func;
+    hdr->off = off;
+    hdr->len = len;
+
+    rc = poke_mmio_read_range(&bdf, bar, off, len, a, hdr + 1, &t);
+    if (rc) {
+        ERR("mmio-snap: Could not map %s BAR%s %#llx-%#llx (%s).", argv[0], argv[1], off, off + len, strerror(-rc));
+        free(hdr);
+        return rc;
+    }
+    rc = poke_write_file(argv[5], hdr, sizeof (*hdr) + len);
+    if (rc) {
+        ERR("mmio-snap: Could not write `%s' (%s).", argv[5], strerror(-rc));
+    } else {
+        INF("mmio-snap: %02x:%02x.%1x BAR%lu %#llx-%#llx -> %s, %llu bytes read in %lluns.",
+            bdf.bus, bdf.slot, bdf.func, bar, off, off + len, argv[5], len, t);
+    }
+    free(hdr);
+    return rc;
+}
+
+/* First 64 bytes block at or after @i where @x and @y differ, @n if none. */
+static size_t poke_diff_next(const uint8_t *x, const uint8_t *y, size_t i, size_t n)
+{
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; n - i >= 64; i += 64) {
+        __m128i d0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(x + i)),
+                                   _mm_loadu_si128((const __m128i *)(y + i)));
+        __m128i d1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(x + i + 16)),
+                                   _mm_loadu_si128((const __m128i *)(y + i + 16)));
+        __m128i d2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(x + i + 32)),
+                                   _mm_loadu_si128((const __m128i *)(y + i + 32)));
+        __m128i d3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(x + i + 48)),
+                                   _mm_loadu_si128((const __m128i *)(y + i + 48)));
+        __m128i d = _mm_or_si128(_mm_or_si128(d0, d1), _mm_or_si128(d2, d3));
 
-    switch (argv[3][0]) {
-        case 'b':
-            ((uint8_t*)(h->p))[reg_addr] = reg_data & 0xff;
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(d, zero)) != 0xffff) {
             break;
-        case 'w':
-            *((uint16_t*)&((uint8_t*)(h->p))[reg_addr]) = reg_data & 0xffff;
+        }
+    }
+#else
+    for (; n - i >= 64 && !memcmp(x + i, y + i, 64); i += 64);
+#endif
+    return i;
+}
+
+static int poke_mmio_diff(int argc, char *argv[])
+{
+    struct poke_snap_hdr *hdr;
+    struct pci_bdf bdf;
+    unsigned long long t, tcmp;
+    unsigned long changed = 0;
+    uint8_t *old, *cur;
+    size_t size, i, end;
+    int update, rc;
+
+    test_or_failret(argc != 1 && argc != 2, -EINVAL, "mmio-diff: Invalid parameters for `mmio-diff' command.");
+    update = (argc == 2);
+    test_or_failret(update && strcmp(argv[1], "-u"), -EINVAL, "mmio-diff: Unknown option `%s'.", argv[1]);
+
+    rc = poke_read_file(argv[0], (void **)&hdr, &size);
+    test_or_failret(rc < 0, rc, "mmio-diff: Could not read `%s' (%s).", argv[0], strerror(-rc));
+    if (size < sizeof (*hdr) || memcmp(hdr->magic, POKE_SNAP_MAGIC, sizeof (hdr->magic)) ||
+        (hdr->width != 4 && hdr->width != 8) || hdr->len != size - sizeof (*hdr)) {
+        ERR("mmio-diff: `%s' is not a snapshot.", argv[0]);
+        free(hdr);
+        return -EINVAL;
+    }
+    bdf.domain = hdr->domain;
+    bdf.bus = hdr->bus;
+    bdf.slot = hdr->slot;
+    bdf.func = hdr->func;
+    old = (uint8_t *)(hdr + 1);
+
+    cur = m_malloc(hdr->len);
+    rc = poke_mmio_read_range(&bdf, hdr->bar, hdr->off, hdr->len,
+                              poke_access_width(hdr->width), cur, &t);
+    if (rc) {
+        ERR("mmio-diff: Could not map %02x:%02x.%1x BAR%u %#" PRIx64 "-%#" PRIx64 " (%s).",
+            bdf.bus, bdf.slot, bdf.func, hdr->bar, hdr->off, hdr->off + hdr->len, strerror(-rc));
+        goto out;
+    }
+
+    tcmp = poke_now();
+    for (i = 0; i < hdr->len; ) {
+        i = poke_diff_next(old, cur, i, hdr->len);
+        end = (hdr->len - i < 64) ? hdr->len : i + 64;
+        for (; i < end; i += hdr->width) {
+            uint64_t o = 0, c = 0;
+
+            if (!memcmp(old + i, cur + i, hdr->width)) {
+                continue;
+            }
+            memcpy(&o, old + i, hdr->width);
+            memcpy(&c, cur + i, hdr->width);
+            printf("%08" PRIx64 ": %0*" PRIx64 " -> %0*" PRIx64 "\n",
+                   hdr->off + i, hdr->width * 2, o, hdr->width * 2, c);
+            ++changed;
+        }
+    }
+    tcmp = poke_now() - tcmp;
+    INF("mmio-diff: %02x:%02x.%1x BAR%u %#" PRIx64 "-%#" PRIx64 ", %lu of %" PRIu64 " words changed, read in %lluns, compared in %lluns.",
+        bdf.bus, bdf.slot, bdf.func, hdr->bar, hdr->off, hdr->off + hdr->len, changed,
+        hdr->len / hdr->width, t, tcmp);
+
+    if (update && changed) {
+        memcpy(old, cur, hdr->len);
+        rc = poke_write_file(argv[0], hdr, size);
+        if (rc) {
+            ERR("mmio-diff: Could not update `%s' (%s).", argv[0], strerror(-rc));
+        }
+    }
+out:
+    free(cur);
+    free(hdr);
+    return rc;
+}
+
+/*
+ * Wait for a register to match.
+ * The register is first read in a tight loop, with a pause between reads so a
+ * sibling hyper-thread is not starved, for POKE_WAIT_SPIN_NS. Then the loop
+ * sleeps between reads, starting at POKE_WAIT_SLEEP_MIN_NS and doubling up to
+ * POKE_WAIT_SLEEP_MAX_NS, so long waits do not burn a CPU.
+ */
+#define POKE_WAIT_SPIN_NS       (50ULL * 1000ULL)
+#define POKE_WAIT_SLEEP_MIN_NS  (1ULL * 1000ULL)
+#define POKE_WAIT_SLEEP_MAX_NS  (1000ULL * 1000ULL)
+#define POKE_WAIT_TIMEOUT_MS    1000UL
+
+static uint64_t poke_wait_mmio(const struct poke_access *a, uintptr_t reg)
+{
+    return a->load((const void *)reg);
+}
+
+static uint64_t poke_wait_io(const struct poke_access *a, uintptr_t port)
+{
+    return a->in(port);
+}
+
+/*
+ * Read @where with @load until (value & @mask) == @value, or @timeout ms
+ * (0 for ever) elapsed. The last value read is left in @v.
+ */
+static int poke_wait(uint64_t (*load)(const struct poke_access *, uintptr_t), uintptr_t where,
+                     const struct poke_access *a, unsigned long long mask, unsigned long long value,
+                     unsigned long timeout, uint64_t *v, unsigned long long *elapsed,
+                     unsigned long *reads)
+{
+    unsigned long long start, now, deadline, sleep_ns = POKE_WAIT_SLEEP_MIN_NS;
+    int rc = 0;
+
+    *reads = 0;
+    start = now = poke_now();
+    deadline = timeout ? start + timeout * 1000000ULL : ~0ULL;
+    for (;;) {
+        *v = load(a, where);
+        ++*reads;
+        if ((*v & mask) == value) {
             break;
-        case 'l':
-            *((uint32_t*)&((uint8_t*)(h->p))[reg_addr]) = reg_data & 0xffffffff;
+        }
+        now = poke_now();
+        if (now >= deadline) {
+            rc = -ETIMEDOUT;
             break;
-        default:
-            ERR("mmio-write: Could not parse register size `%s' (%s).", argv[3], strerror(EINVAL));
+        }
+        if (now - start < POKE_WAIT_SPIN_NS) {
+            cpu_relax();
+        } else {
+            unsigned long long ns = sleep_ns;
+            struct timespec ts;
+
+            if (ns > deadline - now) {
+                ns = deadline - now;
+            }
+            ts.tv_sec = ns / 1000000000ULL;
+            ts.tv_nsec = ns % 1000000000ULL;
+            nanosleep(&ts, NULL);
+            if (sleep_ns < POKE_WAIT_SLEEP_MAX_NS) {
+                sleep_ns *= 2;
+            }
+        }
+    }
+    *elapsed = poke_now() - start;
+    return rc;
+}
+
+static int poke_mmio_wait(int argc, char *argv[])
+{
+    struct pci_bdf bdf;
+    unsigned long bar, timeout = POKE_WAIT_TIMEOUT_MS;
+    unsigned long long reg_addr, mask, value, elapsed;
+    unsigned long reads;
+    const struct poke_access *a;
+    struct pci_handle *h;
+    uint64_t v;
+    int rc = 0;
+
+    test_or_failret(argc != 6 && argc != 7, -EINVAL, "mmio-wait: Invalid parameters for `mmio-wait' command.");
+
+    rc = parse_bdf(argv[0], &bdf);
+    test_or_failret(rc < 0, rc, "mmio-wait: Could not parse PCI BDF `%s' (%s).", argv[0], strerror(-rc));
+    rc = parse_ul(argv[1], &bar);
+    test_or_failret(rc < 0, rc, "mmio-wait: Could not parse PCI BAR `%s' (%s).", argv[1], strerror(-rc));
+    rc = parse_ull(argv[2], &reg_addr);
+    test_or_failret(rc < 0, rc, "mmio-wait: Could not parse register address `%s' (%s).", argv[2], strerror(-rc));
+    a = poke_access(argv[3]);
+    test_or_failret(!a, -EINVAL, "mmio-wait: Could not parse register size `%s' (%s).", argv[3], strerror(EINVAL));
+    rc = parse_ull(argv[4], &mask);
+    test_or_failret(rc < 0, rc, "mmio-wait: Could not parse mask `%s' (%s).", argv[4], strerror(-rc));
+    rc = parse_ull(argv[5], &value);
+    test_or_failret(rc < 0, rc, "mmio-wait: Could not parse value `%s' (%s).", argv[5], strerror(-rc));
+    if (argc == 7) {
+        rc = parse_ul(argv[6], &timeout);
+        test_or_failret(rc < 0, rc, "mmio-wait: Could not parse timeout `%s' (%s).", argv[6], strerror(-rc));
+    }
+    test_or_failret((value & ~mask) != 0, -EINVAL, "mmio-wait: Value %#llx has bits outside of mask %#llx.", value, mask);
+
+    h = pci_get_bar(&bdf, bar, reg_addr, a->width, 0);
+    test_or_failret(!h, -errno, "mmio-wait: Could not map %s BAR%s at %#llx.%c (%s).", argv[0], argv[1], reg_addr, a->size, strerror(errno));
+    rc = poke_wait(poke_wait_mmio, (uintptr_t)pci_bar_ptr(h, reg_addr), a, mask, value,
+                   timeout, &v, &elapsed, &reads);
+    pci_put_bar(h);
+
+    if (rc) {
+        ERR("mmio-wait: %02x:%02x.%1x BAR%lu %#llx.%c still %#" PRIx64 " after %lluns (%lu reads), waiting for %#llx/%#llx.",
+            bdf.bus, bdf.slot, bdf.func, bar, reg_addr, a->size, v, elapsed, reads, value, mask);
+        return rc;
+    }
+    INF("mmio-wait: %02x:%02x.%1x BAR%lu %#llx.%c -> %#" PRIx64 " after %lluns (%lu reads).",
+        bdf.bus, bdf.slot, bdf.func, bar, reg_addr, a->size, v, elapsed, reads);
+    return 0;
+}
+
+static int poke_io_wait(int argc, char *argv[])
+{
+    unsigned long addr, timeout = POKE_WAIT_TIMEOUT_MS;
+    unsigned long long mask, value, elapsed;
+    unsigned long reads;
+    const struct poke_access *a;
+    uint64_t v;
+    int rc = 0;
+
+    test_or_failret(argc != 4 && argc != 5, -EINVAL, "io-wait: Invalid parameters for `io-wait' command.");
+
+    rc = parse_ul(argv[0], &addr);
+    test_or_failret(rc < 0, rc, "io-wait: Could not parse IO port address `%s' (%s).", argv[0], strerror(-rc));
+    a = poke_io_access(argv[1]);
+    test_or_failret(!a, -EINVAL, "io-wait: Could not parse IO port size `%s' (%s).", argv[1], strerror(EINVAL));
+    rc = parse_ull(argv[2], &mask);
+    test_or_failret(rc < 0, rc, "io-wait: Could not parse mask `%s' (%s).", argv[2], strerror(-rc));
+    rc = parse_ull(argv[3], &value);
+    test_or_failret(rc < 0, rc, "io-wait: Could not parse value `%s' (%s).", argv[3], strerror(-rc));
+    if (argc == 5) {
+        rc = parse_ul(argv[4], &timeout);
+        test_or_failret(rc < 0, rc, "io-wait: Could not parse timeout `%s' (%s).", argv[4], strerror(-rc));
+    }
+    test_or_failret((value & ~mask) != 0, -EINVAL, "io-wait: Value %#llx has bits outside of mask %#llx.", value, mask);
+
+    rc = poke_ioperm(addr, a->width);
+    test_or_failret(rc < 0, rc, "io-wait: Could not access IO port address `%s.%c' (%s).", argv[0], a->size, strerror(-rc));
+    rc = poke_wait(poke_wait_io, addr, a, mask, value, timeout, &v, &elapsed, &reads);
+    if (rc) {
+        ERR("io-wait: in%c(%#lx) still %#" PRIx64 " after %lluns (%lu reads), waiting for %#llx/%#llx.",
+            a->size, addr, v, elapsed, reads, value, mask);
+        return rc;
+    }
+    INF("io-wait: in%c(%#lx) -> %#" PRIx64 " after %lluns (%lu reads).", a->size, addr, v, elapsed, reads);
+    return 0;
+}
+
+/*
+ * Run a script of commands.
+ * One command per line, as given on the command line, `#' starts a comment.
+ * The libxc handle and BAR mappings are shared by all the commands, and each
+ * one is timed. Stops at the first command failing.
+ */
+#define POKE_LINE_MAX   1024
+#define POKE_ARGS_MAX   16
+
+static int poke_batch(int argc, char *argv[])
+{
+    char line[POKE_LINE_MAX];
+    char *args[POKE_ARGS_MAX], *tok, *save;
+    const struct poke_op *op;
+    unsigned int lineno = 0, ncmds = 0;
+    unsigned long long t, total = 0;
+    FILE *f;
+    int n, rc = 0;
+
+    test_or_failret(argc != 1, -EINVAL, "batch: Invalid parameters for `batch' command.");
+
+    f = strcmp(argv[0], "-") ? fopen(argv[0], "r") : stdin;
+    test_or_failret(!f, -errno, "batch: Could not open `%s' (%s).", argv[0], strerror(errno));
+
+    while (fgets(line, sizeof (line), f)) {
+        ++lineno;
+        /* A full buffer with no newline, the rest would run as a command of its own. */
+        if (!strchr(line, '\n') && !feof(f)) {
+            ERR("batch:%u: Line too long.", lineno);
+            rc = -E2BIG;
+            break;
+        }
+        n = 0;
+        for (tok = strtok_r(line, " \t\r\n", &save); tok && *tok != '#';
+             tok = strtok_r(NULL, " \t\r\n", &save)) {
+            if (n == POKE_ARGS_MAX) {
+                break;
+            }
+            args[n++] = tok;
+        }
+        if (!n) {
+            continue;
+        }
+        if (tok && *tok != '#') {
+            ERR("batch:%u: Too many arguments.", lineno);
+            rc = -E2BIG;
+            break;
+        }
+        op = poke_find_op(args[0]);
+        if (!op || op->cmd == poke_batch) {
+            ERR("batch:%u: Unknown command `%s'.", lineno, args[0]);
             rc = -EINVAL;
+            break;
+        }
+
+        t = poke_now();
+        rc = op->cmd(n - 1, &args[1]);
+        t = poke_now() - t;
+        total += t;
+        ++ncmds;
+        INF("batch:%u: %s %s in %lluns.", lineno, args[0], rc ? "failed" : "done", t);
+        if (rc) {
+            break;
+        }
     }
-    INF("mmio-write: %02u:%02x.%1x BAR%lu %#llx.%c <- %#lx.", bdf.bus, bdf.slot, bdf.func, bar,
-        reg_addr, argv[3][0], reg_data);
+    if (!rc && ferror(f)) {
+        rc = -EIO;
+        ERR("batch: Could not read `%s'.", argv[0]);
+    }
+    INF("batch: %u commands in %lluns.", ncmds, total);
 
-    pci_close_handle(h);
+    if (f != stdin) {
+        fclose(f);
+    }
     return rc;
 }
 
 
 int main(int argc, char *argv[])
 {
-    size_t i;
+    const struct poke_op *op;
     int rc = 0;
 
     if (argc <= 1) {
         return usage(argc, argv);
     }
+    if (!strcmp(argv[1], "-f")) {
+        argv[1] = "batch";
+    }
 
-    for (i = 0; i < ARRAY_LEN(poke_ops); ++i) {
-        if (!strcmp(poke_ops[i].cmd_str, argv[1])) {
-            INF("found command %s.", argv[1]);
-            rc = poke_ops[i].cmd(argc - 2, &argv[2]);
-        }
+    op = poke_find_op(argv[1]);
+    if (op) {
+        INF("found command %s.", argv[1]);
+        rc = op->cmd(argc - 2, &argv[2]);
     }
+    poke_release();
 
     return rc;
 }
@@ -67,12 +67,63 @@
 #  include <fcntl.h>
 # endif
 
+# ifdef HAVE_TIME_H
+#  include <time.h>
+# endif
+
 # ifdef HAVE_XENCTRL_H
 #  include <xenctrl.h>
 # endif
 
+# ifdef __SSE2__
+#  include <emmintrin.h>
+# endif
+
 # include "utils.h"
 # include "pci.h"
 
+static inline unsigned long long poke_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+# if defined(__i386__) || defined(__x86_64__)
+#  define cpu_relax()   __asm__ __volatile__("pause" ::: "memory")
+# elif defined(__aarch64__)
+#  define cpu_relax()   __asm__ __volatile__("yield" ::: "memory")
+# else
+#  define cpu_relax()   __asm__ __volatile__("" ::: "memory")
+# endif
+
+/* poke.c */
+/* Get access to ports [@port, @port + @n), kept until poke_release(). */
+int poke_ioperm(unsigned long port, unsigned long n);
+
+/* Register accessors of one access size, IO ones are NULL past 4 bytes. */
+struct poke_access {
+    char size;          /* b|w|l|q */
+    unsigned int width;
+    uint64_t (*load)(const void *p);
+    void (*store)(void *p, uint64_t v);
+    void (*copy)(void *dst, const void *src, size_t len);
+    uint32_t (*in)(unsigned long port);
+    void (*out)(unsigned long port, uint32_t v);
+    void (*ins)(unsigned long port, void *buf, unsigned long n);
+    void (*outs)(unsigned long port, const void *buf, unsigned long n);
+};
+
+/* Accessors of a b|w|l|q size argument, NULL if invalid. */
+const struct poke_access *poke_access(const char *s);
+/* Same for IO ports, b|w|l only. */
+const struct poke_access *poke_io_access(const char *s);
+
+/* bench.c */
+int poke_bench(int argc, char *argv[]);
+void poke_latency_report(const char *tag, uint64_t *samples, unsigned long n,
+                         double ns_per_unit);
+
 #endif /* !_POKE_H_ */
 
@@ -0,0 +1,246 @@
+#include "v4cat.h"
+
+/*
+ * Round-trip latency probes.
+ *
+ * Probes are fixed size records starting with a small header carrying a
+ * sequence number and the monotonic time they were sent at. The remote end
+ * (v4cat -l --echo) reflects the byte stream as is, so the RTT of a probe is
+ * simply the difference between its reception time and the timestamp it
+ * carries.
+ */
+#define PING_MAGIC      0x76347069  /* "v4pi" */
+
+struct ping_probe {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t ts;        /* CLOCK_MONOTONIC, in ns. */
+};
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Run one probe series: send @count probes of @size bytes, at most @window of
+ * them in flight and paced at @rate probes per second (0 for as fast as
+ * possible). The RTT of every probe is stored in @rtts, in reception order.
+ */
+static int ping_run(int fd, const struct ping_opts *o, unsigned long window,
+                    unsigned long rate, uint64_t *rtts, uint64_t *elapsed)
+{
+    char *tx, *rx;
+    size_t tx_off = 0, rx_off = 0;
+    unsigned long sent = 0, recv = 0;
+    uint64_t start, period, t;
+    int rc = 0;
+
+    tx = m_malloc0(o->size);
+    rx = m_malloc(o->size);
+    period = rate ? 1000000000ULL / rate : 0;
+
+    start = now_ns();
+    while (recv < o->count) {
+        /* Transports may signal room to write on another fd. */
+        struct pollfd pfd[2] = {
+            { .fd = fd, .events = POLLIN, .revents = 0 },
+            { .fd = -1, .events = 0, .revents = 0 },
+        };
+        int timeout = -1;
+
+        t = now_ns();
+        /* Start a new probe when due and within the in-flight window. */
+        if (!tx_off && sent < o->count && (sent - recv) < window) {
+            uint64_t due = start + sent * period;
+
+            if (t >= due) {
+                struct ping_probe *p = (struct ping_probe *)tx;
+
+                p->magic = PING_MAGIC;
+                p->seq = sent;
+                p->ts = t;
+                tx_off = o->size;
+            } else {
+                timeout = (due - t) / 1000000 + 1;
+            }
+        }
+        if (tx_off) {
+            pfd[1].fd = xport_wait_wr(fd, &pfd[1].events);
+        }
+
+        rc = poll(pfd, 2, timeout);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rc = -errno;
+            goto out;
+        }
+        if ((pfd[0].revents | pfd[1].revents) & (POLLERR | POLLNVAL)) {
+            rc = -EPIPE;
+            goto out;
+        }
+
+        if (pfd[1].revents) {
+            ssize_t nw;
+
+            nw = xport_write(fd, tx + o->size - tx_off, tx_off);
+            if (nw < 0 && errno != EAGAIN && errno != EINTR) {
+                rc = -errno;
+                goto out;
+            }
+            if (nw > 0) {
+                tx_off -= nw;
+                if (!tx_off) {
+                    ++sent;
+                }
+            }
+        }
+
+        if (pfd[0].revents & (POLLIN | POLLHUP)) {
+            ssize_t nr;
+
+            nr = xport_read(fd, rx + rx_off, o->size - rx_off);
+            if (nr < 0 && errno != EAGAIN && errno != EINTR) {
+                rc = -errno;
+                goto out;
+            }
+            if (!nr) {
+                ERR("ping: peer closed the connection after %lu/%lu probes.",
+                    recv, o->count);
+                rc = -ECONNRESET;
+                goto out;
+            }
+            if (nr > 0) {
+                rx_off += nr;
+            }
+            if (rx_off == o->size) {
+                struct ping_probe *p = (struct ping_probe *)rx;
+
+                if (p->magic != PING_MAGIC || p->seq != recv) {
+                    ERR("ping: unexpected probe (magic %#x, seq %u, expected %lu).",
+                        p->magic, p->seq, recv);
+                    rc = -EPROTO;
+                    goto out;
+                }
+                rtts[recv++] = now_ns() - p->ts;
+                rx_off = 0;
+            }
+        }
+    }
+    rc = 0;
+
+out:
+    *elapsed = now_ns() - start;
+    free(rx);
+    free(tx);
+    return rc;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static inline uint64_t percentile(const uint64_t *sorted, unsigned long n,
+                                  unsigned int pct)
+{
+    return sorted[((n - 1) * pct) / 100];
+}
+
+/*
+ * Display min/p50/p99/max and a log2 histogram (in us) of sorted RTTs.
+ */
+#define PING_HIST_BUCKETS   24
+#define PING_HIST_WIDTH     50
+static void ping_report_rtt(const uint64_t *rtts, unsigned long n)
+{
+    unsigned long hist[PING_HIST_BUCKETS] = { 0 };
+    unsigned long i, max = 0;
+    unsigned int b, first = PING_HIST_BUCKETS, last = 0;
+
+    INF("rtt min/p50/p99/max = %.1f/%.1f/%.1f/%.1f us",
+        rtts[0] / 1000., percentile(rtts, n, 50) / 1000.,
+        percentile(rtts, n, 99) / 1000., rtts[n - 1] / 1000.);
+
+    for (i = 0; i < n; ++i) {
+        uint64_t us = rtts[i] / 1000;
+
+        for (b = 0; us && b < PING_HIST_BUCKETS - 1; ++b) {
+            us >>= 1;
+        }
+        ++hist[b];
+    }
+    for (b = 0; b < PING_HIST_BUCKETS; ++b) {
+        if (!hist[b]) {
+            continue;
+        }
+        first = (b < first) ? b : first;
+        last = b;
+        max = (hist[b] > max) ? hist[b] : max;
+    }
+    for (b = first; b <= last; ++b) {
+        char bar[PING_HIST_WIDTH + 1];
+        unsigned int w = (hist[b] * PING_HIST_WIDTH) / max;
+
+        memset(bar, '#', w);
+        bar[w] = '\0';
+        INF("  < %8lu us: %8lu %s", 1UL << b, hist[b], bar);
+    }
+}
+
+/*
+ * Probe the connected stream @fd: a paced latency series first, then an
+ * unthrottled series for each in-flight window (1, 2, 4, ... o->window) to
+ * draw the throughput-under-load curve.
+ */
+int v4cat_ping(int fd, const struct ping_opts *o)
+{
+    uint64_t *rtts, elapsed;
+    unsigned long w;
+    int rc;
+
+    test_or_failret(o->size < sizeof (struct ping_probe), -EINVAL,
+                    "ping: probe size must be at least %zuB.", sizeof (struct ping_probe));
+    test_or_failret(!o->count, -EINVAL, "ping: probe count must not be 0.");
+
+    rtts = m_malloc(o->count * sizeof (*rtts));
+
+    INF("ping: %lu probes of %zuB at %lu/s.", o->count, o->size, o->rate);
+    rc = ping_run(fd, o, 1, o->rate, rtts, &elapsed);
+    if (rc) {
+        goto out;
+    }
+    qsort(rtts, o->count, sizeof (*rtts), cmp_u64);
+    ping_report_rtt(rtts, o->count);
+
+    INF("ping: throughput under load (%lu probes of %zuB per step):", o->count, o->size);
+    INF("  %8s %12s %12s %12s %12s", "window", "probes/s", "MB/s", "p50 (us)", "p99 (us)");
+    for (w = 1; w <= o->window; w <<= 1) {
+        double secs;
+
+        rc = ping_run(fd, o, w, 0, rtts, &elapsed);
+        if (rc) {
+            goto out;
+        }
+        qsort(rtts, o->count, sizeof (*rtts), cmp_u64);
+        secs = elapsed / 1e9;
+        INF("  %8lu %12.0f %12.2f %12.1f %12.1f", w, o->count / secs,
+            (2. * o->count * o->size) / secs / MB(1),
+            percentile(rtts, o->count, 50) / 1000.,
+            percentile(rtts, o->count, 99) / 1000.);
+    }
+
+out:
+    if (rc) {
+        ERR("ping: probe series failed (%s).", strerror(-rc));
+    }
+    free(rtts);
+    return rc;
+}
@@ -0,0 +1,542 @@
+#include "v4cat.h"
+
+/*
+ * Shared memory stand-in for v4v streams.
+ *
+ * A connection is a memfd holding two single-producer/single-consumer rings,
+ * one per direction, with eventfd doorbells. Producer and consumer indices
+ * live on separate cache lines and are free running, the ring size being a
+ * power of 2. Doorbells are only rung when the other end said it is about to
+ * wait (rwait/wwait), so a busy stream costs no syscall besides the copies.
+ *
+ * Rendezvous goes through an abstract UNIX socket named after the port: the
+ * listener creates the region and passes it, along with the doorbells, to
+ * the connecting process using SCM_RIGHTS. Both ends keep the socket open for
+ * the channel lifetime, its hangup tells a peer that went away without
+ * closing the rings.
+ *
+ * Channels are identified by an epoll fd waiting on their data doorbell and
+ * the socket, so they can be select()ed for input like any other fd. Waiting
+ * for room to write is done on another one, see xport_wait_wr(). Channels are
+ * always non-blocking.
+ */
+#define SHM_RING_SIZE   KB(256)
+#define SHM_CACHELINE   64
+
+struct shm_ring {
+    /* Producer side. */
+    uint32_t head __attribute__((aligned(SHM_CACHELINE)));
+    uint32_t wclosed;   /* Producer is gone. */
+    uint32_t rwait;     /* Consumer waits on the data doorbell. */
+    /* Consumer side. */
+    uint32_t tail __attribute__((aligned(SHM_CACHELINE)));
+    uint32_t rclosed;   /* Consumer is gone. */
+    uint32_t wwait;     /* Producer waits on the space doorbell. */
+    char data[] __attribute__((aligned(SHM_CACHELINE)));
+};
+
+#define SHM_RING_LEN    (sizeof (struct shm_ring) + SHM_RING_SIZE)
+
+/* Doorbells, as passed at rendezvous: data and space for both rings. */
+enum { SHM_D0 = 0, SHM_S0, SHM_D1, SHM_S1, SHM_NFDS };
+
+struct shm_chan {
+    void *map;
+    struct shm_ring *rx, *tx;
+    int rx_data;    /* Identity of the channel, readable when rx has data. */
+    int rx_space;   /* Rung after consuming, when the peer waits. */
+    int tx_data;    /* Rung after producing, when the peer waits. */
+    int tx_space;   /* Readable when tx has room again. */
+    int sock;       /* Rendezvous socket, hangs up when the peer is gone. */
+    int rd_wait;    /* Identity of the channel, rx_data and sock. */
+    int wr_wait;    /* tx_space and sock. */
+};
+
+/*
+ * Channels indexed by fd.
+ */
+static struct shm_chan **chans = NULL;
+static unsigned int nchans = 0;
+
+static inline struct shm_chan *shm_chan_get(int fd)
+{
+    if (fd < 0 || (unsigned int)fd >= nchans) {
+        return NULL;
+    }
+    return chans[fd];
+}
+
+static void shm_chan_set(int fd, struct shm_chan *c)
+{
+    if ((unsigned int)fd >= nchans) {
+        unsigned int n = nchans ? nchans : 64;
+
+        while (n <= (unsigned int)fd) {
+            n *= 2;
+        }
+        chans = m_realloc(chans, n * sizeof (*chans));
+        memset(chans + nchans, 0, (n - nchans) * sizeof (*chans));
+        nchans = n;
+    }
+    chans[fd] = c;
+}
+
+/*
+ * Doorbells.
+ */
+static inline void doorbell_ring(int efd)
+{
+    uint64_t v = 1;
+
+    if (write(efd, &v, sizeof (v)) < 0) {
+        /* Counter saturated, the other end will wake up anyway. */
+    }
+}
+
+static inline void doorbell_clear(int efd)
+{
+    uint64_t v;
+
+    if (read(efd, &v, sizeof (v)) < 0) {
+        /* Not rung. */
+    }
+}
+
+/*
+ * The peer never writes to the socket after rendezvous, it only becomes
+ * readable on hangup.
+ */
+static int shm_peer_gone(struct shm_chan *c)
+{
+    struct pollfd pfd = { .fd = c->sock, .events = POLLIN, .revents = 0 };
+
+    return poll(&pfd, 1, 0) == 1;
+}
+
+/*
+ * Data path.
+ */
+static ssize_t shm_read(struct shm_chan *c, void *buf, size_t n)
+{
+    struct shm_ring *r = c->rx;
+    uint32_t head, tail, off;
+    size_t len, first;
+
+    for (;;) {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        tail = r->tail;
+        if (head != tail) {
+            break;
+        }
+        if (__atomic_load_n(&r->wclosed, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        /* Empty, announce we are about to wait and check again. */
+        doorbell_clear(c->rx_data);
+        __atomic_store_n(&r->rwait, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != tail ||
+            __atomic_load_n(&r->wclosed, __ATOMIC_SEQ_CST)) {
+            continue;
+        }
+        if (shm_peer_gone(c)) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+
+    len = head - tail;
+    len = (len < n) ? len : n;
+    off = tail & (SHM_RING_SIZE - 1);
+    first = (len < SHM_RING_SIZE - off) ? len : SHM_RING_SIZE - off;
+    memcpy(buf, r->data + off, first);
+    memcpy((char *)buf + first, r->data, len - first);
+    __atomic_store_n(&r->tail, tail + len, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->wwait, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&r->wwait, 0, __ATOMIC_RELAXED);
+        doorbell_ring(c->rx_space);
+    }
+    return len;
+}
+
+static ssize_t shm_write(struct shm_chan *c, const void *buf, size_t n)
+{
+    struct shm_ring *r = c->tx;
+    uint32_t head, tail, off;
+    size_t len, first;
+
+    for (;;) {
+        if (__atomic_load_n(&r->rclosed, __ATOMIC_ACQUIRE)) {
+            errno = EPIPE;
+            return -1;
+        }
+        tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        head = r->head;
+        if (head - tail < SHM_RING_SIZE) {
+            break;
+        }
+        /* Full, announce we are about to wait and check again. */
+        doorbell_clear(c->tx_space);
+        __atomic_store_n(&r->wwait, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) != tail) {
+            continue;
+        }
+        errno = shm_peer_gone(c) ? EPIPE : EAGAIN;
+        return -1;
+    }
+
+    len = SHM_RING_SIZE - (head - tail);
+    len = (len < n) ? len : n;
+    off = head & (SHM_RING_SIZE - 1);
+    first = (len < SHM_RING_SIZE - off) ? len : SHM_RING_SIZE - off;
+    memcpy(r->data + off, buf, first);
+    memcpy(r->data, (const char *)buf + first, len - first);
+    __atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->rwait, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&r->rwait, 0, __ATOMIC_RELAXED);
+        doorbell_ring(c->tx_data);
+    }
+    return len;
+}
+
+/*
+ * Make the space doorbell readable as soon as a write can make progress:
+ * right away if there is room (or the consumer is gone), when the consumer
+ * frees some otherwise.
+ */
+static void shm_arm_space(struct shm_chan *c)
+{
+    struct shm_ring *r = c->tx;
+
+    __atomic_store_n(&r->wwait, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->rclosed, __ATOMIC_SEQ_CST) ||
+        r->head - __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) < SHM_RING_SIZE) {
+        __atomic_store_n(&r->wwait, 0, __ATOMIC_RELAXED);
+        doorbell_ring(c->tx_space);
+    }
+}
+
+static void shm_close(struct shm_chan *c)
+{
+    __atomic_store_n(&c->tx->wclosed, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&c->rx->rclosed, 1, __ATOMIC_SEQ_CST);
+    /* Wake the peer whatever it is waiting on. */
+    doorbell_ring(c->tx_data);
+    doorbell_ring(c->rx_space);
+
+    shm_chan_set(c->rd_wait, NULL);
+    munmap(c->map, 2 * SHM_RING_LEN);
+    close(c->rd_wait);
+    close(c->wr_wait);
+    close(c->sock);
+    close(c->rx_data);
+    close(c->rx_space);
+    close(c->tx_data);
+    close(c->tx_space);
+    free(c);
+}
+
+/*
+ * epoll fd readable when @efd is or @sock hangs up.
+ */
+static int shm_wait_set(int efd, int sock)
+{
+    struct epoll_event e;
+    int fd, rc;
+
+    fd = epoll_create1(EPOLL_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    memset(&e, 0, sizeof (e));
+    e.events = EPOLLIN;
+    e.data.fd = efd;
+    fail_on_goto(epoll_ctl(fd, EPOLL_CTL_ADD, efd, &e), rc, fail);
+    e.data.fd = sock;
+    fail_on_goto(epoll_ctl(fd, EPOLL_CTL_ADD, sock, &e), rc, fail);
+    return fd;
+
+fail:
+    close(fd);
+    return rc;
+}
+
+/*
+ * Channel setup. The listener produces on ring 0, the connecting end on
+ * ring 1. The channel owns the doorbells and @sock once set up.
+ */
+static int shm_chan_open(int memfd, const int *efds, int sock, int listener)
+{
+    struct shm_chan *c;
+    struct shm_ring *r0, *r1;
+    void *map;
+    int rc;
+
+    map = mmap(NULL, 2 * SHM_RING_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (map == MAP_FAILED) {
+        return -errno;
+    }
+    r0 = map;
+    r1 = (struct shm_ring *)((char *)map + SHM_RING_LEN);
+    if (listener) {
+        /* Consumers start out waiting for the first bytes. */
+        r0->rwait = 1;
+        r1->rwait = 1;
+    }
+
+    c = m_malloc(sizeof (*c));
+    c->map = map;
+    if (listener) {
+        c->tx = r0;
+        c->rx = r1;
+        c->tx_data = efds[SHM_D0];
+        c->tx_space = efds[SHM_S0];
+        c->rx_data = efds[SHM_D1];
+        c->rx_space = efds[SHM_S1];
+    } else {
+        c->tx = r1;
+        c->rx = r0;
+        c->tx_data = efds[SHM_D1];
+        c->tx_space = efds[SHM_S1];
+        c->rx_data = efds[SHM_D0];
+        c->rx_space = efds[SHM_S0];
+    }
+    c->sock = sock;
+    c->rd_wait = shm_wait_set(c->rx_data, sock);
+    if (c->rd_wait < 0) {
+        rc = c->rd_wait;
+        goto fail;
+    }
+    c->wr_wait = shm_wait_set(c->tx_space, sock);
+    if (c->wr_wait < 0) {
+        rc = c->wr_wait;
+        close(c->rd_wait);
+        goto fail;
+    }
+    shm_chan_set(c->rd_wait, c);
+    return c->rd_wait;
+
+fail:
+    munmap(map, 2 * SHM_RING_LEN);
+    free(c);
+    return rc;
+}
+
+static void shm_sockaddr(unsigned long port, struct sockaddr_un *sa, socklen_t *len)
+{
+    memset(sa, 0, sizeof (*sa));
+    sa->sun_family = AF_UNIX;
+    /* Abstract namespace, nothing to clean up. */
+    *len = offsetof(struct sockaddr_un, sun_path) + 1 +
+           snprintf(sa->sun_path + 1, sizeof (sa->sun_path) - 1, "v4cat-shm:%lu", port);
+}
+
+int shm_listen(unsigned long port)
+{
+    struct sockaddr_un sa;
+    socklen_t len;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -errno;
+    }
+    shm_sockaddr(port, &sa, &len);
+    if (bind(fd, (struct sockaddr *)&sa, len) || listen(fd, 16)) {
+        int rc = -errno;
+
+        close(fd);
+        return rc;
+    }
+    return fd;
+}
+
+int shm_accept(int lfd)
+{
+    int fds[1 + SHM_NFDS];
+    char cbuf[CMSG_SPACE(sizeof (fds))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    uint32_t size = SHM_RING_SIZE;
+    int i, sfd, rc;
+
+    sfd = accept(lfd, NULL, NULL);
+    if (sfd < 0) {
+        return -errno;
+    }
+    for (i = 0; i < 1 + SHM_NFDS; ++i) {
+        fds[i] = -1;
+    }
+    fds[0] = memfd_create("v4cat-shm", MFD_CLOEXEC);
+    fail_on_goto(fds[0] < 0, rc, out);
+    fail_on_goto(ftruncate(fds[0], 2 * SHM_RING_LEN), rc, out);
+    for (i = 1; i < 1 + SHM_NFDS; ++i) {
+        fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        fail_on_goto(fds[i] < 0, rc, out);
+    }
+
+    /* Rings are set up before the peer can see them. */
+    rc = shm_chan_open(fds[0], &fds[1], sfd, 1);
+    if (rc < 0) {
+        goto out;
+    }
+
+    memset(&msg, 0, sizeof (msg));
+    iov.iov_base = &size;
+    iov.iov_len = sizeof (size);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof (cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof (fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof (fds));
+    if (sendmsg(sfd, &msg, MSG_NOSIGNAL) != sizeof (size)) {
+        /* The channel owns the doorbells and the socket. */
+        shm_close(shm_chan_get(rc));
+        rc = -EPIPE;
+    }
+    close(fds[0]);
+    return rc;
+
+out:
+    for (i = 0; i < 1 + SHM_NFDS; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    close(sfd);
+    return rc;
+}
+
+int shm_connect(unsigned long port)
+{
+    int fds[1 + SHM_NFDS];
+    char cbuf[CMSG_SPACE(sizeof (fds))];
+    struct sockaddr_un sa;
+    socklen_t len;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    uint32_t size;
+    int i, sfd, rc;
+
+    sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sfd < 0) {
+        return -errno;
+    }
+    shm_sockaddr(port, &sa, &len);
+    fail_on_goto(connect(sfd, (struct sockaddr *)&sa, len), rc, fail);
+
+    memset(&msg, 0, sizeof (msg));
+    iov.iov_base = &size;
+    iov.iov_len = sizeof (size);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof (cbuf);
+    fail_on_goto(recvmsg(sfd, &msg, MSG_CMSG_CLOEXEC) != sizeof (size), rc, fail);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof (fds)) || size != SHM_RING_SIZE) {
+        rc = -EPROTO;
+        goto fail;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof (fds));
+
+    rc = shm_chan_open(fds[0], &fds[1], sfd, 0);
+    close(fds[0]);
+    if (rc < 0) {
+        for (i = 1; i < 1 + SHM_NFDS; ++i) {
+            close(fds[i]);
+        }
+        close(sfd);
+    }
+    return rc;
+
+fail:
+    close(sfd);
+    return rc;
+}
+
+/*
+ * Transport independent I/O, shm channels or plain fds.
+ */
+ssize_t xport_read(int fd, void *buf, size_t n)
+{
+    struct shm_chan *c = shm_chan_get(fd);
+
+    return c ? shm_read(c, buf, n) : read(fd, buf, n);
+}
+
+ssize_t xport_write(int fd, const void *buf, size_t n)
+{
+    struct shm_chan *c = shm_chan_get(fd);
+
+    return c ? shm_write(c, buf, n) : write(fd, buf, n);
+}
+
+ssize_t xport_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct shm_chan *c = shm_chan_get(fd);
+    ssize_t n, nw = 0;
+    int i;
+
+    if (!c) {
+        return writev(fd, iov, iovcnt);
+    }
+    for (i = 0; i < iovcnt; ++i) {
+        n = shm_write(c, iov[i].iov_base, iov[i].iov_len);
+        if (n < 0) {
+            return nw ? nw : n;
+        }
+        nw += n;
+        if ((size_t)n < iov[i].iov_len) {
+            break;
+        }
+    }
+    return nw;
+}
+
+int xport_close(int fd)
+{
+    struct shm_chan *c = shm_chan_get(fd);
+
+    if (c) {
+        shm_close(c);
+        return 0;
+    }
+    return close(fd);
+}
+
+int xport_shutdown_wr(int fd)
+{
+    struct shm_chan *c = shm_chan_get(fd);
+
+    if (c) {
+        __atomic_store_n(&c->tx->wclosed, 1, __ATOMIC_SEQ_CST);
+        doorbell_ring(c->tx_data);
+        return 0;
+    }
+    return shutdown(fd, SHUT_WR) ? -errno : 0;
+}
+
+int xport_wait_wr(int fd, short *events)
+{
+    struct shm_chan *c = shm_chan_get(fd);
+
+    if (c) {
+        *events = POLLIN;
+        shm_arm_space(c);
+        return c->wr_wait;
+    }
+    *events = POLLOUT;
+    return fd;
+}
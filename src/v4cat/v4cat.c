@@ -1,10 +1,72 @@
 #include "v4cat.h"
 
-#define fail_on_goto(cond, rc, label)   \
-    if (cond) {                         \
-        rc = -errno;                    \
-        goto label;                     \
+/*
+ * Refcounted data chunks. Data read once is shared by every pipe queue it is
+ * written to, the last reference frees it.
+ */
+#define CHUNK_SIZE  KB(16)
+
+struct chunk {
+    unsigned int ref;
+    size_t len;
+    char data[];
+};
+
+static struct chunk *chunk_alloc(size_t size)
+{
+    struct chunk *c;
+
+    c = m_malloc(sizeof (*c) + size);
+    c->ref = 1;
+    c->len = 0;
+    return c;
+}
+
+/*
+ * Chunks are read into at CHUNK_SIZE, give the unused tail back so what is
+ * queued is what is allocated.
+ */
+static struct chunk *chunk_trim(struct chunk *c, size_t len)
+{
+    c->len = len;
+    if (len < CHUNK_SIZE) {
+        c = m_realloc(c, sizeof (*c) + len);
+    }
+    return c;
+}
+
+static inline struct chunk *chunk_get(struct chunk *c)
+{
+    ++c->ref;
+    return c;
+}
+
+static inline void chunk_put(struct chunk *c)
+{
+    if (!--c->ref) {
+        free(c);
     }
+}
+
+/*
+ * Shutdown requests, from signals or when STDIN reaches EOF. A signal caught
+ * while draining abandons the drain.
+ */
+static unsigned int shutdown_requests = 0;
+static unsigned int shutdown_signals = 0;
+
+static void v4cat_request_shutdown(void)
+{
+    ++shutdown_requests;
+}
+
+static int v4cat_signal(struct evsignal *s)
+{
+    LOG("Caught signal %d, shutting down.", s->signo);
+    ++shutdown_signals;
+    v4cat_request_shutdown();
+    return 0;
+}
 
 /*
  * Simple pipe simplex representation.
@@ -15,6 +77,21 @@ struct pipe {
     int out;    /* output fd. */
     struct pipe *rev;   /* Optional reverse pipe (out <=> in). */
     void *owner;        /* Optional owner reference used for event/memory management. */
+
+    /* Output queue, only used when out is non-blocking (see pipe_set_queued()). */
+    struct event *flusher;  /* Write readiness event, armed while the queue is not empty. */
+    unsigned int flush_want;    /* Readiness the flusher waits for, depends on the transport. */
+    struct chunk **q;       /* Ring of queued chunks. */
+    unsigned int qhead, qcount, qslots;
+    size_t qoff;            /* Bytes of the head chunk already written. */
+    size_t qbytes;          /* Bytes pending. */
+    unsigned long long delivered;   /* Bytes accepted by out. */
+    struct timespec since;  /* When the output was queued, for throughput reports. */
+    struct list_head *pipes;    /* Pipes list, to find others sharing the input. */
+    int throttled;          /* Over PIPE_QUEUE_MAX, the input is paused. */
+    uint64_t throttled_since;   /* ns, see evloop_now(). */
+    int shut_wr;            /* Input reached EOF, shut the output down once drained. */
+    char tag[32];       /* Peer description for shutdown reports. */
 };
 
 static struct pipe *pipe_init(struct pipe *p, int in, int out)
@@ -24,6 +101,15 @@ static struct pipe *pipe_init(struct pipe *p, int in, int out)
     p->out = out;
     p->rev = NULL;
     p->owner = NULL;
+    p->flusher = NULL;
+    p->q = NULL;
+    p->qhead = p->qcount = p->qslots = 0;
+    p->qoff = p->qbytes = 0;
+    p->delivered = 0;
+    p->pipes = NULL;
+    p->throttled = p->shut_wr = 0;
+    p->throttled_since = 0;
+    p->tag[0] = '\0';
     return p;
 }
 
@@ -44,15 +130,94 @@ static void pipe_set_reverse(struct pipe *p, struct pipe *r)
     r->rev = p;
 }
 
+static inline size_t pipe_pending(const struct pipe *p)
+{
+    return p->qbytes;
+}
+
+/*
+ * Input backpressure: a queued pipe pauses its input while more than
+ * PIPE_QUEUE_MAX bytes are pending, the input is resumed once no pipe reading
+ * from it is over the limit.
+ */
+static void pipe_throttle(struct pipe *p)
+{
+    if (!p->throttled) {
+        p->throttled_since = evloop_now();
+    }
+    p->throttled = 1;
+    event_pause_fd(p->flusher->loop, p->in);
+}
+
+static void pipe_unthrottle(struct pipe *p)
+{
+    struct pipe *o;
+
+    p->throttled = 0;
+    list_for_each_entry(o, p->pipes, l) {
+        if (o->in == p->in && o->throttled) {
+            return;
+        }
+    }
+    /* Inputs stay paused once shutdown is requested. */
+    if (!shutdown_requests) {
+        event_resume_fd(p->flusher->loop, p->in);
+    }
+}
+
+/*
+ * Half-close the output, the peer reads EOF. v4v streams are not sockets and
+ * have no half-close, their peer only sees EOF when the pipe is released.
+ */
+static void pipe_shutdown_wr(struct pipe *p)
+{
+    int rc;
+
+    p->shut_wr = 0;
+    rc = xport_shutdown_wr(p->out);
+    if (rc && rc != -ENOTSOCK) {
+        LOG("%s: could not shut down output (%s).", p->tag, strerror(-rc));
+    }
+}
+
+/* The input reached EOF, shut the output down once the queue is drained. */
+static void pipe_set_eof(struct pipe *p)
+{
+    p->shut_wr = 1;
+    if (!pipe_pending(p)) {
+        pipe_shutdown_wr(p);
+    }
+}
+
 static void pipe_release(struct pipe *p)
 {
+    if (p->flusher) {
+        struct timespec now;
+        double secs;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        secs = (now.tv_sec - p->since.tv_sec) +
+               (now.tv_nsec - p->since.tv_nsec) / 1e9;
+        LOG("%s: %llu bytes delivered in %.3fs (%.2f MB/s), %zu abandoned.",
+            p->tag, p->delivered, secs,
+            secs > 0 ? p->delivered / secs / MB(1) : 0., pipe_pending(p));
+        if (p->throttled) {
+            pipe_unthrottle(p);
+        }
+        event_mark_release(p->flusher);
+    }
+    for (; p->qcount; --p->qcount) {
+        chunk_put(p->q[p->qhead]);
+        p->qhead = (p->qhead + 1) % p->qslots;
+    }
+    free(p->q);
     if (p->in != STDIN_FILENO && p->in != STDOUT_FILENO &&
         p->in != STDERR_FILENO) {
-        close(p->in);
+        xport_close(p->in);
     }
     if (p->out != STDIN_FILENO && p->out != STDOUT_FILENO &&
-        p->out != STDERR_FILENO) {
-        close(p->out);
+        p->out != STDERR_FILENO && p->out != p->in) {
+        xport_close(p->out);
     }
     free(p);
 }
@@ -68,144 +233,196 @@ static inline void pipe_flush(struct list_head *pipes)
     }
 }
 
-static ssize_t pipe_splice(struct pipe *p)
+/*
+ * Pipe output queue.
+ * Data the output could not take right away is queued and written back when
+ * select() reports it ready, so a slow peer does not stall the others and
+ * nothing is lost until the pipe is released. Past PIPE_QUEUE_MAX pending
+ * bytes the input is paused rather than queueing without bound.
+ */
+#define PIPE_QUEUE_MAX  MB(1)
+/* Seconds a broadcast client can stay over PIPE_QUEUE_MAX before it is dropped. */
+#define PIPE_STALL_TIMEOUT  10
+
+static int v4cat_flush(struct event *ev);
+
+static int pipe_set_queued(struct pipe *p, struct evloop *loop,
+                           struct list_head *pipes, const char *tag)
 {
-    char buf[1024];
-    ssize_t nr, nw;
+    int flags, fd;
+    short events;
 
-    //INF("%s() pipe : { .in=%d, .out=%d }", __FUNCTION__, p->in, p->out);
-    nr = read(p->in, buf, 1024);
-    switch (nr) {
-        case -1:
-            INF("%s() read failed (%s)", __FUNCTION__, strerror(errno));
-            return -errno;
-        case 0:
-            //INF("%s() nothing to read.", __FUNCTION__);
-            return 0;
-        default:
-            break;
+    flags = fcntl(p->out, F_GETFL);
+    if (flags < 0 || fcntl(p->out, F_SETFL, flags | O_NONBLOCK)) {
+        return -errno;
     }
-
-    nw = write(p->out, buf, nr);
-    switch (nw) {
-        case -1:
-            INF("%s() write failed (%s)", __FUNCTION__, strerror(errno));
-            return -errno;
-        case 0:
-            //INF("%s() write failed (%s)", __FUNCTION__, strerror(EAGAIN));
-            return -EAGAIN;
-        default:
-            break;
+    fd = xport_wait_wr(p->out, &events);
+    p->flush_want = (events & POLLIN) ? EV_READ : EV_WRITE;
+    p->flusher = event_alloc(fd, p, v4cat_flush);
+    if (!p->flusher) {
+        return -ENOMEM;
     }
-    //INF("%s() spliced %d bytes from %d to %d.", __FUNCTION__, nw, p->in, p->out);
-    return nw;
+    p->flusher->want = 0;
+    event_add(loop, p->flusher);
+    p->pipes = pipes;
+    snprintf(p->tag, sizeof (p->tag), "%s", tag);
+    clock_gettime(CLOCK_MONOTONIC, &p->since);
+    return 0;
 }
 
 /*
- * Event handling interface.
- * XXX: So why no libevent? Because I don't want to add dependencies and only a
- *      small subset of libevent would be used here.
+ * Queue a reference to @c, starting at @off, at the end of the pipe queue.
  */
-struct event {
-    struct list_head l;
-    int fd;
-    void *arg;
-    int (*ops)(struct event *ev);
-    int release;    /* Used to release events after the main event loop. */
-};
-
-static inline struct event *event_init(struct event *ev, int fd, void *arg,
-                                       int (*ev_ops)(struct event *))
-{
-    ev->fd = fd;
-    ev->arg = arg;
-    ev->ops = ev_ops;
-    ev->release = 0;
-    INIT_LIST_HEAD(&ev->l);
-    return ev;
-}
-
-static struct event *event_alloc(int fd, void *arg,
-                                 int (*ev_ops)(struct event *))
+static void pipe_queue(struct pipe *p, struct chunk *c, size_t off)
 {
-    struct event *ev;
+    if (p->qcount == p->qslots) {
+        unsigned int i, slots = p->qslots ? 2 * p->qslots : 16;
+        struct chunk **q;
 
-    ev = malloc(sizeof (*ev));
-    if (!ev) {
-        return NULL;
+        q = m_malloc(slots * sizeof (*q));
+        for (i = 0; i < p->qcount; ++i) {
+            q[i] = p->q[(p->qhead + i) % p->qslots];
+        }
+        free(p->q);
+        p->q = q;
+        p->qhead = 0;
+        p->qslots = slots;
     }
-    return event_init(ev, fd, arg, ev_ops);
-}
-
-static void event_add(struct event *new, struct list_head *evs)
-{
-    list_add_tail(&new->l, evs);
+    if (!p->qcount) {
+        p->qoff = off;
+    }
+    p->q[(p->qhead + p->qcount++) % p->qslots] = chunk_get(c);
+    p->qbytes += c->len - off;
+    p->flusher->want = p->flush_want;
 }
 
-static void event_del(struct event *ev)
+#define PIPE_FLUSH_IOV  16
+static ssize_t pipe_queue_flush(struct pipe *p)
 {
-    list_del(&ev->l);
-}
+    struct iovec iov[PIPE_FLUSH_IOV];
+    unsigned int i, n;
+    ssize_t nw, left;
 
-static void event_release(struct event *ev)
-{
-    free(ev);
-}
+    if (!pipe_pending(p)) {
+        return 0;
+    }
+    n = (p->qcount < PIPE_FLUSH_IOV) ? p->qcount : PIPE_FLUSH_IOV;
+    for (i = 0; i < n; ++i) {
+        struct chunk *c = p->q[(p->qhead + i) % p->qslots];
 
-static inline void event_flush(struct list_head *evs)
-{
-    struct event *e;
+        iov[i].iov_base = c->data;
+        iov[i].iov_len = c->len;
+    }
+    iov[0].iov_base = (char *)iov[0].iov_base + p->qoff;
+    iov[0].iov_len -= p->qoff;
 
-    while (!list_empty(evs)) {
-        e = list_entry(evs->next, struct event, l);
-        event_del(e);
-        event_release(e);
+    nw = xport_writev(p->out, iov, n);
+    if (nw < 0) {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -errno;
+    }
+    p->delivered += nw;
+    p->qbytes -= nw;
+    for (left = nw; left; ) {
+        struct chunk *c = p->q[p->qhead];
+        size_t rem = c->len - p->qoff;
+
+        if ((size_t)left < rem) {
+            p->qoff += left;
+            break;
+        }
+        left -= rem;
+        chunk_put(c);
+        p->qhead = (p->qhead + 1) % p->qslots;
+        --p->qcount;
+        p->qoff = 0;
+    }
+    if (!pipe_pending(p)) {
+        p->flusher->want = 0;
     }
+    return nw;
 }
 
-
-static int event_wait(struct list_head *evs, struct timeval *to)
+/*
+ * Write chunk @c to the pipe output. Queued pipes keep a reference to what
+ * could not be written, and pause their input once PIPE_QUEUE_MAX bytes are
+ * pending. Others block until everything is written.
+ */
+static ssize_t pipe_write(struct pipe *p, struct chunk *c)
 {
-    fd_set rfds;
-    int n, rc, nfds = 0;
-    struct event *ev = NULL, *tev = NULL;
-    struct timeval __to = { .tv_sec = to->tv_sec, .tv_usec = to->tv_usec };
+    ssize_t nw = 0;
 
-    FD_ZERO(&rfds);
-    list_for_each_entry_safe(ev, tev, evs, l) {
-        FD_SET(ev->fd, &rfds);
-        //INF("Select on fd %d.", ev->fd);
-        nfds = (nfds < ev->fd) ? ev->fd : nfds;
-    }
-    n = select(nfds + 1, &rfds, NULL, NULL, &__to);
-    if (n <= 0) {
-        return -errno;
-    }
-    //INF("Select returned %d fds after %us.", n, (unsigned int)__to.tv_sec);
+    if (!p->flusher) {
+        /* Short writes would drop the tail of the chunk, finish it here. */
+        while ((size_t)nw < c->len) {
+            ssize_t n;
 
-    list_for_each_entry_safe(ev, tev, evs, l) {
-        if (FD_ISSET(ev->fd, &rfds)) {
-            //INF("fd %d ready.", ev->fd);
-            rc = ev->ops(ev);
-            if (rc <= 0) {
-                //INF("event returned %d...", rc);
+            n = xport_write(p->out, c->data + nw, c->len - nw);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -errno;
             }
-            if (!--n) {
-                //INF("no more fd to process.");
-                /* No more fd to process. */
-                break;
+            if (!n) {
+                return -EAGAIN;
             }
+            nw += n;
         }
+        return nw;
     }
-    /* Release marked events. */
-    list_for_each_entry_safe(ev, tev, evs, l) {
-        if (ev->release) {
-            event_del(ev);
-            event_release(ev);
+
+    if (!pipe_pending(p)) {
+        nw = xport_write(p->out, c->data, c->len);
+        if (nw < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                return -errno;
+            }
+            nw = 0;
         }
+        p->delivered += nw;
     }
+    if ((size_t)nw < c->len) {
+        pipe_queue(p, c, nw);
+    }
+    if (pipe_pending(p) > PIPE_QUEUE_MAX) {
+        pipe_throttle(p);
+    }
+    return c->len;
+}
 
-    return 0;
+static ssize_t pipe_splice(struct pipe *p)
+{
+    struct chunk *c;
+    ssize_t nr, nw;
+
+    c = chunk_alloc(CHUNK_SIZE);
+    //INF("%s() pipe : { .in=%d, .out=%d }", __FUNCTION__, p->in, p->out);
+    nr = xport_read(p->in, c->data, CHUNK_SIZE);
+    switch (nr) {
+        case -1:
+            nr = (errno == EAGAIN || errno == EINTR) ? -EAGAIN : -errno;
+            if (nr != -EAGAIN) {
+                LOG("%s() read failed (%s)", __FUNCTION__, strerror(errno));
+            }
+            chunk_put(c);
+            return nr;
+        case 0:
+            //INF("%s() nothing to read.", __FUNCTION__);
+            chunk_put(c);
+            return 0;
+        default:
+            break;
+    }
+
+    c = chunk_trim(c, nr);
+    nw = pipe_write(p, c);
+    chunk_put(c);
+    if (nw < 0) {
+        LOG("%s() write failed (%s)", __FUNCTION__, strerror(-nw));
+        return nw;
+    }
+    //INF("%s() spliced %d bytes from %d to %d.", __FUNCTION__, nw, p->in, p->out);
+    return nw;
 }
 
 /*
@@ -275,12 +492,19 @@ static int v4v_connect(int fd, v4v_addr_t *peer)
 
 /*
  * v4v helpers.
+ * With --shm, the shared memory stand-in (shm.c) is used instead of v4v and
+ * the domid is ignored.
  */
+static int use_shm = 0;
+
 static int __v4v_socket_listen(unsigned long port)
 {
     int fd, rc;
     v4v_addr_t vaddr;
 
+    if (use_shm) {
+        return shm_listen(port);
+    }
     fd = v4v_socket_stream();
     if (fd < 0) {
         return fd;
@@ -302,6 +526,9 @@ static int __v4v_socket_connect(domid_t domid, unsigned long port)
     int fd, rc;
     v4v_addr_t /*vaddr, */vpeer;
 
+    if (use_shm) {
+        return shm_connect(port);
+    }
     fd = v4v_socket_stream();
     if (fd < 0) {
         return fd;
@@ -327,6 +554,74 @@ fail:
     return rc;
 }
 
+/*
+ * Release a pipe, its reverse and mark the events owning them.
+ */
+static void pipe_close(struct pipe *p)
+{
+    if (p->rev) {
+        list_del(&(p->rev->l));
+        if (p->rev->owner)
+            ((struct event *)(p->rev->owner))->release = 1;
+        pipe_release(p->rev);
+    }
+    list_del(&p->l);
+    if (p->owner)
+        ((struct event *)(p->owner))->release = 1;
+    pipe_release(p);
+}
+
+static int __v4v_socket_accept(int fd, v4v_addr_t *peer)
+{
+    int fd2;
+
+    if (use_shm) {
+        peer->domain = 0;
+        peer->port = 0;
+        fd2 = shm_accept(fd);
+        if (fd2 < 0) {
+            errno = -fd2;
+        }
+        return fd2;
+    }
+    return v4v_accept(fd, peer);
+}
+
+/*
+ * Non-blocking connect, returns -EINPROGRESS with a valid @fd when the
+ * connection completes later (the fd becomes writable).
+ */
+static int __v4v_socket_connect_async(domid_t domid, unsigned long port, int *fd)
+{
+    int rc, flags;
+    v4v_addr_t vpeer;
+
+    if (use_shm) {
+        /* Rendezvous is local and immediate. */
+        *fd = shm_connect(port);
+        return (*fd < 0) ? *fd : 0;
+    }
+    *fd = v4v_socket_stream();
+    if (*fd < 0) {
+        return *fd;
+    }
+    flags = fcntl(*fd, F_GETFL);
+    fail_on_goto(flags < 0, rc, fail);
+    fail_on_goto(fcntl(*fd, F_SETFL, flags | O_NONBLOCK) == -1, rc, fail);
+
+    vpeer.domain = domid;
+    vpeer.port = port;
+    rc = v4v_connect(*fd, &vpeer);
+    if (!rc || rc == -EINPROGRESS) {
+        return rc;
+    }
+
+fail:
+    close(*fd);
+    *fd = -1;
+    return rc;
+}
+
 /*
  * Splice pipe input in its output.
  */
@@ -336,17 +631,43 @@ static int v4cat_splice(struct event *ev)
     int rc;
 
     rc = pipe_splice(p);
+    if (rc == -EAGAIN) {
+        /* Spurious wake-up, the fd is non-blocking. */
+        return 1;
+    }
+    if (!rc && p->in == STDIN_FILENO) {
+        /* Half-close, the queue to the peer still has to be drained. */
+        ev->want &= ~EV_READ;
+        pipe_set_eof(p);
+        v4cat_request_shutdown();
+        return 0;
+    }
     if (rc <= 0) {
         /* Either failed or the other end has close() its fd. */
-        if (p->rev) {
-            list_del(&(p->rev->l));
-            if (p->rev->owner)
-                ((struct event *)(p->rev->owner))->release = 1;
-            pipe_release(p->rev);
-        }
-        list_del(&p->l);
-        pipe_release(p);
-        ev->release = 1;
+        pipe_close(p);
+    }
+    return rc;
+}
+
+/*
+ * Write queued data when the output is ready.
+ */
+static int v4cat_flush(struct event *ev)
+{
+    struct pipe *p = ev->arg;
+    ssize_t rc;
+
+    rc = pipe_queue_flush(p);
+    if (rc < 0) {
+        LOG("%s() write failed (%s)", __FUNCTION__, strerror(-rc));
+        pipe_close(p);
+        return rc;
+    }
+    if (p->throttled && pipe_pending(p) <= PIPE_QUEUE_MAX) {
+        pipe_unthrottle(p);
+    }
+    if (p->shut_wr && !pipe_pending(p)) {
+        pipe_shutdown_wr(p);
     }
     return rc;
 }
@@ -414,11 +735,12 @@ static int v4cat_accept(struct event *ev)
     struct event *rev;
     int fd, rc;
     v4v_addr_t peer = { .domain = 0, .port = 0 };
+    char tag[32];
 
-    fd = v4v_accept(ev->fd, &peer);
+    fd = __v4v_socket_accept(ev->fd, &peer);
     if (fd < 0) {
         rc = -errno;
-        INF("%s() failed (%s)", __FUNCTION__, strerror(errno));
+        LOG("%s() failed (%s)", __FUNCTION__, strerror(errno));
         return rc;
     }
 
@@ -428,11 +750,145 @@ static int v4cat_accept(struct event *ev)
         close(fd);
         return -ENOMEM;
     }
-    event_add(rev, &ev->l);
+    event_add(ev->loop, rev);
+
+    snprintf(tag, sizeof (tag), "dom%u:%u", peer.domain, peer.port);
+    rc = pipe_set_queued(((struct pipe *)rev->arg)->rev, ev->loop, pipes, tag);
+    if (rc) {
+        LOG("%s() could not queue output to %s (%s)", __FUNCTION__, tag, strerror(-rc));
+        pipe_close(rev->arg);
+        return rc;
+    }
+
+    return fd;
+}
+
+/*
+ * Accept new client and reflect everything it sends (ping responder).
+ */
+static int v4cat_accept_echo(struct event *ev)
+{
+    struct list_head *pipes = ev->arg;
+    struct event *rev;
+    int fd, rc;
+    v4v_addr_t peer = { .domain = 0, .port = 0 };
+    char tag[32];
+
+    fd = __v4v_socket_accept(ev->fd, &peer);
+    if (fd < 0) {
+        rc = -errno;
+        LOG("%s() failed (%s)", __FUNCTION__, strerror(errno));
+        return rc;
+    }
+    LOG("Echo for dom%u:%u.", peer.domain, peer.port);
+
+    rev = __pipe_event_alloc(fd, fd, v4cat_splice, pipes);
+    if (!rev) {
+        close(fd);
+        return -ENOMEM;
+    }
+    event_add(ev->loop, rev);
+
+    snprintf(tag, sizeof (tag), "dom%u:%u", peer.domain, peer.port);
+    rc = pipe_set_queued(rev->arg, ev->loop, pipes, tag);
+    if (rc) {
+        LOG("%s() could not queue output to %s (%s)", __FUNCTION__, tag, strerror(-rc));
+        pipe_close(rev->arg);
+        return rc;
+    }
 
     return fd;
 }
 
+/*
+ * Fan-out client: one connection per target, STDIN is broadcast to every
+ * connected one once all connects have completed or failed.
+ */
+struct fanout {
+    struct list_head pipes;
+    struct evloop *loop;
+    struct event *broadcast;
+    unsigned int pending;
+    unsigned int connected;
+    unsigned int failed;
+};
+
+struct fanout_target {
+    struct fanout *f;
+    domid_t domid;
+    unsigned long port;
+};
+
+static void fanout_resolved(struct fanout *f)
+{
+    if (--f->pending) {
+        return;
+    }
+    LOG("%u/%u targets connected.", f->connected, f->connected + f->failed);
+    if (!f->connected) {
+        v4cat_request_shutdown();
+        return;
+    }
+    f->broadcast->want = EV_READ;
+}
+
+static int fanout_join(struct fanout_target *t, int fd)
+{
+    struct fanout *f = t->f;
+    struct event *ev;
+    char tag[32];
+    int rc;
+
+    ev = __join_event_alloc(fd, STDIN_FILENO, STDOUT_FILENO,
+                            v4cat_splice, &f->pipes);
+    if (!ev) {
+        close(fd);
+        return -ENOMEM;
+    }
+    event_add(f->loop, ev);
+
+    snprintf(tag, sizeof (tag), "dom%u:%lu", t->domid, t->port);
+    rc = pipe_set_queued(((struct pipe *)ev->arg)->rev, f->loop, &f->pipes, tag);
+    if (rc) {
+        pipe_close(ev->arg);
+        return rc;
+    }
+    return 0;
+}
+
+/*
+ * Connection completion of a target.
+ */
+static int v4cat_connected(struct event *ev)
+{
+    struct fanout_target *t = ev->arg;
+    struct pollfd pfd = { .fd = ev->fd, .events = POLLOUT, .revents = 0 };
+    int err = 0;
+    socklen_t len = sizeof (err);
+
+    ev->release = 1;
+    /* v4v fds are not sockets, fall back on poll() error reporting. */
+    if (getsockopt(ev->fd, SOL_SOCKET, SO_ERROR, &err, &len)) {
+        err = 0;
+        if (poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLERR | POLLHUP))) {
+            err = ECONNREFUSED;
+        }
+    }
+    if (!err) {
+        err = -fanout_join(t, ev->fd);
+    } else {
+        close(ev->fd);
+    }
+    if (err) {
+        ERR("dom%u:%lu: connect failed (%s).", t->domid, t->port, strerror(err));
+        ++t->f->failed;
+    } else {
+        ++t->f->connected;
+    }
+    fanout_resolved(t->f);
+    return err ? -err : 1;
+}
+
 /*
  * Send STDIN to all clients.
  */
@@ -440,17 +896,34 @@ static int v4cat_broadcast(struct event *ev)
 {
     struct list_head *pipes = ev->arg;
     struct pipe *p, *tp;
-    char buf[1024];
-    int nr, nw;
+    struct chunk *c;
+    ssize_t nr, nw;
 
     /* If there is more, select() will tell us anyway. */
-    nr = read(ev->fd, buf, 1024);
+    c = chunk_alloc(CHUNK_SIZE);
+    nr = read(ev->fd, c->data, CHUNK_SIZE);
     if (nr < 0) {
-        return -errno;
+        nr = -errno;
+        chunk_put(c);
+        return nr;
+    }
+    if (!nr) {
+        /* Stop reading STDIN, clients still have to be drained. */
+        chunk_put(c);
+        ev->want &= ~EV_READ;
+        list_for_each_entry(p, pipes, l) {
+            if (p->in == STDIN_FILENO && p->flusher) {
+                pipe_set_eof(p);
+            }
+        }
+        v4cat_request_shutdown();
+        return 0;
     }
+    c = chunk_trim(c, nr);
 
     if (list_empty(pipes)) {
-        INF("No client yet.");
+        LOG("No client yet.");
+        chunk_put(c);
         /* We always return >0 to make this event persistent. */
         return 1;
     }
@@ -461,7 +934,7 @@ static int v4cat_broadcast(struct event *ev)
             p = tp;
             continue;
         }
-        nw = write(p->out, buf, nr);
+        nw = pipe_write(p, c);
         if (nw != nr) {
             /* The other end closed or we failed, anyway release. */
             /* Keep next pointer valid. */
@@ -469,53 +942,199 @@ static int v4cat_broadcast(struct event *ev)
                 tp = list_entry(tp->l.next, struct pipe, l);
             }
             /* Remove the v4cat_splice event recv end of the pipe. */
-            ((struct event *)(p->owner))->release = 1;
-            list_del(&(p->rev->l));
-            list_del(&p->l);
-            pipe_release(p->rev);
-            pipe_release(p);
+            pipe_close(p);
         }
         p = tp;
     }
+    chunk_put(c);
     /* We always return >0 to make this event persistent. */
     return 1;
 }
 
+/*
+ * Broadcast clients share STDIN, the slowest one paces the others. Drop those
+ * that made no room for PIPE_STALL_TIMEOUT seconds.
+ */
+static int v4cat_stalled(struct timer *t)
+{
+    struct list_head *pipes = t->arg;
+    struct pipe *p;
+    uint64_t now = evloop_now();
+
+again:
+    list_for_each_entry(p, pipes, l) {
+        if (p->throttled &&
+            now - p->throttled_since > PIPE_STALL_TIMEOUT * 1000000000ULL) {
+            WAR("%s: stalled for %us, dropped.", p->tag, PIPE_STALL_TIMEOUT);
+            pipe_close(p);
+            goto again;
+        }
+    }
+    return 0;
+}
+
+static int v4cat_watch_stalls(struct evloop *loop, struct list_head *pipes)
+{
+    struct timer *t;
+
+    t = timer_alloc(1000000000ULL, 1000000000ULL, pipes, v4cat_stalled);
+    if (!t) {
+        return -ENOMEM;
+    }
+    timer_add(loop, t);
+    return 0;
+}
+
+/*
+ * Event loop with shutdown requested on SIGINT, SIGTERM and SIGHUP.
+ */
+static int v4cat_loop_init(struct evloop *loop)
+{
+    static const int sigs[] = { SIGINT, SIGTERM, SIGHUP };
+    struct evsignal *s;
+    unsigned int i;
+    int rc;
+
+    rc = evloop_init(loop);
+    if (rc) {
+        return rc;
+    }
+    for (i = 0; i < ARRAY_LEN(sigs); ++i) {
+        s = evsignal_alloc(sigs[i], NULL, v4cat_signal);
+        if (!s) {
+            evloop_fini(loop);
+            return -ENOMEM;
+        }
+        rc = evsignal_add(loop, s);
+        if (rc) {
+            free(s);
+            evloop_fini(loop);
+            return rc;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Main loop, then orderly shutdown once requested:
+ * - stop accepting on @lfd (if any) and stop reading STDIN,
+ * - keep servicing events until every pipe queue is empty, for @drain seconds
+ *   at most or until another signal is caught,
+ * - pipes report delivered/abandoned bytes when released by the caller.
+ */
+static size_t pipes_pending(struct list_head *pipes)
+{
+    struct pipe *p;
+    size_t n = 0;
+
+    list_for_each_entry(p, pipes, l) {
+        n += pipe_pending(p);
+    }
+    return n;
+}
+
+static int v4cat_drain_expired(struct timer *t)
+{
+    *(int *)t->arg = 1;
+    return 0;
+}
+
+static int v4cat_run(struct evloop *loop, struct list_head *pipes,
+                     int lfd, unsigned long drain)
+{
+    struct timeval to = { .tv_sec = 30, .tv_usec = 0 };
+    struct timer *deadline;
+    unsigned int signals;
+    int rc, expired = 0;
+
+    do {
+        rc = evloop_wait(loop, &to);
+        if (rc == -EINTR) {
+            rc = 0;
+        }
+    } while (!rc && !shutdown_requests && evloop_has_events(loop));
+    if (rc || !evloop_has_events(loop)) {
+        return rc;
+    }
+
+    event_pause_fd(loop, STDIN_FILENO);
+    if (lfd >= 0) {
+        event_pause_fd(loop, lfd);
+    }
+    if (!pipes_pending(pipes)) {
+        return 0;
+    }
+    LOG("Draining %zuB within %lus.", pipes_pending(pipes), drain);
+
+    deadline = timer_alloc(drain * 1000000000ULL, 0, &expired, v4cat_drain_expired);
+    if (!deadline) {
+        return -ENOMEM;
+    }
+    timer_add(loop, deadline);
+    signals = shutdown_signals;
+    while (!rc && pipes_pending(pipes) && shutdown_signals == signals && !expired) {
+        rc = evloop_wait(loop, &to);
+        if (rc == -EINTR) {
+            rc = 0;
+        }
+    }
+    if (expired) {
+        WAR("Drain deadline reached.");
+    } else {
+        if (shutdown_signals != signals) {
+            WAR("Drain abandoned.");
+        }
+        timer_cancel(deadline);
+    }
+
+    return rc;
+}
+
 /*
  * Server side.
  */
-static int v4cat_listen(unsigned long port)
+static int v4cat_listen(unsigned long port, int echo, unsigned long drain)
 {
     int rc, fd;
     struct list_head pipes;     /* List of pipes to clients (accepted ones). */
-    struct list_head events;    /* List of events to be managed. */
+    struct evloop loop;         /* Events to be managed. */
     struct event *accept, *broadcast;
-    struct timeval to = { .tv_sec = 30, .tv_usec = 0 };
 
     fd = __v4v_socket_listen(port);
     if (fd < 0) {
         return fd;
     }
 
+    rc = v4cat_loop_init(&loop);
+    if (rc) {
+        close(fd);
+        return rc;
+    }
     INIT_LIST_HEAD(&pipes);
-    /* Read from STDIN only and broadcast to every client. */
-    accept = event_alloc(STDIN_FILENO, &pipes, v4cat_broadcast);
-    //event_init(&broadcast, STDIN_FILENO, &pipes, v4cat_broadcast);
-    /* Accept inbound connection requests. */
-    broadcast = event_alloc(fd, &pipes, v4cat_accept);
-    //event_init(&accept, fd, &pipes, v4cat_accept);
-
-    INIT_LIST_HEAD(&events);
-    event_add(broadcast, &events);
-    event_add(accept, &events);
+    if (echo) {
+        /* Clients are only talking to themselves, STDIN is not used. */
+        accept = event_alloc(fd, &pipes, v4cat_accept_echo);
+        event_add(&loop, accept);
+    } else {
+        /* Read from STDIN only and broadcast to every client. */
+        broadcast = event_alloc(STDIN_FILENO, &pipes, v4cat_broadcast);
+        //event_init(&broadcast, STDIN_FILENO, &pipes, v4cat_broadcast);
+        /* Accept inbound connection requests. */
+        accept = event_alloc(fd, &pipes, v4cat_accept);
+        //event_init(&accept, fd, &pipes, v4cat_accept);
+
+        event_add(&loop, accept);
+        event_add(&loop, broadcast);
+        rc = v4cat_watch_stalls(&loop, &pipes);
+    }
 
-    do {
-        rc = event_wait(&events, &to);
-    } while (!rc);
+    if (!rc) {
+        rc = v4cat_run(&loop, &pipes, fd, drain);
+    }
 
     /* Cleanup. */
     pipe_flush(&pipes);
-    event_flush(&events);
+    evloop_fini(&loop);
     close(fd);
 
     return rc;
@@ -524,16 +1143,17 @@ static int v4cat_listen(unsigned long port)
 /*
  * Client side.
  */
-static int v4cat_connect(domid_t domid, unsigned long port)
+static int v4cat_connect(domid_t domid, unsigned long port, unsigned long drain)
 {
     int rc, fd;
-    struct list_head events, pipes;
+    struct list_head pipes;
+    struct evloop loop;
     struct event *in, *out;
-    struct timeval to = { .tv_sec = 30, .tv_usec = 0 };
+    char tag[32];
 
     fd = __v4v_socket_connect(domid, port);
     if (fd < 0) {
-        return -errno;
+        return fd;
     }
 
     INIT_LIST_HEAD(&pipes);
@@ -541,17 +1161,118 @@ static int v4cat_connect(domid_t domid, unsigned long port)
     out = __pipe_event_alloc(STDIN_FILENO, fd, v4cat_splice, &pipes);
     pipe_set_reverse(in->arg, out->arg);
 
-    INIT_LIST_HEAD(&events);
-    event_add(in, &events);
-    event_add(out, &events);
+    rc = v4cat_loop_init(&loop);
+    if (rc) {
+        pipe_flush(&pipes);
+        return rc;
+    }
+    event_add(&loop, in);
+    event_add(&loop, out);
 
-    do {
-        rc = event_wait(&events, &to);
-    } while (!rc && !list_empty(&events));
+    snprintf(tag, sizeof (tag), "dom%u:%lu", domid, port);
+    rc = pipe_set_queued(out->arg, &loop, &pipes, tag);
+    if (!rc) {
+        rc = v4cat_run(&loop, &pipes, -1, drain);
+    }
 
     /* Cleanup. */
     pipe_flush(&pipes);
-    event_flush(&events);
+    evloop_fini(&loop);
+    close(fd);
+
+    return rc;
+}
+
+/*
+ * Fan-out client side.
+ */
+static int v4cat_fanout(struct fanout_target *targets, unsigned int n,
+                        unsigned long drain)
+{
+    struct evloop loop;
+    struct fanout f;
+    struct event *ev;
+    unsigned int i;
+    int rc, fd;
+
+    rc = v4cat_loop_init(&loop);
+    if (rc) {
+        return rc;
+    }
+    INIT_LIST_HEAD(&f.pipes);
+    f.loop = &loop;
+    f.pending = n;
+    f.connected = f.failed = 0;
+
+    /* Dormant until every connect is resolved. */
+    f.broadcast = event_alloc(STDIN_FILENO, &f.pipes, v4cat_broadcast);
+    if (!f.broadcast) {
+        evloop_fini(&loop);
+        return -ENOMEM;
+    }
+    f.broadcast->want = 0;
+    event_add(&loop, f.broadcast);
+    rc = v4cat_watch_stalls(&loop, &f.pipes);
+    if (rc) {
+        evloop_fini(&loop);
+        return rc;
+    }
+
+    for (i = 0; i < n; ++i) {
+        targets[i].f = &f;
+        rc = __v4v_socket_connect_async(targets[i].domid, targets[i].port, &fd);
+        if (!rc) {
+            rc = fanout_join(&targets[i], fd);
+        } else if (rc == -EINPROGRESS) {
+            ev = event_alloc(fd, &targets[i], v4cat_connected);
+            if (ev) {
+                ev->want = EV_WRITE;
+                event_add(&loop, ev);
+                continue;
+            }
+            close(fd);
+            rc = -ENOMEM;
+        }
+        if (rc) {
+            ERR("dom%u:%lu: connect failed (%s).", targets[i].domid,
+                targets[i].port, strerror(-rc));
+            ++f.failed;
+        } else {
+            ++f.connected;
+        }
+        fanout_resolved(&f);
+    }
+
+    rc = v4cat_run(&loop, &f.pipes, -1, drain);
+    if (!rc && !f.connected) {
+        rc = -ENOTCONN;
+    }
+
+    /* Cleanup, pending connects still own their fd. */
+    pipe_flush(&f.pipes);
+    list_for_each_entry(ev, &loop.events, l) {
+        if (ev->ops == v4cat_connected && !ev->release) {
+            close(ev->fd);
+        }
+    }
+    evloop_fini(&loop);
+
+    return rc;
+}
+
+/*
+ * Latency probes, client side.
+ */
+static int v4cat_probe(domid_t domid, unsigned long port,
+                       const struct ping_opts *o)
+{
+    int rc, fd;
+
+    fd = __v4v_socket_connect(domid, port);
+    if (fd < 0) {
+        return fd;
+    }
+    rc = v4cat_ping(fd, o);
     close(fd);
 
     return rc;
@@ -564,10 +1285,23 @@ static int usage(int rc)
 {
     INF("Basic usages:");
     INF("v4cat [options] domid port");
+    INF("v4cat [options] domid port [domid port ...]");
     INF("v4cat -l -p local_port");
+    INF("v4cat -P [-s size] [-r rate] [-c count] [-w window] domid port");
+    INF("v4cat -l -e -p local_port");
     INF("Options:");
     INF("	-l, --listen	listen mode, for inbound connects.");
     INF("	-p, --port	local port number");
+    INF("	-P, --ping	send latency probes to an echo responder.");
+    INF("	-e, --echo	with -l, reflect everything received (ping responder).");
+    INF("	-s, --size	probe size in bytes (default %u).", PING_DEFAULT_SIZE);
+    INF("	-r, --rate	probes per second, 0 is unpaced (default %u).", PING_DEFAULT_RATE);
+    INF("	-c, --count	probes per series (default %u).", PING_DEFAULT_COUNT);
+    INF("	-w, --window	largest in-flight window of the load series (default %u).",
+        PING_DEFAULT_WINDOW);
+    INF("	-S, --shm	use the local shared memory stand-in instead of v4v, domid is ignored.");
+    INF("	-t, --drain-timeout	seconds allowed to flush pending output on shutdown (default %u).",
+        V4CAT_DRAIN_TIMEOUT);
 
     return rc;
 }
@@ -576,10 +1310,18 @@ static int usage(int rc)
  * Supported options, assumes there is always a short format for every long
  * one.
  */
-#define OPT_STR "hlp:"
+#define OPT_STR "hlp:SPes:r:c:w:t:"
 static struct option long_options[] = {
     { "listen",   no_argument,          0,  'l' },
     { "port",     required_argument,    0,  'p' },
+    { "shm",      no_argument,          0,  'S' },
+    { "ping",     no_argument,          0,  'P' },
+    { "echo",     no_argument,          0,  'e' },
+    { "size",     required_argument,    0,  's' },
+    { "rate",     required_argument,    0,  'r' },
+    { "count",    required_argument,    0,  'c' },
+    { "window",   required_argument,    0,  'w' },
+    { "drain-timeout", required_argument, 0, 't' },
     { "help",     no_argument,          0,  'h' },
     { 0,            0,                  0,  0 },
 };
@@ -595,7 +1337,18 @@ int main(int argc, char *argv[])
     unsigned long local_port = 0;
     unsigned long port = 0;
     int listen = 0;
+    int ping = 0, echo = 0;
+    unsigned long drain = V4CAT_DRAIN_TIMEOUT;
+    unsigned long size = PING_DEFAULT_SIZE;
+    struct ping_opts popts = {
+        .size = PING_DEFAULT_SIZE,
+        .rate = PING_DEFAULT_RATE,
+        .count = PING_DEFAULT_COUNT,
+        .window = PING_DEFAULT_WINDOW,
+    };
     domid_t domid = V4V_DOMID_NONE;
+    struct fanout_target *targets = NULL;
+    unsigned int ntargets = 0;
 
     if (argc < 1) {
         return usage(EINVAL);
@@ -631,6 +1384,52 @@ int main(int argc, char *argv[])
                 }
                 continue;
 
+            case 'S':
+                use_shm = 1;
+                continue;
+            case 'P':
+                ping = 1;
+                continue;
+            case 'e':
+                echo = 1;
+                continue;
+            case 's':
+                rc = parse_ul(optarg, &size);
+                if (rc) {
+                    ERR("Invalid probe size %s.", optarg);
+                    return -rc;
+                }
+                popts.size = size;
+                continue;
+            case 'r':
+                rc = parse_ul(optarg, &popts.rate);
+                if (rc) {
+                    ERR("Invalid probe rate %s.", optarg);
+                    return -rc;
+                }
+                continue;
+            case 'c':
+                rc = parse_ul(optarg, &popts.count);
+                if (rc || !popts.count) {
+                    ERR("Invalid probe count %s.", optarg);
+                    return rc ? -rc : EINVAL;
+                }
+                continue;
+            case 'w':
+                rc = parse_ul(optarg, &popts.window);
+                if (rc || !popts.window) {
+                    ERR("Invalid probe window %s.", optarg);
+                    return rc ? -rc : EINVAL;
+                }
+                continue;
+            case 't':
+                rc = parse_ul(optarg, &drain);
+                if (rc) {
+                    ERR("Invalid drain timeout %s.", optarg);
+                    return -rc;
+                }
+                continue;
+
             default:
                 ERR("Unknown option '%c'.", opt);
                 return usage(EINVAL);
@@ -650,8 +1449,28 @@ getopt_done:
                 return -rc;
             }
             //INF("port=%lu", port);
+        } else if (listen || ping) {
+            LOG("%s not handled...", argv[optind++]);
         } else {
-            INF("%s not handled...", argv[optind++]);
+            /* More domid port pairs, fan-out to every target. */
+            if (!ntargets) {
+                targets = m_malloc(sizeof (*targets));
+                targets[0].domid = domid;
+                targets[0].port = port;
+                ntargets = 1;
+            }
+            targets = m_realloc(targets, (ntargets + 1) * sizeof (*targets));
+            rc = parse_domid(argv[optind++], &targets[ntargets].domid);
+            if (rc || optind >= argc) {
+                ERR("Invalid target %s.", argv[optind - 1]);
+                return rc ? -rc : EINVAL;
+            }
+            rc = parse_ul(argv[optind++], &targets[ntargets].port);
+            if (rc || !is_valid_port(targets[ntargets].port)) {
+                ERR("Invalid port %s.", argv[optind - 1]);
+                return rc ? -rc : EINVAL;
+            }
+            ++ntargets;
         }
     }
 
@@ -670,16 +1489,40 @@ getopt_done:
         ERR("Missing port.");
         return EINVAL;
     }
+    if (echo && !listen) {
+        ERR("--echo requires --listen.");
+        return EINVAL;
+    }
+    if (ping && listen) {
+        ERR("--ping is a client mode, use --echo with --listen.");
+        return EINVAL;
+    }
+
+    /* Dead peers are reported by write() instead. */
+    signal(SIGPIPE, SIG_IGN);
 
     if (listen) {
-        INF("Open listening socket on <any>:%lu.", local_port);
-        rc = v4cat_listen(local_port);
+        LOG("Open %slistening socket on <any>:%lu.", echo ? "echo " : "", local_port);
+        rc = v4cat_listen(local_port, echo, drain);
         if (rc) {
             ERR("Error:%s", strerror(-rc));
         }
+    } else if (ping) {
+        LOG("Probe dom%u:%lu.", domid, port);
+        rc = v4cat_probe(domid, port, &popts);
+        if (rc) {
+            ERR("Error: %s", strerror(-rc));
+        }
+    } else if (ntargets) {
+        LOG("Open sockets to %u targets.", ntargets);
+        rc = v4cat_fanout(targets, ntargets, drain);
+        if (rc) {
+            ERR("Error: %s", strerror(-rc));
+        }
+        free(targets);
     } else {
-        INF("Open socket to dom%u:%lu.", domid, port);
-        rc = v4cat_connect(domid, port);
+        LOG("Open socket to dom%u:%lu.", domid, port);
+        rc = v4cat_connect(domid, port, drain);
         if (rc) {
             ERR("Error: %s", strerror(-rc));
         }
@@ -75,6 +75,42 @@
 #  include <fcntl.h>
 # endif
 
+# ifdef HAVE_POLL_H
+#  include <poll.h>
+# endif
+
+# ifdef HAVE_TIME_H
+#  include <time.h>
+# endif
+
+# ifdef HAVE_SYS_TIME_H
+#  include <sys/time.h>
+# endif
+
+# ifdef HAVE_SIGNAL_H
+#  include <signal.h>
+# endif
+
+# ifdef HAVE_SYS_UIO_H
+#  include <sys/uio.h>
+# endif
+
+# ifdef HAVE_SYS_SOCKET_H
+#  include <sys/socket.h>
+# endif
+
+# ifdef HAVE_SYS_UN_H
+#  include <sys/un.h>
+# endif
+
+# ifdef HAVE_SYS_EVENTFD_H
+#  include <sys/eventfd.h>
+# endif
+
+# ifdef HAVE_SYS_EPOLL_H
+#  include <sys/epoll.h>
+# endif
+
 /*
 # ifdef HAVE_XENCTRL_H
 #  include <xenctrl.h>
@@ -97,6 +133,7 @@
 # endif
 
 # include "list.h"
+# include "evloop.h"
 
 static inline int parse_domid(const char *nptr, domid_t *domid)
 {
@@ -120,5 +157,51 @@ static inline int parse_domid(const char *nptr, domid_t *domid)
 # define M_TAG "v4cat: "
 # include "utils.h"
 
+/* Status lines, stdout carries the data. */
+# define LOG(fmt, ...) fprintf(stderr, M_TAG "%s:%d: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+
+# define fail_on_goto(cond, rc, label)  \
+    if (cond) {                         \
+        rc = -errno;                    \
+        goto label;                     \
+    }
+
+/*
+ * Shared memory stand-in transport (shm.c) and transport independent I/O,
+ * for fds returned by either v4v or shm helpers.
+ */
+int shm_listen(unsigned long port);
+int shm_accept(int lfd);
+int shm_connect(unsigned long port);
+
+ssize_t xport_read(int fd, void *buf, size_t n);
+ssize_t xport_write(int fd, const void *buf, size_t n);
+ssize_t xport_writev(int fd, const struct iovec *iov, int iovcnt);
+int xport_close(int fd);
+/* Half-close, the peer reads EOF once it consumed what was written. */
+int xport_shutdown_wr(int fd);
+/* fd and poll() events to wait on until @fd can be written to. */
+int xport_wait_wr(int fd, short *events);
+
+/* Seconds allowed to flush pending output once shutdown is requested. */
+# define V4CAT_DRAIN_TIMEOUT    5
+
+/*
+ * Round-trip latency probes (ping.c).
+ */
+struct ping_opts {
+    size_t size;            /* Probe size in bytes, header included. */
+    unsigned long rate;     /* Probes per second for the latency series, 0 is unpaced. */
+    unsigned long count;    /* Probes per series. */
+    unsigned long window;   /* Largest in-flight window of the load series. */
+};
+
+# define PING_DEFAULT_SIZE      64
+# define PING_DEFAULT_RATE      100
+# define PING_DEFAULT_COUNT     1000
+# define PING_DEFAULT_WINDOW    64
+
+int v4cat_ping(int fd, const struct ping_opts *o);
+
 #endif /* _V4CAT_H_ */
 